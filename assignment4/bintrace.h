@@ -0,0 +1,38 @@
+/*
+ * bintrace.h - Layout of a binary trace: the requests of a .rep trace
+ *     as fixed-width records after a header, which rep2bin writes and
+ *     mdriver replays.  mdriver maps the file and decodes the records
+ *     a chunk at a time as the replay reaches them, so a trace of any
+ *     length starts at once and is never held in memory whole.  Sizes
+ *     and counts are 64 bits wide.
+ */
+#include <stdint.h>
+
+#define BINTRACE_MAGIC 0x6d6d726570620001UL
+
+/* Requests */
+#define BINTRACE_ALLOC 0
+#define BINTRACE_FREE 1
+#define BINTRACE_MEMALIGN 2        /* align is 1 << align_shift */
+#define BINTRACE_CALLOC 3
+
+/* Header flags */
+#define BINTRACE_HAS_CALLOC 1      /* some request is a calloc */
+
+typedef struct {
+  uint64_t magic;
+  uint64_t heap_size;            /* suggested heap size (unused) */
+  uint64_t num_ids;              /* block ids are 0 to num_ids - 1 */
+  uint64_t num_ops;              /* records after the header */
+  uint64_t weight;               /* (unused) */
+  uint64_t num_threads;          /* 1 + the highest thread id */
+  uint64_t flags;                /* BINTRACE_HAS_CALLOC */
+} bintrace_header_t;
+
+typedef struct {
+  uint64_t size;                 /* payload bytes; 0 for a free */
+  uint32_t id;                   /* block id */
+  uint16_t thread;               /* thread that makes the request */
+  uint8_t op;                    /* BINTRACE_ALLOC, ... */
+  uint8_t align_shift;           /* memalign: log2 of the alignment */
+} bintrace_record_t;
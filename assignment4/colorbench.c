@@ -0,0 +1,193 @@
+/*
+ * colorbench.c - Measures what cache-index coloring of large blocks
+ *     (MM_OPT_COLORING in mm.c) buys a loop that streams through
+ *     several large mm_malloc buffers at once.
+ *
+ * The buffers are sized so that, uncolored, they all start at the
+ * same offset within a page.  The kernel then adds pairs of buffers
+ * into the last one, so every iteration loads from and stores to
+ * addresses that share their low 12 bits: the loads falsely depend on
+ * the earlier stores (4K aliasing), and the buffers compete for the
+ * same L1 sets.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define MAX_BUFFERS 64
+
+/* Parameters (set by the command line) */
+static int num_buffers = 8;       /* buffers streamed at once */
+static size_t buffer_size = 256 * 1024 - 8; /* payload bytes of each */
+static int passes = 200;          /* times the kernel runs per trial */
+static int trials = 5;            /* trials per mode; the best one counts */
+
+static double *buffers[MAX_BUFFERS];
+
+static void usage(void);
+
+/*
+ * now - current time in seconds
+ */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * stream - store the sum of each pair of neighbouring buffers among
+ *     0..n-2 into buffer n-1, passes times
+ */
+static void stream(int n, size_t len)
+{
+    double *dst = buffers[n - 1];
+    double *a, *b;
+    size_t i;
+    int k, pass;
+
+    for (pass = 0; pass < passes; pass++) {
+	for (k = 0; k + 1 < n - 1; k++) {
+	    a = buffers[k];
+	    b = buffers[k + 1];
+	    for (i = 0; i < len; i++)
+		dst[i] = a[i] + b[i];
+	}
+    }
+}
+
+/*
+ * run - allocate the buffers on a fresh heap, with coloring on or off,
+ *     and return the secs the kernel took
+ */
+static double run(int coloring)
+{
+    size_t len = buffer_size / sizeof(double);
+    double start, secs;
+    size_t i;
+    int b;
+
+    mem_reset_brk();
+    if (mm_init() < 0) {
+	fprintf(stderr, "mm_init failed\n");
+	exit(1);
+    }
+    mm_mallopt(MM_OPT_COLORING, coloring);
+
+    for (b = 0; b < num_buffers; b++) {
+	if ((buffers[b] = mm_malloc(buffer_size)) == NULL) {
+	    fprintf(stderr, "mm_malloc failed\n");
+	    exit(1);
+	}
+	for (i = 0; i < len; i++)
+	    buffers[b][i] = b + i;
+    }
+
+    stream(num_buffers, len); /* warm up */
+    start = now();
+    stream(num_buffers, len);
+    secs = now() - start;
+
+    for (b = 0; b < num_buffers; b++)
+	mm_free(buffers[b]);
+    return secs;
+}
+
+/*
+ * print_offsets - show where within a page each buffer starts
+ */
+static void print_offsets(int coloring)
+{
+    int b;
+
+    printf("%-10s page offsets:", coloring ? "colored" : "uncolored");
+    for (b = 0; b < num_buffers; b++)
+	printf(" %4lu", (unsigned long)((size_t)buffers[b] % 4096));
+    printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    int c, t;
+    double plain = 0, colored = 0, secs, bytes;
+
+    while ((c = getopt(argc, argv, "n:s:r:t:h")) != EOF) {
+	switch (c) {
+	case 'n':
+	    num_buffers = atoi(optarg);
+	    break;
+	case 's':
+	    buffer_size = strtoul(optarg, NULL, 0);
+	    break;
+	case 'r':
+	    passes = atoi(optarg);
+	    break;
+	case 't':
+	    trials = atoi(optarg);
+	    break;
+	case 'h':
+	    usage();
+	    exit(0);
+	default:
+	    usage();
+	    exit(1);
+	}
+    }
+    if (num_buffers < 3 || num_buffers > MAX_BUFFERS ||
+	buffer_size < sizeof(double) || passes < 1 || trials < 1) {
+	usage();
+	exit(1);
+    }
+
+    /* Alternate the modes, so that warm-up and frequency changes do
+       not favor either one, and keep the best time of each */
+    mem_init();
+    for (t = 0; t < trials; t++) {
+	secs = run(0);
+	if (t == 0)
+	    print_offsets(0);
+	if (t == 0 || secs < plain)
+	    plain = secs;
+	secs = run(1);
+	if (t == 0)
+	    print_offsets(1);
+	if (t == 0 || secs < colored)
+	    colored = secs;
+    }
+    mem_deinit();
+
+    /* each sum reads two buffers and writes a third */
+    bytes = (double)passes * buffer_size * 3 * (num_buffers - 2);
+    printf("%d buffers of %lu bytes, %d passes, best of %d\n",
+	   num_buffers, (unsigned long)buffer_size, passes, trials);
+    printf("%10s%10s%8s\n", "", "secs", "GB/s");
+    printf("%10s%10.4f%8.2f\n", "uncolored", plain, bytes / 1e9 / plain);
+    printf("%10s%10.4f%8.2f\n", "colored", colored, bytes / 1e9 / colored);
+    printf("speedup %.2fx\n", plain / colored);
+    exit(0);
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: colorbench [-h] [-n <buffers>] [-s <bytes>] "
+	    "[-r <passes>] [-t <trials>]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-h           Print this message.\n");
+    fprintf(stderr, "\t-n <buffers> Stream through this many buffers "
+	    "(default 8).\n");
+    fprintf(stderr, "\t-s <bytes>   Payload size of each buffer "
+	    "(default 262136).\n");
+    fprintf(stderr, "\t-r <passes>  Passes over the buffers per trial "
+	    "(default 200).\n");
+    fprintf(stderr, "\t-t <trials>  Trials per mode, best one counts "
+	    "(default 5).\n");
+}
@@ -58,7 +58,9 @@
 /* 
  * Maximum heap size in bytes 
  */
+#ifndef MAX_HEAP
 #define MAX_HEAP (20*(1<<20))  /* 20 MB */
+#endif
 
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
@@ -0,0 +1,224 @@
+/*
+ * fastmem.c - bulk memory routines used by the allocator.
+ *
+ *    Small requests go to the libc routines.  Past NT_THRESHOLD bytes
+ *    (roughly the size of a last-level cache slice) we switch to
+ *    non-temporal stores, which write around the cache so that
+ *    clearing or moving a big block does not evict the caller's
+ *    working set.
+ *
+ *    fast_copy picks its implementation on first use from what CPUID
+ *    reports: AVX2 if the CPU has it, else SSE2, else plain memcpy.
+ */
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#else
+#define HAVE_X86_SIMD 0
+#endif
+
+#include "fastmem.h"
+
+/* Blocks at least this big are written with non-temporal stores */
+#define NT_THRESHOLD (256 * 1024)
+
+/* Copies shorter than this are not worth the vector loop's setup */
+#define SMALL_COPY 128
+
+typedef void (*copy_funct)(char *dst, const char *src, size_t n);
+
+static void copy_init(char *dst, const char *src, size_t n);
+static copy_funct copy_impl = copy_init;
+
+static fast_copy_stats_t copy_stats;
+static int copy_timing = 0;
+
+/*
+ * fast_zero - set the n bytes at p to zero
+ */
+void fast_zero(void *p, size_t n)
+{
+#if defined(__SSE2__)
+  char *dst = (char *)p;
+  size_t head;
+  __m128i zero;
+
+  if (n < NT_THRESHOLD) {
+    memset(p, 0, n);
+    return;
+  }
+
+  /* Streaming stores need 16-byte aligned destinations */
+  head = (16 - ((size_t)dst & 15)) & 15;
+  memset(dst, 0, head);
+  dst += head;
+  n -= head;
+
+  zero = _mm_setzero_si128();
+  for (; n >= 64; n -= 64, dst += 64) {
+    _mm_stream_si128((__m128i *)dst, zero);
+    _mm_stream_si128((__m128i *)(dst + 16), zero);
+    _mm_stream_si128((__m128i *)(dst + 32), zero);
+    _mm_stream_si128((__m128i *)(dst + 48), zero);
+  }
+  /* Order the streaming stores before anything the caller writes next */
+  _mm_sfence();
+  memset(dst, 0, n);
+#else
+  memset(p, 0, n);
+#endif
+}
+
+/*
+ * copy_scalar - the fallback for CPUs without usable vector units
+ */
+static void copy_scalar(char *dst, const char *src, size_t n)
+{
+  memcpy(dst, src, n);
+}
+
+#if HAVE_X86_SIMD
+/*
+ * copy_sse2 - copy with 16-byte loads and stores, streaming the stores
+ *     past the cache for big copies
+ */
+__attribute__((target("sse2")))
+static void copy_sse2(char *dst, const char *src, size_t n)
+{
+  size_t head = (16 - ((size_t)dst & 15)) & 15;
+  int stream = (n >= NT_THRESHOLD);
+
+  /* Align the destination, so the stores below can be aligned ones */
+  memcpy(dst, src, head);
+  dst += head;
+  src += head;
+  n -= head;
+
+  for (; n >= 64; n -= 64, dst += 64, src += 64) {
+    __m128i a = _mm_loadu_si128((const __m128i *)src);
+    __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+    __m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+    __m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+    if (stream) {
+      _mm_stream_si128((__m128i *)dst, a);
+      _mm_stream_si128((__m128i *)(dst + 16), b);
+      _mm_stream_si128((__m128i *)(dst + 32), c);
+      _mm_stream_si128((__m128i *)(dst + 48), d);
+    } else {
+      _mm_store_si128((__m128i *)dst, a);
+      _mm_store_si128((__m128i *)(dst + 16), b);
+      _mm_store_si128((__m128i *)(dst + 32), c);
+      _mm_store_si128((__m128i *)(dst + 48), d);
+    }
+  }
+  if (stream)
+    _mm_sfence();
+  memcpy(dst, src, n);
+}
+
+/*
+ * copy_avx2 - copy with 32-byte loads and stores, streaming the stores
+ *     past the cache for big copies
+ */
+__attribute__((target("avx2")))
+static void copy_avx2(char *dst, const char *src, size_t n)
+{
+  size_t head = (32 - ((size_t)dst & 31)) & 31;
+  int stream = (n >= NT_THRESHOLD);
+
+  memcpy(dst, src, head);
+  dst += head;
+  src += head;
+  n -= head;
+
+  for (; n >= 128; n -= 128, dst += 128, src += 128) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)src);
+    __m256i b = _mm256_loadu_si256((const __m256i *)(src + 32));
+    __m256i c = _mm256_loadu_si256((const __m256i *)(src + 64));
+    __m256i d = _mm256_loadu_si256((const __m256i *)(src + 96));
+    if (stream) {
+      _mm256_stream_si256((__m256i *)dst, a);
+      _mm256_stream_si256((__m256i *)(dst + 32), b);
+      _mm256_stream_si256((__m256i *)(dst + 64), c);
+      _mm256_stream_si256((__m256i *)(dst + 96), d);
+    } else {
+      _mm256_store_si256((__m256i *)dst, a);
+      _mm256_store_si256((__m256i *)(dst + 32), b);
+      _mm256_store_si256((__m256i *)(dst + 64), c);
+      _mm256_store_si256((__m256i *)(dst + 96), d);
+    }
+  }
+  if (stream)
+    _mm_sfence();
+  /* Leave the AVX state clean for any SSE code that follows */
+  _mm256_zeroupper();
+  memcpy(dst, src, n);
+}
+#endif
+
+/*
+ * copy_init - pick the copy routine for this CPU, then use it
+ */
+static void copy_init(char *dst, const char *src, size_t n)
+{
+  copy_impl = copy_scalar;
+#if HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    copy_impl = copy_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    copy_impl = copy_sse2;
+#endif
+  copy_impl(dst, src, n);
+}
+
+/*
+ * fast_copy - copy n bytes from src to dst (which must not overlap)
+ */
+void fast_copy(void *dst, const void *src, size_t n)
+{
+  struct timespec start, end;
+
+  copy_stats.calls++;
+  copy_stats.bytes += n;
+
+  if (copy_timing)
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (n < SMALL_COPY)
+    memcpy(dst, src, n);
+  else
+    copy_impl((char *)dst, (const char *)src, n);
+
+  if (copy_timing) {
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    copy_stats.secs += (end.tv_sec - start.tv_sec) +
+      (end.tv_nsec - start.tv_nsec) / 1e9;
+  }
+}
+
+/*
+ * fast_copy_timing - turn timing of each fast_copy call on or off
+ */
+void fast_copy_timing(int enable)
+{
+  copy_timing = enable;
+}
+
+/*
+ * fast_copy_get_stats - return the fast_copy totals so far
+ */
+void fast_copy_get_stats(fast_copy_stats_t *stats)
+{
+  *stats = copy_stats;
+}
+
+/*
+ * fast_copy_reset_stats - start the fast_copy totals over
+ */
+void fast_copy_reset_stats(void)
+{
+  memset(&copy_stats, 0, sizeof(copy_stats));
+}
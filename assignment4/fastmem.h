@@ -0,0 +1,18 @@
+/*
+ * fastmem.h - bulk memory routines used by the allocator
+ */
+#include <stddef.h>
+
+void fast_zero(void *p, size_t n);
+void fast_copy(void *dst, const void *src, size_t n);
+
+/* Running totals for fast_copy, for drivers to report */
+typedef struct {
+  size_t calls;   /* number of fast_copy calls */
+  size_t bytes;   /* bytes copied */
+  double secs;    /* time spent copying (only while timing is on) */
+} fast_copy_stats_t;
+
+void fast_copy_timing(int enable);
+void fast_copy_get_stats(fast_copy_stats_t *stats);
+void fast_copy_reset_stats(void);
@@ -18,6 +18,7 @@
 
 #include "mm.h"
 #include "memlib.h"
+#include "fastmem.h"
 #include "fsecs.h"
 #include "config.h"
 
@@ -81,6 +82,9 @@ typedef struct {
 
 	/* defined only for the student malloc package */
 	double util;     /* space utilization for this trace (always 0 for libc) */
+	double copies;   /* number of block moves mm_realloc made in the util pass */
+	double copy_bytes; /* bytes moved by those copies */
+	double copy_secs;  /* secs spent in those copies */
 
 	/* Note: secs and util are only defined if valid is true */
 } stats_t; 
@@ -127,6 +131,7 @@ static void eval_mm_speed(void *ptr);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void printcopies(int n, stats_t *stats);
 static void sumresults(const stats_t *stats, const int n_stats, 
 								int *num_err, double *avg_util, double *avg_tput);
 static void usage(void);
@@ -140,13 +145,14 @@ static void app_error(char *msg);
 int main(int argc, char **argv)
 {
 	int i;
-	char c;
+	int c;
 	char **tracefiles = NULL;  /* null-terminated array of trace file names */
 	int num_tracefiles = 0;    /* the number of traces in that array */
 	trace_t *trace = NULL;     /* stores a single trace file in memory */
 	range_t *ranges = NULL;    /* keeps track of block extents for one trace */
 	stats_t *libc_stats = NULL;/* libc stats for each trace */
 	stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
+	fast_copy_stats_t copy_stats; /* realloc copy counters for one trace */
 	speed_t speed_params;      /* input parameters to the xx_speed routines */ 
 
 	int team_check = 1;  /* If set, check team structure (reset by -a) */
@@ -270,7 +276,14 @@ int main(int argc, char **argv)
 		if (mm_stats[i].valid) {
 			if (verbose > 1)
 				printf("efficiency, ");
+			fast_copy_reset_stats();
+			fast_copy_timing(1);
 			mm_stats[i].util = eval_mm_util(trace, i, &ranges);
+			fast_copy_timing(0);
+			fast_copy_get_stats(&copy_stats);
+			mm_stats[i].copies = copy_stats.calls;
+			mm_stats[i].copy_bytes = copy_stats.bytes;
+			mm_stats[i].copy_secs = copy_stats.secs;
 			speed_params.trace = trace;
 			speed_params.ranges = ranges;
 			if (verbose > 1)
@@ -284,6 +297,8 @@ int main(int argc, char **argv)
 	if (verbose) {
 		printf("\nResults for mm malloc:\n");
 		printresults(num_tracefiles, mm_stats);
+		printf("\nRealloc copies for mm malloc:\n");
+		printcopies(num_tracefiles, mm_stats);
 		printf("\n");
 	}
 
@@ -614,7 +629,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 				oldsize = trace->block_sizes[index];
 				if (size < oldsize) oldsize = size;
 				for (j = 0; j < oldsize; j++) {
-					if (newp[j] != (index & 0xFF)) {
+					if ((unsigned char)newp[j] != (index & 0xFF)) {
 						malloc_error(tracenum, i, "mm_realloc did not preserve the "
 								"data from old block");
 						return 0;
@@ -933,6 +948,43 @@ static void printresults(int n, stats_t *stats)
 
 }
 
+/*
+ * printcopies - prints how much data mm_realloc moved on each trace
+ *     during the utilization pass, and how fast it moved it
+ */
+static void printcopies(int n, stats_t *stats)
+{
+	int i;
+	double copies = 0;
+	double bytes = 0;
+	double secs = 0;
+
+	printf("%5s%8s%12s%10s%7s\n",
+			"trace", "copies", "bytes", "secs", "GB/s");
+	for (i=0; i < n; i++) {
+		if (stats[i].valid) {
+			printf("%2d%11.0f%12.0f%10.6f%7.2f\n",
+					i,
+					stats[i].copies,
+					stats[i].copy_bytes,
+					stats[i].copy_secs,
+					stats[i].copy_secs > 0 ?
+					(stats[i].copy_bytes/1e9)/stats[i].copy_secs : 0.0);
+			copies += stats[i].copies;
+			bytes += stats[i].copy_bytes;
+			secs += stats[i].copy_secs;
+		} else {
+			printf("%2d%11s%12s%10s%7s\n", i, "-", "-", "-", "-");
+		}
+	}
+	printf("%5s%8.0f%12.0f%10.6f%7.2f\n",
+			"Total",
+			copies,
+			bytes,
+			secs,
+			secs > 0 ? (bytes/1e9)/secs : 0.0);
+}
+
 /* 
  * Accumulate the aggregate statistics for the student's mm package 
  */
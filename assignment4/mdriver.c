@@ -12,14 +12,23 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sched.h>
 #include <assert.h>
 #include <float.h>
+#include <limits.h>
+#include <math.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
 #include "config.h"
+#include "bintrace.h"
 
 /**********************
  * Constants and macros
@@ -37,31 +46,56 @@
  * The key compound data types 
  *****************************/
 
-/* Records the extent of each block's payload */
+/* Records the extent of each block's payload, as a node of a treap:
+   a binary search tree by lo, and a heap by a random priority, which
+   keeps it balanced with high probability */
 typedef struct range_t {
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    unsigned priority;     /* no lower than either child's */
+    struct range_t *left;  /* ranges below this one ... */
+    struct range_t *right; /* ... and above it; the next free node in
+			      the pool */
 } range_t;
 
+/* Range nodes are carved from chunks of this many */
+#define RANGE_CHUNK 1024
+
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-    enum {ALLOC, FREE} type; /* type of request */
-    int index;                        /* index for free() to use later */
-    int size;                         /* byte size of alloc request */
+    enum {ALLOC, FREE, MEMALIGN, CALLOC} type; /* type of request */
+    unsigned index;                   /* index for free() to use later */
+    size_t size;                      /* byte size of alloc request */
+    size_t align;                     /* payload alignment (MEMALIGN only) */
+    int lifetime;                     /* mm_malloc_hint class (ALLOC only) */
+    int thread;                       /* thread that issues it (-T), or 0 */
 } traceop_t;
 
+/* Requests of a binary trace are decoded this many at a time */
+#define OP_CHUNK 4096
+
 /* Holds the information for one trace file*/
 typedef struct {
-    int sugg_heapsize;   /* suggested heap size (unused) */
-    int num_ids;         /* number of alloc ids */
-    int num_ops;         /* number of distinct requests */
+    size_t sugg_heapsize; /* suggested heap size (unused) */
+    size_t num_ids;      /* number of alloc ids */
+    size_t num_ops;      /* number of distinct requests */
     int weight;          /* weight for this trace (unused) */
-    traceop_t *ops;      /* array of requests */
+    int has_calloc;      /* does the trace contain CALLOC requests? */
+    int num_threads;     /* 1 + the highest thread id in the trace */
+    traceop_t *ops;      /* array of requests ... */
+    size_t first_op;     /* ... from this one ... */
+    size_t num_loaded;   /* ... on (all of them, but for a binary trace) */
+    bintrace_record_t *records; /* a binary trace's mapped requests */
+    size_t map_size;     /* ... and the size of its mapping */
     char **blocks;       /* array of ptrs returned by malloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
 } trace_t;
 
+/* Request i of a trace, decoding the chunk it is in if need be */
+#define TRACE_OP(trace, i) \
+    ((size_t)(i) - (trace)->first_op < (trace)->num_loaded ? \
+     &(trace)->ops[(i) - (trace)->first_op] : load_ops(trace, i))
+
 /* 
  * Holds the params to the xxx_speed functions, which are timed by fcyc. 
  * This struct is necessary because fcyc accepts only a pointer array
@@ -85,11 +119,58 @@ typedef struct {
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
 
+/* 
+ * Latencies in nanoseconds, HDR-style: exact below LATENCY_SUB, then
+ * LATENCY_SUB linear buckets for each power of two above, so every
+ * latency is kept to within 1/LATENCY_SUB of its value at any scale.
+ */
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB)
+typedef struct {
+    unsigned long counts[LATENCY_BUCKETS];
+    unsigned long total;  /* latencies recorded */
+    unsigned long max;    /* the largest, exactly */
+} latency_t;
+
+/* One thread of a multithreaded replay (-T) */
+typedef struct {
+    trace_t *trace;
+    char **blocks;   /* block of each id: the trace's own, or a copy's */
+    int thread;      /* which thread this is ... */
+    int threads;     /* ... of how many */
+    int split;       /* run only this thread's requests, not all of them */
+    long start_ns;   /* when the thread started on its requests ... */
+    long end_ns;     /* ... and when it was done */
+} thread_arg_t;
+
+/* An allocator for the A/B comparison (-A): the mm.c linked in, or a
+   variant of it whose symbols were renamed to mm_<variant>_* */
+typedef struct {
+    int (*init)(void);
+    void *(*malloc)(size_t size);
+    void *(*memalign)(size_t align, size_t size);
+    void *(*calloc)(size_t nmemb, size_t size);
+    void (*free_sized)(void *ptr, size_t size);
+    const char *(*policy)(void);
+} allocator_t;
+
 /********************
  * Global variables
  *******************/
 int verbose = 0;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
+static int show_stats = 0; /* print mm_stats for each trace (-s) */
+static int sweep_row = 0;  /* print one row of the policy sweep (-S) */
+static mm_stats_t peak_stats; /* mm_stats when eval_mm_util peaked */
+static mm_stats_t end_stats;  /* and when it finished */
+static int check_mode = -1;   /* mm_check_mode after every op (-c), or -1 */
+static size_t check_budget;   /* ... and its budget */
+static int ab_rounds = 0;     /* rounds of the A/B comparison (-A), or 0 */
+static int max_threads = 0;   /* replay on 1 to this many threads (-T), or 0 */
+static int show_latency = 0;  /* time every request (-P) */
+static pthread_barrier_t start_barrier; /* lines up the -T threads */
+static int threads_failed;    /* set when a -T thread cannot go on */
 char msg[MAXLINE];      /* for whenever we need to compose an error message */
 
 /* Directory where default tracefiles are found */
@@ -100,19 +181,51 @@ static char *default_tracefiles[] = {
     DEFAULT_TRACEFILES, NULL
 };
 
+/*
+ * The allocators -A compares: mm.c, then each variant in
+ * MM_AB_VARIANTS, a list of AB(<variant>) that the Makefile passes
+ * when it builds mdriver-ab.
+ */
+#ifndef MM_AB_VARIANTS
+#define MM_AB_VARIANTS
+#endif
+#define AB(v) \
+    extern int mm_##v##_init(void); \
+    extern void *mm_##v##_malloc(size_t size); \
+    extern void *mm_##v##_memalign(size_t align, size_t size); \
+    extern void *mm_##v##_calloc(size_t nmemb, size_t size); \
+    extern void mm_##v##_free_sized(void *ptr, size_t size); \
+    extern const char *mm_##v##_policy(void);
+MM_AB_VARIANTS
+#undef AB
+#define AB(v) { mm_##v##_init, mm_##v##_malloc, mm_##v##_memalign, \
+	mm_##v##_calloc, mm_##v##_free_sized, mm_##v##_policy },
+static allocator_t allocators[] = {
+    { mm_init, mm_malloc, mm_memalign, mm_calloc, mm_free_sized, mm_policy },
+    MM_AB_VARIANTS
+};
+#undef AB
+#define NUM_ALLOCATORS ((int)(sizeof(allocators) / sizeof(allocator_t)))
+
 
 /********************* 
  * Function prototypes 
  *********************/
 
 /* these functions manipulate range lists */
-static int add_range(range_t **ranges, char *lo, int size, 
-		     int tracenum, int opnum);
+static int add_range(range_t **ranges, char *lo, size_t size, 
+		     int tracenum, size_t opnum);
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
+static void split_ranges(range_t *root, char *lo, range_t **below,
+			 range_t **above);
+static range_t *join_ranges(range_t *below, range_t *above);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
+static void map_trace(trace_t *trace, char *path);
+static traceop_t *load_ops(trace_t *trace, size_t i);
+static void materialize_trace(trace_t *trace);
 static void free_trace(trace_t *trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
@@ -124,12 +237,46 @@ static void eval_libc_speed(void *ptr);
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
 static void eval_mm_speed(void *ptr);
+static double eval_mm_hutil(trace_t *trace, int tracenum);
+static void infer_lifetimes(trace_t *trace, int short_ops);
+
+/* Routines for timing each request on its own (-P) */
+static long now_ns(void);
+static void calibrate_timer(void);
+static void latency_record(latency_t *hist, long ns);
+static unsigned long latency_percentile(latency_t *hist, double p);
+static void latency_merge(latency_t *to, latency_t *from);
+static void eval_mm_latency(trace_t *trace, latency_t *hists);
+
+/* Routines for the A/B comparison of several allocators (-A) */
+static void ab_compare(char **tracefiles, int n, int rounds);
+static double ab_replay(allocator_t *a, trace_t *trace, latency_t *lat);
+
+/* Routines for replaying traces on several threads at once (-T) */
+static void eval_threads(char **tracefiles, int n, int max_threads);
+static double eval_mm_threads(trace_t *trace, int threads, int split);
+static void *replay_thread(void *arg);
+
+/* Issue the allocation call for an ALLOC, MEMALIGN or CALLOC request */
+static char *mm_alloc_op(traceop_t *op);
+static char *libc_alloc_op(traceop_t *op);
+static void reset_heap(trace_t *trace);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void printsweep(int n, stats_t *stats);
+static void printcompare(int n, stats_t *stats, double *alt_util, 
+			 char *label);
+static void printlatency(char *tracename, latency_t *hists);
+static void printlatencyrow(char *name, latency_t *hist);
+static void printclasses(void);
+static void printstats(char *tracename);
+#if MM_INSTRUMENT
+static void printinstrument(char *tracename);
+#endif
 static void usage(void);
 static void unix_error(char *msg);
-static void malloc_error(int tracenum, int opnum, char *msg);
+static void malloc_error(int tracenum, size_t opnum, char *msg);
 static void app_error(char *msg);
 
 /**************
@@ -138,7 +285,7 @@ static void app_error(char *msg);
 int main(int argc, char **argv)
 {
     int i;
-    char c;
+    int c;
     char **tracefiles = NULL;  /* null-terminated array of trace file names */
     int num_tracefiles = 0;    /* the number of traces in that array */
     trace_t *trace = NULL;     /* stores a single trace file in memory */
@@ -149,6 +296,11 @@ int main(int argc, char **argv)
 
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    int run_handles = 0; /* If set, also replay through handles (-H) */
+    int short_ops = 0;   /* If set, also replay with lifetime hints (-L) */
+    double *hutil = NULL;/* utilization through handles for each trace */
+    static latency_t latency[4], all_latency[4]; /* by request type (-P) */
+    double *lutil = NULL;/* utilization with lifetime hints for each trace */
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -157,21 +309,22 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgl")) != 255) {
+    while ((c = getopt(argc, argv, "A:c:f:t:T:hvVglPsSHL:")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
 	    break;
-        case 'f': /* Use one specific trace file only (relative to curr dir) */
-            num_tracefiles = 1;
-            if ((tracefiles = realloc(tracefiles, 2*sizeof(char *))) == NULL)
+        case 'f': /* Use these trace files only (relative to curr dir) */
+            num_tracefiles++;
+            if ((tracefiles = realloc(tracefiles, 
+				      (num_tracefiles+1)*sizeof(char *))) == NULL)
 		unix_error("ERROR: realloc failed in main");
 	    strcpy(tracedir, "./"); 
-            tracefiles[0] = strdup(optarg);
-            tracefiles[1] = NULL;
+            tracefiles[num_tracefiles-1] = strdup(optarg);
+            tracefiles[num_tracefiles] = NULL;
             break;
 	case 't': /* Directory where the traces are located */
-	    if (num_tracefiles == 1) /* ignore if -f already encountered */
+	    if (num_tracefiles > 0) /* ignore if -f already encountered */
 		break;
 	    strcpy(tracedir, optarg);
 	    if (tracedir[strlen(tracedir)-1] != '/') 
@@ -180,6 +333,52 @@ int main(int argc, char **argv)
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+        case 'P': /* Print request latency percentiles for each trace */
+            show_latency = 1;
+            break;
+        case 's': /* Print allocator statistics for each trace */
+            show_stats = 1;
+            break;
+        case 'S': /* Print just a row of the policy sweep */
+            sweep_row = 1;
+            break;
+        case 'H': /* Compare utilization with relocatable blocks */
+            run_handles = 1;
+            break;
+        case 'A': /* Compare the allocators linked in, A/B */
+            ab_rounds = atoi(optarg);
+            if (ab_rounds <= 0) {
+		usage();
+		exit(1);
+	    }
+            break;
+        case 'T': /* Replay on 1 to this many threads at once */
+            max_threads = atoi(optarg);
+            if (max_threads <= 0) {
+		usage();
+		exit(1);
+	    }
+            break;
+        case 'c': /* Check the heap after every request */
+	    check_budget = strtoul(optarg + 1, NULL, 0);
+	    if (optarg[0] == 'f' && optarg[1] == '\0')
+		check_mode = MM_CHECK_FULL;
+	    else if (optarg[0] == 'i' && check_budget > 0)
+		check_mode = MM_CHECK_INCREMENTAL;
+	    else if (optarg[0] == 's' && check_budget > 0)
+		check_mode = MM_CHECK_SAMPLED;
+	    else {
+		usage();
+		exit(1);
+	    }
+	    break;
+        case 'L': /* Compare utilization with inferred lifetime hints */
+            short_ops = atoi(optarg);
+            if (short_ops <= 0) {
+		usage();
+		exit(1);
+	    }
+            break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -202,7 +401,17 @@ int main(int argc, char **argv)
     if (tracefiles == NULL) {
         tracefiles = default_tracefiles;
         num_tracefiles = sizeof(default_tracefiles) / sizeof(char *) - 1;
-	printf("Using default tracefiles in %s\n", tracedir);
+	if (!sweep_row)
+	    printf("Using default tracefiles in %s\n", tracedir);
+    }
+
+    if (ab_rounds > 0) {
+	ab_compare(tracefiles, num_tracefiles, ab_rounds);
+	exit(0);
+    }
+    if (max_threads > 0) {
+	eval_threads(tracefiles, num_tracefiles, max_threads);
+	exit(0);
     }
 
     /* Initialize the timing package */
@@ -253,6 +462,9 @@ int main(int argc, char **argv)
     mm_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
     if (mm_stats == NULL)
 	unix_error("mm_stats calloc in main failed");
+    if ((hutil = (double *)calloc(num_tracefiles, sizeof(double))) == NULL ||
+	(lutil = (double *)calloc(num_tracefiles, sizeof(double))) == NULL)
+	unix_error("util calloc in main failed");
     
     /* Initialize the simulated memory system in memlib.c */
     mem_init(); 
@@ -268,21 +480,54 @@ int main(int argc, char **argv)
 	    if (verbose > 1)
 		printf("efficiency, ");
 	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
+	    if (show_stats)
+		printstats(tracefiles[i]);
+#if MM_INSTRUMENT
+	    printinstrument(tracefiles[i]);
+#endif
 	    speed_params.trace = trace;
 	    speed_params.ranges = ranges;
 	    if (verbose > 1)
 		printf("and performance.\n");
 	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+	    if (show_latency) {
+		eval_mm_latency(trace, latency);
+		printlatency(tracefiles[i], latency);
+		for (c = 0; c < 4; c++)
+		    latency_merge(&all_latency[c], &latency[c]);
+	    }
+	    if (verbose > 1)
+		printclasses();
+	    if (run_handles)
+		hutil[i] = eval_mm_hutil(trace, i);
+	    if (short_ops) {
+		infer_lifetimes(trace, short_ops);
+		lutil[i] = eval_mm_util(trace, i, &ranges);
+	    }
 	}
 	free_trace(trace);
     }
 
+    if (show_latency)
+	printlatency("all traces", all_latency);
+
     /* Display the mm results in a compact table */
     if (verbose) {
 	printf("\nResults for mm malloc:\n");
 	printresults(num_tracefiles, mm_stats);
 	printf("\n");
     }
+    if (run_handles) {
+	printf("Utilization with relocatable (mm_halloc) blocks:\n");
+	printcompare(num_tracefiles, mm_stats, hutil, "handles");
+	printf("\n");
+    }
+    if (short_ops) {
+	printf("Utilization with lifetime hints (short: freed within "
+	       "%d ops):\n", short_ops);
+	printcompare(num_tracefiles, mm_stats, lutil, "hinted");
+	printf("\n");
+    }
 
     /* 
      * Accumulate the aggregate statistics for the student's mm package 
@@ -300,6 +545,11 @@ int main(int argc, char **argv)
     }
     avg_mm_util = util/num_tracefiles;
 
+    if (sweep_row) {
+	printsweep(num_tracefiles, mm_stats);
+	exit(errors == 0 ? 0 : 1);
+    }
+
     /* 
      * Compute and print the performance index 
      */
@@ -337,23 +587,33 @@ int main(int argc, char **argv)
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps 
+ * The following routines manipulate the range tree, which keeps 
  * track of the extent of every allocated block payload. We use the 
- * range list to detect any overlapping allocated blocks.
+ * range tree to detect any overlapping allocated blocks.  Payloads
+ * that pass never overlap, so ordering them by their low address
+ * orders them by their high one too, and a new payload overlaps
+ * another exactly when it overlaps the payload just below it or the
+ * one just above.  Adding and removing a range thus takes O(log n),
+ * and validating a trace O(n log n).
  ****************************************************************/
 
+/* Free range nodes, linked through right, and the seed of priorities */
+static range_t *range_pool = NULL;
+static unsigned range_seed = 2463534242u;
+
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of 
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list. 
+ *     we create a range struct for this block and add it to the range tree. 
  */
-static int add_range(range_t **ranges, char *lo, int size, 
-		     int tracenum, int opnum)
+static int add_range(range_t **ranges, char *lo, size_t size, 
+		     int tracenum, size_t opnum)
 {
     char *hi = lo + size - 1;
-    range_t *p;
+    range_t *p, *below = NULL, *above = NULL;
     char msg[MAXLINE];
+    int i;
 
     assert(size > 0);
 
@@ -374,27 +634,51 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-	    sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-		    lo, hi, p->lo, p->hi);
-	    malloc_error(tracenum, opnum, msg);
-	    return 0;
-        }
+    /* The payload must not overlap any other payloads: find the
+       nearest ones below and above it */
+    for (p = *ranges;  p != NULL; ) {
+	if (p->lo <= lo) {
+	    below = p;
+	    p = p->right;
+	} else {
+	    above = p;
+	    p = p->left;
+	}
+    }
+    if (below != NULL && below->hi >= lo)
+	p = below;
+    else if (above != NULL && above->lo <= hi)
+	p = above;
+    if (p != NULL) {
+	sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+		lo, hi, p->lo, p->hi);
+	malloc_error(tracenum, opnum, msg);
+	return 0;
     }
 
     /* 
      * Everything looks OK, so remember the extent of this block 
-     * by creating a range struct and adding it the range list.
+     * by taking a range struct from the pool and adding it to the tree.
      */
-    if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
-	unix_error("malloc error in add_range");
-    p->next = *ranges;
+    if (range_pool == NULL) {
+	if ((p = (range_t *)malloc(RANGE_CHUNK * sizeof(range_t))) == NULL)
+	    unix_error("malloc error in add_range");
+	for (i = 0; i < RANGE_CHUNK; i++) {
+	    p[i].right = range_pool;
+	    range_pool = &p[i];
+	}
+    }
+    p = range_pool;
+    range_pool = p->right;
     p->lo = lo;
     p->hi = hi;
-    *ranges = p;
+    p->left = p->right = NULL;
+    range_seed ^= range_seed << 13;   /* xorshift32 */
+    range_seed ^= range_seed >> 17;
+    range_seed ^= range_seed << 5;
+    p->priority = range_seed;
+    split_ranges(*ranges, lo, &below, &above);
+    *ranges = join_ranges(join_ranges(below, p), above);
     return 1;
 }
 
@@ -403,34 +687,68 @@ static int add_range(range_t **ranges, char *lo, int size,
  */
 static void remove_range(range_t **ranges, char *lo)
 {
-    range_t *p;
-    range_t **prevpp = ranges;
-    //int size;
+    range_t *below, *rest, *p, *above;
 
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-	    *prevpp = p->next;
-            //size = p->hi - p->lo + 1;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
+    split_ranges(*ranges, lo, &below, &rest);
+    split_ranges(rest, lo + 1, &p, &above);
+    if (p != NULL) {
+	p->right = range_pool;
+	range_pool = p;
     }
+    *ranges = join_ranges(below, above);
 }
 
 /*
- * clear_ranges - free all of the range records for a trace 
+ * clear_ranges - return all of the range records for a trace to the
+ *     pool
  */
 static void clear_ranges(range_t **ranges)
 {
-    range_t *p;
-    range_t *pnext;
+    range_t *p = *ranges;
+
+    if (p == NULL)
+	return;
+    clear_ranges(&p->left);
+    clear_ranges(&p->right);
+    p->right = range_pool;
+    range_pool = p;
+    *ranges = NULL;
+}
 
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
+/*
+ * split_ranges - split a tree into the ranges starting below lo and
+ *     those starting at or above it
+ */
+static void split_ranges(range_t *root, char *lo, range_t **below,
+			 range_t **above)
+{
+    if (root == NULL) {
+	*below = *above = NULL;
+    } else if (root->lo < lo) {
+	split_ranges(root->right, lo, &root->right, above);
+	*below = root;
+    } else {
+	split_ranges(root->left, lo, below, &root->left);
+	*above = root;
     }
-    *ranges = NULL;
+}
+
+/*
+ * join_ranges - join two trees, every range of the first below every
+ *     range of the second, into one
+ */
+static range_t *join_ranges(range_t *below, range_t *above)
+{
+    if (below == NULL)
+	return above;
+    if (above == NULL)
+	return below;
+    if (below->priority > above->priority) {
+	below->right = join_ranges(below->right, above);
+	return below;
+    }
+    above->left = join_ranges(below, above->left);
+    return above;
 }
 
 
@@ -447,9 +765,12 @@ static trace_t *read_trace(char *tracedir, char *filename)
     trace_t *trace;
     char type[MAXLINE];
     char path[MAXLINE];
-    unsigned index, size;
+    unsigned index;
+    size_t size, align;
     unsigned max_index = 0;
-    unsigned op_index;
+    size_t op_index;
+    uint64_t magic;
+    int thread;
 
     if (verbose > 1)
 	printf("Reading tracefile: %s\n", filename);
@@ -465,15 +786,29 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	sprintf(msg, "Could not open %s in read_trace", path);
 	unix_error(msg);
     }
-    fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
-    fscanf(tracefile, "%d", &(trace->num_ids));     
-    fscanf(tracefile, "%d", &(trace->num_ops));     
+
+    /* A binary trace is replayed straight from the file */
+    if (fread(&magic, sizeof(magic), 1, tracefile) == 1 &&
+	magic == BINTRACE_MAGIC) {
+	fclose(tracefile);
+	map_trace(trace, path);
+	return trace;
+    }
+    rewind(tracefile);
+    fscanf(tracefile, "%zu", &(trace->sugg_heapsize)); /* not used */
+    fscanf(tracefile, "%zu", &(trace->num_ids));     
+    fscanf(tracefile, "%zu", &(trace->num_ops));     
     fscanf(tracefile, "%d", &(trace->weight));        /* not used */
+    trace->has_calloc = 0;
+    trace->num_threads = 1;
+    trace->records = NULL;
     
     /* We'll store each request line in the trace in this array */
     if ((trace->ops = 
 	 (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
 	unix_error("malloc 2 failed in read_trace");
+    trace->first_op = 0;
+    trace->num_loaded = trace->num_ops;
 
     /* We'll keep an array of pointers to the allocated blocks here... */
     if ((trace->blocks = 
@@ -489,12 +824,40 @@ static trace_t *read_trace(char *tracedir, char *filename)
     index = 0;
     op_index = 0;
     while (fscanf(tracefile, "%s", type) != EOF) {
+	/* A request may start with the id of the thread that makes it */
+	thread = 0;
+	if (isdigit((unsigned char)type[0])) {
+	    thread = atoi(type);
+	    if (thread >= trace->num_threads)
+		trace->num_threads = thread + 1;
+	    fscanf(tracefile, "%s", type);
+	}
+	trace->ops[op_index].thread = thread;
 	switch(type[0]) {
 	case 'a':
-	    fscanf(tracefile, "%u %u", &index, &size);
+	    fscanf(tracefile, "%u %zu", &index, &size);
 	    trace->ops[op_index].type = ALLOC;
 	    trace->ops[op_index].index = index;
 	    trace->ops[op_index].size = size;
+	    trace->ops[op_index].lifetime = MM_LIFETIME_UNKNOWN;
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
+	case 'm':
+	    fscanf(tracefile, "%u %zu %zu", &index, &size, &align);
+	    trace->ops[op_index].type = MEMALIGN;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].size = size;
+	    trace->ops[op_index].lifetime = MM_LIFETIME_UNKNOWN;
+	    trace->ops[op_index].align = align;
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
+	case 'c':
+	    fscanf(tracefile, "%u %zu", &index, &size);
+	    trace->ops[op_index].type = CALLOC;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].size = size;
+	    trace->ops[op_index].lifetime = MM_LIFETIME_UNKNOWN;
+	    trace->has_calloc = 1;
 	    max_index = (index > max_index) ? index : max_index;
 	    break;
 	case 'f':
@@ -517,15 +880,130 @@ static trace_t *read_trace(char *tracedir, char *filename)
     return trace;
 }
 
+/*
+ * map_trace - set up a binary trace (see bintrace.h) for replay: map
+ *     its requests, which load_ops decodes as the replay reaches them
+ */
+static void map_trace(trace_t *trace, char *path)
+{
+    bintrace_header_t *header;
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+	sprintf(msg, "Could not open %s in map_trace", path);
+	unix_error(msg);
+    }
+    if ((size_t)st.st_size < sizeof(bintrace_header_t) ||
+	(header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) ==
+	MAP_FAILED) {
+	sprintf(msg, "Could not map %s in map_trace", path);
+	unix_error(msg);
+    }
+    close(fd);
+    if ((size_t)st.st_size < sizeof(bintrace_header_t) +
+	header->num_ops * sizeof(bintrace_record_t)) {
+	printf("Binary tracefile %s is truncated\n", path);
+	exit(1);
+    }
+    madvise(header, st.st_size, MADV_SEQUENTIAL);
+
+    trace->sugg_heapsize = header->heap_size;
+    trace->num_ids = header->num_ids;
+    trace->num_ops = header->num_ops;
+    trace->weight = header->weight;
+    trace->has_calloc = (header->flags & BINTRACE_HAS_CALLOC) != 0;
+    trace->num_threads = header->num_threads;
+    trace->records = (bintrace_record_t *)(header + 1);
+    trace->map_size = st.st_size;
+    trace->first_op = 0;
+    trace->num_loaded = 0;
+    if ((trace->ops = 
+	 (traceop_t *)malloc(OP_CHUNK * sizeof(traceop_t))) == NULL ||
+	(trace->blocks = 
+	 (char **)malloc(trace->num_ids * sizeof(char *))) == NULL ||
+	(trace->block_sizes = 
+	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
+	unix_error("malloc failed in map_trace");
+}
+
+/*
+ * decode_op - Turn a binary trace record into a request
+ */
+static void decode_op(trace_t *trace, traceop_t *op, bintrace_record_t *r)
+{
+    static int types[] = { ALLOC, FREE, MEMALIGN, CALLOC };
+
+    if (r->op > BINTRACE_CALLOC || r->id >= trace->num_ids)
+	app_error("Bad request in binary tracefile");
+    op->type = types[r->op];
+    op->index = r->id;
+    op->size = r->size;
+    op->align = (size_t)1 << r->align_shift;
+    op->lifetime = MM_LIFETIME_UNKNOWN;
+    op->thread = r->thread;
+}
+
+/*
+ * load_ops - Decode the chunk of a binary trace holding request i, in
+ *     place of the one decoded before, and return request i.  Replays
+ *     go through the trace in order, so the pages of the records
+ *     already decoded are let go.
+ */
+static traceop_t *load_ops(trace_t *trace, size_t i)
+{
+    size_t first = i - i % OP_CHUNK, k, n;
+    size_t page = mem_pagesize(), lo, hi;
+
+    assert(i < trace->num_ops && trace->records != NULL);
+    n = trace->num_ops - first < OP_CHUNK ? trace->num_ops - first : OP_CHUNK;
+    for (k = 0; k < n; k++)
+	decode_op(trace, &trace->ops[k], &trace->records[first + k]);
+
+    if (first > trace->first_op) {
+	lo = (size_t)&trace->records[trace->first_op];
+	hi = (size_t)&trace->records[first];
+	lo = (lo + page - 1) & ~(page - 1);
+	hi &= ~(page - 1);
+	if (hi > lo)
+	    madvise((void *)lo, hi - lo, MADV_DONTNEED);
+    }
+    trace->first_op = first;
+    trace->num_loaded = n;
+    return &trace->ops[i - first];
+}
+
+/*
+ * materialize_trace - Decode all of a binary trace's requests, for the
+ *     replays that do not go through it in order on one thread
+ */
+static void materialize_trace(trace_t *trace)
+{
+    size_t i;
+
+    if (trace->records == NULL || trace->num_loaded == trace->num_ops)
+	return;
+    if ((trace->ops = (traceop_t *)realloc(trace->ops, trace->num_ops *
+					   sizeof(traceop_t))) == NULL)
+	unix_error("realloc failed in materialize_trace");
+    for (i = 0; i < trace->num_ops; i++)
+	decode_op(trace, &trace->ops[i], &trace->records[i]);
+    trace->first_op = 0;
+    trace->num_loaded = trace->num_ops;
+}
+
 /*
  * free_trace - Free the trace record and the three arrays it points
- *              to, all of which were allocated in read_trace().
+ *              to, all of which were allocated in read_trace(), and
+ *              unmap a binary trace
  */
 void free_trace(trace_t *trace)
 {
     free(trace->ops);         /* free the three arrays... */
     free(trace->blocks);      
     free(trace->block_sizes);
+    if (trace->records != NULL)
+	munmap((bintrace_header_t *)trace->records - 1, trace->map_size);
     free(trace);              /* and the trace record itself... */
 }
 
@@ -539,13 +1017,14 @@ void free_trace(trace_t *trace)
  */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) 
 {
-    int i;
+    size_t i, j;
     int index;
-    int size;
+    size_t size;
+    traceop_t *op;
     char *p;
     
     /* Reset the heap and free any records in the range list */
-    mem_reset_brk();
+    reset_heap(trace);
     clear_ranges(ranges);
 
     /* Call the mm package's init function */
@@ -556,18 +1035,41 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 
     /* Interpret each operation in the trace in order */
     for (i = 0;  i < trace->num_ops;  i++) {
-	index = trace->ops[i].index;
-	size = trace->ops[i].size;
+	op = TRACE_OP(trace, i);
+	index = op->index;
+	size = op->size;
 
-        switch (trace->ops[i].type) {
+        switch (op->type) {
 
         case ALLOC: /* mm_malloc */
+        case MEMALIGN: /* mm_memalign */
+        case CALLOC: /* mm_calloc */
 
 	    /* Call the student's malloc */
-	    if ((p = mm_malloc(size)) == NULL) {
+	    if ((p = mm_alloc_op(op)) == NULL) {
 		malloc_error(tracenum, i, "mm_malloc failed.");
 		return 0;
 	    }
+
+	    /* Aligned requests must honor their own alignment too */
+	    if (op->type == MEMALIGN && ((size_t)p % op->align) != 0) {
+		sprintf(msg, "Payload address (%p) not aligned to %lu bytes",
+			p, (unsigned long)op->align);
+		malloc_error(tracenum, i, msg);
+		return 0;
+	    }
+
+	    /* Calloc'ed payloads must read as zero */
+	    if (op->type == CALLOC) {
+		for (j = 0; j < size; j++) {
+		    if (p[j] != 0) {
+			sprintf(msg, "mm_calloc payload (%p) has a non-zero "
+				"byte at offset %lu", p, (unsigned long)j);
+			malloc_error(tracenum, i, msg);
+			return 0;
+		    }
+		}
+	    }
 	    
 	    /* 
 	     * Test the range of the new block for correctness and add it 
@@ -591,16 +1093,23 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 
         case FREE: /* mm_free */
 	    
-	    /* Remove region from list and call student's free function */
+	    /* Remove region from list and call student's free function.
+	     * The trace knows every block's size, so use the sized entry
+	     * point (this also exercises its MM_DEBUG size check). */
 	    p = trace->blocks[index];
 	    remove_range(ranges, p);
-	    mm_free(p);
+	    mm_free_sized(p, trace->block_sizes[index]);
 	    break;
 
 	default:
 	    app_error("Nonexistent request type in eval_mm_valid");
         }
 
+	/* With -c, have the package check its own heap */
+	if (check_mode >= 0 && mm_check_mode(check_mode, check_budget) != 0) {
+	    malloc_error(tracenum, i, "mm_check found the heap inconsistent.");
+	    return 0;
+	}
     }
 
     /* As far as we know, this is a valid malloc package */
@@ -620,26 +1129,30 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  */
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 {   
-    int i;
+    size_t i;
     int index;
-    int size;
-    int max_total_size = 0;
-    int total_size = 0;
+    size_t size;
+    size_t max_total_size = 0;
+    size_t total_size = 0;
+    traceop_t *op;
     char *p;
 
     /* initialize the heap and the mm malloc package */
-    mem_reset_brk();
+    reset_heap(trace);
     if (mm_init() < 0)
 	app_error("mm_init failed in eval_mm_util");
 
     for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+	op = TRACE_OP(trace, i);
+        switch (op->type) {
 
         case ALLOC: /* mm_alloc */
-	    index = trace->ops[i].index;
-	    size = trace->ops[i].size;
+        case MEMALIGN: /* mm_memalign */
+        case CALLOC: /* mm_calloc */
+	    index = op->index;
+	    size = op->size;
 
-	    if ((p = mm_malloc(size)) == NULL) 
+	    if ((p = mm_alloc_op(op)) == NULL) 
 		app_error("mm_malloc failed in eval_mm_util");
 	    
 	    /* Remember region and size */
@@ -651,16 +1164,19 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    total_size += size;
 	    
 	    /* Update statistics */
-	    max_total_size = (total_size > max_total_size) ?
-		total_size : max_total_size;
+	    if (total_size > max_total_size) {
+		max_total_size = total_size;
+		if (show_stats)
+		    mm_stats(&peak_stats);
+	    }
 	    break;
 
         case FREE: /* mm_free */
-	    index = trace->ops[i].index;
+	    index = op->index;
 	    size = trace->block_sizes[index];
 	    p = trace->blocks[index];
 	    
-	    mm_free(p);
+	    mm_free_sized(p, size);
 	    
 	    /* Keep track of current total size
 	     * of all allocated blocks */
@@ -673,6 +1189,8 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 
         }
     }
+    if (show_stats)
+	mm_stats(&end_stats);
 
     return ((double)max_total_size / (double)mem_heapsize());
 }
@@ -684,36 +1202,147 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
  */
 static void eval_mm_speed(void *ptr)
 {
-    int i, index, size;
+    size_t i;
+    int index;
     char *p, *block;
+    traceop_t *op;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
     /* Reset the heap and initialize the mm package */
-    mem_reset_brk();
+    reset_heap(trace);
     if (mm_init() < 0) 
 	app_error("mm_init failed in eval_mm_speed");
 
     /* Interpret each trace request */
-    for (i = 0;  i < trace->num_ops;  i++)
-        switch (trace->ops[i].type) {
+    for (i = 0;  i < trace->num_ops;  i++) {
+	op = TRACE_OP(trace, i);
+        switch (op->type) {
 
         case ALLOC: /* mm_malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
-            if ((p = mm_malloc(size)) == NULL)
+        case MEMALIGN: /* mm_memalign */
+        case CALLOC: /* mm_calloc */
+            index = op->index;
+            if ((p = mm_alloc_op(op)) == NULL)
 		app_error("mm_malloc error in eval_mm_speed");
             trace->blocks[index] = p;
+            trace->block_sizes[index] = op->size;
             break;
 
         case FREE: /* mm_free */
-            index = trace->ops[i].index;
+            index = op->index;
             block = trace->blocks[index];
-            mm_free(block);
+            mm_free_sized(block, trace->block_sizes[index]);
             break;
 
 	default:
 	    app_error("Nonexistent request type in eval_mm_valid");
         }
+    }
+}
+
+/*
+ * eval_mm_hutil - Evaluate the space utilization of the trace when
+ *    every block is a relocatable mm_halloc block, so that the heap
+ *    can be compacted.  Since the heap may shrink, utilization is
+ *    measured against the peak heap size.  Aligned requests become
+ *    plain ones: compaction does not keep alignment.  Every payload
+ *    is filled with the low byte of its index and checked when it is
+ *    freed, to catch compaction bugs.
+ */
+static double eval_mm_hutil(trace_t *trace, int tracenum)
+{
+    size_t i, j;
+    int index;
+    size_t size;
+    size_t max_total_size = 0;
+    size_t total_size = 0;
+    traceop_t *op;
+    char *p;
+    mm_handle_t *handles;
+
+    if ((handles = 
+	 (mm_handle_t *)malloc(trace->num_ids * sizeof(mm_handle_t))) == NULL)
+	unix_error("malloc failed in eval_mm_hutil");
+
+    reset_heap(trace);
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_mm_hutil");
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	op = TRACE_OP(trace, i);
+	index = op->index;
+        switch (op->type) {
+
+        case ALLOC: /* mm_halloc */
+        case MEMALIGN:
+        case CALLOC:
+	    size = op->size;
+	    if ((handles[index] = mm_halloc(size)) == 0)
+		app_error("mm_halloc failed in eval_mm_hutil");
+	    p = mm_hlock(handles[index]);
+	    memset(p, index & 0xFF, size);
+	    mm_hunlock(handles[index]);
+	    trace->block_sizes[index] = size;
+
+	    total_size += size;
+	    max_total_size = (total_size > max_total_size) ?
+		total_size : max_total_size;
+	    break;
+
+        case FREE: /* mm_hfree */
+	    size = trace->block_sizes[index];
+	    p = mm_hlock(handles[index]);
+	    for (j = 0; j < size; j++) {
+		if (p[j] != (char)(index & 0xFF)) {
+		    sprintf(msg, "mm_halloc payload (%p) was corrupted at "
+			    "offset %lu", p, (unsigned long)j);
+		    malloc_error(tracenum, i, msg);
+		    break;
+		}
+	    }
+	    mm_hfree(handles[index]);
+	    total_size -= size;
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_hutil");
+        }
+    }
+
+    free(handles);
+    return ((double)max_total_size / (double)mem_peak_heapsize());
+}
+
+/*
+ * infer_lifetimes - Hint every ALLOC request as short-lived if the
+ *    trace frees it within short_ops requests, or as long-lived
+ *    otherwise (including blocks that are never freed)
+ */
+static void infer_lifetimes(trace_t *trace, int short_ops)
+{
+    size_t i;
+    size_t *alloc_op;
+
+    materialize_trace(trace);
+    if ((alloc_op = (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
+	unix_error("malloc failed in infer_lifetimes");
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	traceop_t *op = &trace->ops[i];
+
+	if (op->type == ALLOC) {
+	    op->lifetime = MM_LIFETIME_LONG;
+	    alloc_op[op->index] = i;
+	}
+	else if (op->type == FREE && i - alloc_op[op->index] <= short_ops &&
+		 trace->ops[alloc_op[op->index]].type == ALLOC) {
+	    trace->ops[alloc_op[op->index]].lifetime = MM_LIFETIME_SHORT;
+	}
+	else if (op->type != FREE) {
+	    alloc_op[op->index] = i;
+	}
+    }
+    free(alloc_op);
 }
 
 /*
@@ -724,22 +1353,26 @@ static void eval_mm_speed(void *ptr)
  */
 static int eval_libc_valid(trace_t *trace, int tracenum)
 {
-    int i;
+    size_t i;
+    traceop_t *op;
     char *p;
 
     for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+	op = TRACE_OP(trace, i);
+        switch (op->type) {
 
         case ALLOC: /* malloc */
-	    if ((p = malloc(trace->ops[i].size)) == NULL) {
+        case MEMALIGN: /* posix_memalign */
+        case CALLOC: /* calloc */
+	    if ((p = libc_alloc_op(op)) == NULL) {
 		malloc_error(tracenum, i, "libc malloc failed");
 		unix_error("System message");
 	    }
-	    trace->blocks[trace->ops[i].index] = p;
+	    trace->blocks[op->index] = p;
 	    break;
 
         case FREE: /* free */
-           free(trace->blocks[trace->ops[i].index]);
+           free(trace->blocks[op->index]);
            break;	
 		default:
 	    app_error("invalid operation type  in eval_libc_valid");
@@ -756,23 +1389,26 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
  */
 static void eval_libc_speed(void *ptr)
 {
-    int i;
-    int index, size;
+    size_t i;
+    int index;
     char *p, *block;
+    traceop_t *op;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
     for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+	op = TRACE_OP(trace, i);
+        switch (op->type) {
         case ALLOC: /* malloc */
-	    index = trace->ops[i].index;
-	    size = trace->ops[i].size;
-	    if ((p = malloc(size)) == NULL)
+        case MEMALIGN: /* posix_memalign */
+        case CALLOC: /* calloc */
+	    index = op->index;
+	    if ((p = libc_alloc_op(op)) == NULL)
 		unix_error("malloc failed in eval_libc_speed");
 	    trace->blocks[index] = p;
 	    break;
 
         case FREE: /* free */
-	    index = trace->ops[i].index;
+	    index = op->index;
 	    block = trace->blocks[index];
 	    free(block);
 	    break;
@@ -780,6 +1416,614 @@ static void eval_libc_speed(void *ptr)
     }
 }
 
+/*****************************************************************
+ * The following routines time every request on its own (-P), to show
+ * the occasional slow one that an average hides: a heap extension or
+ * a long free-list search.  The clock is read around each request and
+ * the cost of reading it is taken off.
+ ****************************************************************/
+
+/* Nanoseconds a pair of clock_gettime calls takes */
+static long timer_ns = -1;
+
+/*
+ * now_ns - the monotonic clock in nanoseconds
+ */
+static long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * calibrate_timer - Measure timer_ns, once, as the quickest of many
+ *     back-to-back clock reads
+ */
+static void calibrate_timer(void)
+{
+    long ns;
+    int k;
+
+    if (timer_ns >= 0)
+	return;
+    timer_ns = LONG_MAX;
+    for (k = 0; k < 10000; k++) {
+	ns = now_ns();
+	ns = now_ns() - ns;
+	if (ns < timer_ns)
+	    timer_ns = ns;
+    }
+}
+
+/*
+ * latency_record - Add a latency of ns, less the timer's own cost, to
+ *     a histogram
+ */
+static void latency_record(latency_t *hist, long ns)
+{
+    unsigned long v = ns > timer_ns ? ns - timer_ns : 0;
+    int shift, bucket;
+
+    if (v < LATENCY_SUB)
+	bucket = v;
+    else {
+	shift = 63 - __builtin_clzl(v) - LATENCY_SUB_BITS;
+	bucket = (shift + 1) * LATENCY_SUB + (v >> shift) - LATENCY_SUB;
+    }
+    hist->counts[bucket]++;
+    hist->total++;
+    if (v > hist->max)
+	hist->max = v;
+}
+
+/*
+ * latency_percentile - The latency p percent of the recorded ones are
+ *     at or below, as the top of its bucket
+ */
+static unsigned long latency_percentile(latency_t *hist, double p)
+{
+    unsigned long rank = (unsigned long)ceil(hist->total * p / 100.0);
+    unsigned long seen = 0, top;
+    int bucket, shift;
+
+    if (rank == 0)
+	rank = 1;
+    for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+	seen += hist->counts[bucket];
+	if (seen >= rank)
+	    break;
+    }
+    if (bucket < LATENCY_SUB)
+	top = bucket;
+    else {
+	shift = bucket / LATENCY_SUB - 1;
+	top = ((unsigned long)(LATENCY_SUB + bucket % LATENCY_SUB) << shift) +
+	    (1UL << shift) - 1;
+    }
+    return top < hist->max ? top : hist->max;
+}
+
+/*
+ * latency_merge - Add the latencies in one histogram to another
+ */
+static void latency_merge(latency_t *to, latency_t *from)
+{
+    int bucket;
+
+    for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+	to->counts[bucket] += from->counts[bucket];
+    to->total += from->total;
+    if (from->max > to->max)
+	to->max = from->max;
+}
+
+/*
+ * eval_mm_latency - Replay a trace on a fresh heap, timing each
+ *     request into hists[type], which it clears first
+ */
+static void eval_mm_latency(trace_t *trace, latency_t *hists)
+{
+    traceop_t *op;
+    long start;
+    char *p;
+    size_t i;
+
+    calibrate_timer();
+    memset(hists, 0, 4 * sizeof(latency_t));
+    reset_heap(trace);
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_mm_latency");
+
+    for (i = 0; i < trace->num_ops; i++) {
+	op = TRACE_OP(trace, i);
+	if (op->type == FREE) {
+	    p = trace->blocks[op->index];
+	    start = now_ns();
+	    mm_free_sized(p, trace->block_sizes[op->index]);
+	} else {
+	    start = now_ns();
+	    if ((p = mm_alloc_op(op)) == NULL)
+		app_error("mm_malloc failed in eval_mm_latency");
+	}
+	latency_record(&hists[op->type], now_ns() - start);
+	if (op->type != FREE) {
+	    trace->blocks[op->index] = p;
+	    trace->block_sizes[op->index] = op->size;
+	}
+    }
+}
+
+/*****************************************************************
+ * The following routines compare the allocators linked into the
+ * driver (-A).  mdriver-ab links variants of mm.c, built with other
+ * options, next to it, each under its own symbol prefix, so they all
+ * run on the same traces in the same process.
+ ****************************************************************/
+
+/* Two-sided 95% critical values of Student's t, by degrees of freedom */
+static double t95[] = {
+    0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262,
+    2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093,
+    2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045,
+    2.042
+};
+
+static int by_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * median - the median of x[0..n-1], which it sorts
+ */
+static double median(double *x, int n)
+{
+    qsort(x, n, sizeof(double), by_double);
+    return n % 2 ? x[n / 2] : (x[n / 2 - 1] + x[n / 2]) / 2;
+}
+
+/*
+ * ab_replay - Run a trace on allocator a from an empty heap and return
+ *     its utilization.  If lat is not NULL, each request is timed into
+ *     it.  The results are not checked: run mdriver on each variant
+ *     for that.
+ */
+static double ab_replay(allocator_t *a, trace_t *trace, latency_t *lat)
+{
+    traceop_t *op;
+    long total_size = 0, max_total_size = 0, start = 0;
+    char *p;
+    size_t i;
+
+    reset_heap(trace);
+    if (a->init() < 0)
+	app_error("mm_init failed in ab_replay");
+
+    for (i = 0; i < trace->num_ops; i++) {
+	op = TRACE_OP(trace, i);
+	if (lat != NULL)
+	    start = now_ns();
+	switch (op->type) {
+	case ALLOC:
+	case MEMALIGN:
+	case CALLOC:
+	    if (op->type == MEMALIGN)
+		p = a->memalign(op->align, op->size);
+	    else if (op->type == CALLOC)
+		p = a->calloc(1, op->size);
+	    else
+		p = a->malloc(op->size);
+	    if (p == NULL)
+		app_error("mm_malloc failed in ab_replay");
+	    trace->blocks[op->index] = p;
+	    trace->block_sizes[op->index] = op->size;
+	    total_size += op->size;
+	    if (total_size > max_total_size)
+		max_total_size = total_size;
+	    break;
+
+	case FREE:
+	    a->free_sized(trace->blocks[op->index],
+			  trace->block_sizes[op->index]);
+	    total_size -= trace->block_sizes[op->index];
+	    break;
+	}
+	if (lat != NULL)
+	    latency_record(lat, now_ns() - start);
+    }
+    return (double)max_total_size / (double)mem_heapsize();
+}
+
+/*
+ * ab_compare - Replay every trace on every allocator, rounds times,
+ *     and print their utilization, throughput and latency side by
+ *     side.  Each round runs the allocators in a different order, so
+ *     that drifts in clock speed and temperature hit them all alike.
+ *     A round runs each trace twice per allocator: once as a whole
+ *     for the throughput, and once timing each request for the
+ *     latencies.  Each allocator's speed is then compared with the
+ *     first's round by round, and the difference is marked with a *
+ *     when the 95% confidence interval of their ratio leaves out 1.
+ */
+static void ab_compare(char **tracefiles, int n, int rounds)
+{
+    trace_t **traces;
+    double *util, *secs, *ratios, *x, total, other, ops = 0;
+    double mean, sd, half, t;
+    latency_t *lat;
+    long start;
+    int a, i, k, r;
+
+    /* Read all the traces first, so every run replays them from
+       memory */
+    if ((traces = malloc(n * sizeof(trace_t *))) == NULL)
+	unix_error("malloc failed in ab_compare");
+    for (i = 0; i < n; i++) {
+	traces[i] = read_trace(tracedir, tracefiles[i]);
+	ops += traces[i]->num_ops;
+    }
+
+    util = calloc(NUM_ALLOCATORS * n, sizeof(double));
+    secs = calloc((size_t)NUM_ALLOCATORS * n * rounds, sizeof(double));
+    ratios = calloc(rounds, sizeof(double));
+    x = calloc(rounds, sizeof(double));
+    lat = calloc(NUM_ALLOCATORS, sizeof(latency_t));
+    if (util == NULL || secs == NULL || ratios == NULL || x == NULL ||
+	lat == NULL)
+	unix_error("calloc failed in ab_compare");
+    calibrate_timer();
+
+    mem_init();
+    for (r = 0; r < rounds; r++) {
+	for (i = 0; i < n; i++) {
+	    for (k = 0; k < NUM_ALLOCATORS; k++) {
+		a = (k + r) % NUM_ALLOCATORS;
+		start = now_ns();
+		util[a * n + i] = ab_replay(&allocators[a], traces[i], NULL);
+		secs[(a * n + i) * rounds + r] = (now_ns() - start) / 1e9;
+		ab_replay(&allocators[a], traces[i], &lat[a]);
+	    }
+	}
+    }
+
+    printf("A/B comparison of %d allocators, %d round%s\n\n",
+	   NUM_ALLOCATORS, rounds, rounds == 1 ? "" : "s");
+
+    printf("Utilization:\n%-18s", "allocator");
+    for (i = 0; i < n; i++)
+	printf("%5d", i);
+    printf("%6s\n", "util");
+    for (a = 0; a < NUM_ALLOCATORS; a++) {
+	printf("%-18s", allocators[a].policy());
+	for (i = 0, total = 0; i < n; i++) {
+	    printf("%4.0f%%", util[a * n + i] * 100.0);
+	    total += util[a * n + i];
+	}
+	printf("%5.0f%%\n", total / n * 100.0);
+    }
+
+    printf("\nThroughput (Kops, median of the rounds):\n%-18s", "allocator");
+    for (i = 0; i < n; i++)
+	printf("%7d", i);
+    printf("%8s\n", "Kops");
+    for (a = 0; a < NUM_ALLOCATORS; a++) {
+	printf("%-18s", allocators[a].policy());
+	for (i = 0; i < n; i++) {
+	    memcpy(x, &secs[(a * n + i) * rounds], rounds * sizeof(double));
+	    printf("%7.0f", traces[i]->num_ops / 1e3 / median(x, rounds));
+	}
+	for (r = 0; r < rounds; r++)
+	    for (i = 0, x[r] = 0; i < n; i++)
+		x[r] += secs[(a * n + i) * rounds + r];
+	printf("%8.0f\n", ops / 1e3 / median(x, rounds));
+    }
+
+    printf("\nLatency (ns per request) and speed against %s:\n",
+	   allocators[0].policy());
+    printf("%-18s%7s%7s%7s%8s%9s%8s%16s\n", "allocator", "p50", "p90",
+	   "p99", "p99.9", "max", "speed", "95% interval");
+    for (a = 0; a < NUM_ALLOCATORS; a++) {
+	printf("%-18s%7lu%7lu%7lu%8lu%9lu", allocators[a].policy(),
+	       latency_percentile(&lat[a], 50), latency_percentile(&lat[a], 90),
+	       latency_percentile(&lat[a], 99),
+	       latency_percentile(&lat[a], 99.9), lat[a].max);
+
+	/* the log of the first allocator's time over this one's, for
+	   each round */
+	for (r = 0; r < rounds; r++) {
+	    for (i = 0, total = 0, other = 0; i < n; i++) {
+		total += secs[i * rounds + r];
+		other += secs[(a * n + i) * rounds + r];
+	    }
+	    ratios[r] = log(total / other);
+	}
+	for (r = 0, mean = 0; r < rounds; r++)
+	    mean += ratios[r] / rounds;
+	printf("%7.2fx", exp(mean));
+	if (a == 0 || rounds < 2) {
+	    printf("\n");
+	    continue;
+	}
+	for (r = 0, sd = 0; r < rounds; r++)
+	    sd += (ratios[r] - mean) * (ratios[r] - mean) / (rounds - 1);
+	t = rounds - 1 < 30 ? t95[rounds - 1] : 1.96;
+	half = t * sqrt(sd / rounds);
+	printf("%8.2f-%.2fx%s\n", exp(mean - half), exp(mean + half),
+	       mean - half > 0 || mean + half < 0 ? " *" : "");
+    }
+
+    for (i = 0; i < n; i++)
+	free_trace(traces[i]);
+    free(traces);
+    free(util);
+    free(secs);
+    free(ratios);
+    free(x);
+    free(lat);
+}
+
+/*****************************************************************
+ * The following routines replay traces on several threads at once
+ * (-T), on one heap with MM_OPT_THREADS on, to see how mm.c scales.
+ * A trace whose requests carry thread ids is split among the threads
+ * by id; any other trace is replayed in full by every thread.
+ ****************************************************************/
+
+/*
+ * eval_threads - Replay each trace on 1 to max_threads threads and
+ *     print the throughput of each, all threads' requests together,
+ *     and how it scales from one thread.  Copies of a big trace may not
+ *     all fit in the heap; when mm_malloc runs out, the run stops, the
+ *     trace shows "-" and is left out of the totals.
+ */
+static void eval_threads(char **tracefiles, int n, int max_threads)
+{
+    trace_t *trace;
+    double *ops, *secs, *scaling, total_ops, total_secs, base = 0;
+    int *complete;
+    int i, t, k;
+
+    ops = calloc(n * max_threads, sizeof(double));
+    secs = calloc(n * max_threads, sizeof(double));
+    scaling = calloc(max_threads, sizeof(double));
+    complete = calloc(n, sizeof(int));
+    if (ops == NULL || secs == NULL || scaling == NULL || complete == NULL)
+	unix_error("calloc failed in eval_threads");
+
+    mem_init();
+    printf("%5s%8s", "trace", "mode");
+    for (t = 1; t <= max_threads; t++)
+	printf("%8d", t);
+    printf("  threads (Kops)\n");
+    for (i = 0; i < n; i++) {
+	trace = read_trace(tracedir, tracefiles[i]);
+	materialize_trace(trace);
+	printf("%5d%8s", i, trace->num_threads > 1 ? "split" : "copies");
+	complete[i] = 1;
+	for (t = 1; t <= max_threads; t++) {
+	    k = i * max_threads + t - 1;
+	    secs[k] = eval_mm_threads(trace, t, trace->num_threads > 1);
+	    ops[k] = trace->num_threads > 1 ? trace->num_ops :
+		(double)trace->num_ops * t;
+	    if (secs[k] > 0)
+		printf("%8.0f", ops[k] / 1e3 / secs[k]);
+	    else {
+		printf("%8s", "-");
+		complete[i] = 0;
+	    }
+	    fflush(stdout);
+	}
+	printf("\n");
+	free_trace(trace);
+    }
+
+    printf("%13s", "Total");
+    for (t = 1; t <= max_threads; t++) {
+	total_ops = 0;
+	total_secs = 0;
+	for (i = 0; i < n; i++) {
+	    if (complete[i]) {
+		total_ops += ops[i * max_threads + t - 1];
+		total_secs += secs[i * max_threads + t - 1];
+	    }
+	}
+	if (total_secs == 0) {
+	    printf("%8s", "-");
+	    continue;
+	}
+	if (t == 1)
+	    base = total_ops / total_secs;
+	scaling[t - 1] = total_ops / total_secs / base;
+	printf("%8.0f", total_ops / 1e3 / total_secs);
+    }
+    printf("\n%13s", "Scaling");
+    for (t = 1; t <= max_threads; t++)
+	printf("%7.2fx", scaling[t - 1]);
+    printf("\n");
+
+    free(ops);
+    free(secs);
+    free(scaling);
+    free(complete);
+}
+
+/*
+ * eval_mm_threads - Replay a trace on a fresh heap on the given number
+ *     of threads, split among them by thread id or copied to each, and
+ *     return the secs the fastest of three runs took from when the
+ *     first thread starts to when the last one is done, or 0 if the
+ *     heap ran out
+ */
+static double eval_mm_threads(trace_t *trace, int threads, int split)
+{
+    pthread_t *tids;
+    thread_arg_t *args;
+    long start, end;
+    double secs, best = 0;
+    int run, t;
+
+    tids = calloc(threads, sizeof(pthread_t));
+    args = calloc(threads, sizeof(thread_arg_t));
+    if (tids == NULL || args == NULL)
+	unix_error("calloc failed in eval_mm_threads");
+    for (t = 0; t < threads; t++) {
+	args[t].trace = trace;
+	args[t].thread = t;
+	args[t].threads = threads;
+	args[t].split = split;
+	if (split)
+	    args[t].blocks = trace->blocks;
+	else if ((args[t].blocks = malloc(trace->num_ids * sizeof(char *))) == NULL)
+	    unix_error("malloc failed in eval_mm_threads");
+    }
+
+    for (run = 0; run < 3; run++) {
+	reset_heap(trace);
+	if (mm_init() < 0)
+	    app_error("mm_init failed in eval_mm_threads");
+	mm_mallopt(MM_OPT_THREADS, 1);
+	for (t = 0; t < threads; t++)
+	    memset(args[t].blocks, 0, trace->num_ids * sizeof(char *));
+
+	/* Each thread times itself from the barrier, so the run lasts
+	   from the first start to the last finish */
+	threads_failed = 0;
+	pthread_barrier_init(&start_barrier, NULL, threads);
+	for (t = 0; t < threads; t++)
+	    if (pthread_create(&tids[t], NULL, replay_thread, &args[t]) != 0)
+		app_error("pthread_create failed in eval_mm_threads");
+	for (t = 0; t < threads; t++)
+	    pthread_join(tids[t], NULL);
+	pthread_barrier_destroy(&start_barrier);
+	if (threads_failed) {
+	    best = 0;
+	    break;
+	}
+
+	start = args[0].start_ns;
+	end = args[0].end_ns;
+	for (t = 1; t < threads; t++) {
+	    start = args[t].start_ns < start ? args[t].start_ns : start;
+	    end = args[t].end_ns > end ? args[t].end_ns : end;
+	}
+	secs = (end - start) / 1e9;
+	if (run == 0 || secs < best)
+	    best = secs;
+    }
+
+    if (!split)
+	for (t = 0; t < threads; t++)
+	    free(args[t].blocks);
+    free(tids);
+    free(args);
+    return best;
+}
+
+/*
+ * replay_thread - Run one thread's part of a trace.  When the trace is
+ *     split, a block may be freed by another thread than the one that
+ *     allocated it, so each block is handed over through its slot in
+ *     blocks: a free waits until the allocation has filled the slot,
+ *     and an allocation waits until any earlier block with the same id
+ *     has been freed.  Both only ever wait on requests earlier in the
+ *     trace, so the threads cannot deadlock.
+ */
+static void *replay_thread(void *arg)
+{
+    thread_arg_t *r = (thread_arg_t *)arg;
+    trace_t *trace = r->trace;
+    traceop_t *op;
+    char *p, *empty;
+    size_t i;
+
+    pthread_barrier_wait(&start_barrier);
+    r->start_ns = now_ns();
+    for (i = 0; i < trace->num_ops; i++) {
+	op = &trace->ops[i];
+	if (r->split && op->thread % r->threads != r->thread)
+	    continue;
+	switch (op->type) {
+	case ALLOC:
+	case MEMALIGN:
+	case CALLOC:
+	    if ((p = mm_alloc_op(op)) == NULL) {
+		__atomic_store_n(&threads_failed, 1, __ATOMIC_RELAXED);
+		return NULL;
+	    }
+	    for (empty = NULL;
+		 !__atomic_compare_exchange_n(&r->blocks[op->index], &empty, p,
+					      0, __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED);
+		 empty = NULL) {
+		if (__atomic_load_n(&threads_failed, __ATOMIC_RELAXED))
+		    return NULL;
+		sched_yield();
+	    }
+	    break;
+
+	case FREE:
+	    while ((p = __atomic_exchange_n(&r->blocks[op->index], NULL,
+					    __ATOMIC_ACQUIRE)) == NULL) {
+		if (__atomic_load_n(&threads_failed, __ATOMIC_RELAXED))
+		    return NULL;
+		sched_yield();
+	    }
+	    mm_free(p);
+	    break;
+	}
+    }
+    r->end_ns = now_ns();
+    return NULL;
+}
+
+/*
+ * mm_alloc_op - Call mm_malloc (mm_malloc_hint if the request has a
+ *     lifetime hint), mm_memalign or mm_calloc, as the
+ *     request asks
+ */
+static char *mm_alloc_op(traceop_t *op)
+{
+    if (op->type == MEMALIGN)
+	return mm_memalign(op->align, op->size);
+    if (op->type == CALLOC)
+	return mm_calloc(1, op->size);
+    if (op->lifetime != MM_LIFETIME_UNKNOWN)
+	return mm_malloc_hint(op->size, op->lifetime);
+    return mm_malloc(op->size);
+}
+
+/*
+ * libc_alloc_op - Call malloc, posix_memalign or calloc, as the
+ *     request asks
+ */
+static char *libc_alloc_op(traceop_t *op)
+{
+    void *p;
+
+    if (op->type == MEMALIGN)
+	return (posix_memalign(&p, op->align, op->size) == 0) ? p : NULL;
+    if (op->type == CALLOC)
+	return calloc(1, op->size);
+    return malloc(op->size);
+}
+
+/*
+ * reset_heap - Empty the simulated heap before a run. Traces that use
+ *     calloc start on zero-filled memory, as a new process would, so
+ *     that they measure what mm_calloc saves on fresh memory.
+ */
+static void reset_heap(trace_t *trace)
+{
+    if (trace->has_calloc)
+	mem_reset_fresh();
+    else
+	mem_reset_brk();
+}
+
 /*************************************
  * Some miscellaneous helper routines
  ************************************/
@@ -842,6 +2086,205 @@ static void printresults(int n, stats_t *stats)
 
 }
 
+/*
+ * printsweep - Print the free-list policies mm.c was built with, the
+ *     utilization of each trace, and the average utilization and
+ *     throughput, as one row under a header line.  "make sweep" runs
+ *     every policy pair's driver this way to build a matrix.
+ */
+static void printsweep(int n, stats_t *stats)
+{
+    double secs = 0, ops = 0, util = 0;
+    int i;
+
+    printf("%-18s", "policy");
+    for (i = 0; i < n; i++)
+	printf("%5d", i);
+    printf("%6s%8s\n", "util", "Kops");
+
+    printf("%-18s", mm_policy());
+    for (i = 0; i < n; i++) {
+	if (stats[i].valid) {
+	    printf("%4.0f%%", stats[i].util*100.0);
+	    secs += stats[i].secs;
+	    ops += stats[i].ops;
+	    util += stats[i].util;
+	}
+	else
+	    printf("%5s", "-");
+    }
+    if (errors == 0)
+	printf("%5.0f%%%8.0f\n", (util/n)*100.0, (ops/1e3)/secs);
+    else
+	printf("%6s%8s\n", "-", "-");
+}
+
+/*
+ * printlatency - prints the latency percentiles of each type of
+ *     request in a trace, and of all of them
+ */
+static void printlatency(char *tracename, latency_t *hists)
+{
+    static char *names[] = { "malloc", "free", "memalign", "calloc" };
+    latency_t all;
+    int type;
+
+    memset(&all, 0, sizeof(all));
+    printf("%s: request latency (ns)\n", tracename);
+    printf("%-10s%9s%7s%7s%7s%8s%10s\n", "request", "count", "p50", "p90",
+	   "p99", "p99.9", "max");
+    for (type = 0; type < 4; type++) {
+	if (hists[type].total > 0) {
+	    printlatencyrow(names[type], &hists[type]);
+	    latency_merge(&all, &hists[type]);
+	}
+    }
+    printlatencyrow("all", &all);
+    printf("\n");
+}
+
+/*
+ * printlatencyrow - prints one line of printlatency
+ */
+static void printlatencyrow(char *name, latency_t *hist)
+{
+    printf("%-10s%9lu%7lu%7lu%7lu%8lu%10lu\n", name, hist->total,
+	   latency_percentile(hist, 50), latency_percentile(hist, 90),
+	   latency_percentile(hist, 99), latency_percentile(hist, 99.9),
+	   hist->max);
+}
+
+/*
+ * printcompare - prints the utilization of each trace next to its
+ *     utilization alt_util[i] in some other mode, headed by label
+ */
+static void printcompare(int n, stats_t *stats, double *alt_util, 
+			 char *label)
+{
+    int i;
+    double util = 0;
+    double alt = 0;
+
+    printf("%5s%7s%9s\n", "trace", "util", label);
+    for (i=0; i < n; i++) {
+	if (stats[i].valid) {
+	    printf("%2d%9.0f%%%8.0f%%\n",
+		   i,
+		   stats[i].util*100.0,
+		   alt_util[i]*100.0);
+	    util += stats[i].util;
+	    alt += alt_util[i];
+	}
+	else {
+	    printf("%2d%10s%9s\n", i, "-", "-");
+	}
+    }
+    printf("%5s%6.0f%%%8.0f%%\n", "Total", (util/n)*100.0, (alt/n)*100.0);
+}
+
+/*
+ * printclasses - prints the size classes mm.c ended up with after the
+ *     last run of a trace, and how often they were re-derived
+ */
+static void printclasses(void)
+{
+    int i;
+    mm_class_stats_t stats;
+
+    mm_class_stats(&stats);
+    printf("size classes after %lu epochs (%lu retired, %lu drains):\n",
+	   (unsigned long)stats.epochs, (unsigned long)stats.retired,
+	   (unsigned long)stats.drains);
+    if (stats.num_classes == 0)
+	return;
+    printf("%8s%6s%8s%9s%7s%7s\n", 
+	   "size", "slab", "cached", "hits", "refill", "epoch");
+    for (i = 0; i < stats.num_classes; i++) {
+	printf("%8lu%6lu%8lu%9lu%7lu%7lu\n",
+	       (unsigned long)stats.classes[i].block_size,
+	       (unsigned long)stats.classes[i].slab_blocks,
+	       (unsigned long)stats.classes[i].cached,
+	       (unsigned long)stats.classes[i].hits,
+	       (unsigned long)stats.classes[i].refills,
+	       (unsigned long)stats.classes[i].epoch_created);
+    }
+}
+
+/*
+ * printstats - prints what mm_stats reported for the last run of
+ *     eval_mm_util: the heap at peak utilization, binned by block
+ *     size, and the splits and merges over the whole run
+ */
+static void printstats(char *tracename)
+{
+    int i;
+    mm_stats_t *peak = &peak_stats;
+    mm_stats_t *end = &end_stats;
+
+    printf("%s: heap %lu bytes at peak (%lu sbrk calls), %lu at end "
+	   "(%lu)\n", tracename,
+	   (unsigned long)peak->heap_size, (unsigned long)peak->sbrk_calls,
+	   (unsigned long)end->heap_size, (unsigned long)end->sbrk_calls);
+    printf("at peak: %lu bytes allocated, %lu free in %lu blocks, "
+	   "%lu cached\n",
+	   (unsigned long)peak->bytes_allocated, (unsigned long)peak->bytes_free,
+	   (unsigned long)peak->free_list_length,
+	   (unsigned long)peak->bytes_cached);
+    printf("%10s%8s%8s%8s%9s%9s\n",
+	   "size>=", "live", "free", "cached", "splits", "merges");
+    for (i = 0; i < MM_STATS_BINS; i++) {
+	if (peak->bins[i].live_blocks == 0 && peak->bins[i].free_blocks == 0 &&
+	    peak->bins[i].cached_blocks == 0 && end->bins[i].splits == 0 &&
+	    end->bins[i].coalesces == 0)
+	    continue;
+	printf("%10lu%8lu%8lu%8lu%9lu%9lu\n", 32UL << i,
+	       (unsigned long)peak->bins[i].live_blocks,
+	       (unsigned long)peak->bins[i].free_blocks,
+	       (unsigned long)peak->bins[i].cached_blocks,
+	       (unsigned long)end->bins[i].splits,
+	       (unsigned long)end->bins[i].coalesces);
+    }
+    printf("\n");
+}
+
+#if MM_INSTRUMENT
+/*
+ * printinstrument - print the histograms mm.c recorded while
+ *     eval_mm_util replayed a trace (mdriver-instr only)
+ */
+static void printinstrument(char *tracename)
+{
+    mm_instrument_t h;
+    int b, last = 0;
+
+    mm_instrument_stats(&h);
+    for (b = 0; b < MM_HIST_BUCKETS; b++)
+	if (h.search_length[b] || h.split_remainder[b] ||
+	    h.cycles[MM_INSTR_MALLOC][b] || h.cycles[MM_INSTR_FREE][b] ||
+	    h.cycles[MM_INSTR_REALLOC][b])
+	    last = b;
+
+    printf("%s: search lengths, split remainders (bytes), cycles per call\n",
+	   tracename);
+    printf("%10s%10s%10s%10s%10s%10s\n",
+	   "<=", "search", "split", "malloc", "free", "realloc");
+    for (b = 0; b <= last; b++)
+	printf("%10lu%10lu%10lu%10lu%10lu%10lu\n",
+	       b == 0 ? 0UL : (1UL << b) - 1,
+	       (unsigned long)h.search_length[b],
+	       (unsigned long)h.split_remainder[b],
+	       (unsigned long)h.cycles[MM_INSTR_MALLOC][b],
+	       (unsigned long)h.cycles[MM_INSTR_FREE][b],
+	       (unsigned long)h.cycles[MM_INSTR_REALLOC][b]);
+    printf("coalesce fan-in:");
+    for (b = 1; b < MM_HIST_BUCKETS; b++)
+	if (h.coalesce_fanin[b])
+	    printf(" %d%s:%lu", b, b == MM_HIST_BUCKETS - 1 ? "+" : "",
+		   (unsigned long)h.coalesce_fanin[b]);
+    printf("\n\n");
+}
+#endif
+
 /* 
  * app_error - Report an arbitrary application error
  */
@@ -863,10 +2306,11 @@ void unix_error(char *msg)
 /*
  * malloc_error - Report an error returned by the mm_malloc package
  */
-void malloc_error(int tracenum, int opnum, char *msg)
+void malloc_error(int tracenum, size_t opnum, char *msg)
 {
     errors++;
-    printf("ERROR [trace %d, line %d]: %s\n", tracenum, LINENUM(opnum), msg);
+    printf("ERROR [trace %d, line %lu]: %s\n", tracenum,
+	   (unsigned long)LINENUM(opnum), msg);
 }
 
 /* 
@@ -874,13 +2318,32 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvVlPsH] [-A <rounds>] [-c <check>] "
+	    "[-f <file>] [-t <dir>]\n\t       [-T <threads>] [-L <ops>]\n");
     fprintf(stderr, "Options\n");
-    fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+    fprintf(stderr, "\t-A <rounds> Compare the allocators linked in "
+	    "(see mdriver-ab),\n\t           interleaved, over <rounds> "
+	    "rounds.\n");
+    fprintf(stderr, "\t-c <check> Run mm_check after every request: f checks "
+	    "the whole\n\t           heap, i<n> the next <n> blocks, s<n> "
+	    "the whole heap\n\t           once in about <n> requests.\n");
+    fprintf(stderr, "\t-f <file>  Use <file> as the trace file (more than "
+	    "one -f runs\n\t           them all, as a suite).\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-H         Compare utilization with relocatable blocks.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-L <ops>   Compare utilization with lifetime hints, "
+	    "taking\n\t           blocks freed within <ops> requests as "
+	    "short-lived.\n");
+    fprintf(stderr, "\t-P         Print request latency percentiles for "
+	    "each trace.\n");
+    fprintf(stderr, "\t-s         Print allocator statistics for each trace.\n");
+    fprintf(stderr, "\t-S         Print only the utilization of each trace and the\n"
+	    "\t           overall throughput, under a header line.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-T <threads> Replay each trace on 1 to <threads> "
+	    "threads and\n\t           print how the throughput scales.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
 }
@@ -8,8 +8,11 @@
 #include <assert.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 
 #include "memlib.h"
 #include "config.h"
@@ -18,20 +21,234 @@
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static char *mem_fresh_brk;  /* bytes from here up have never been used */
+static char *mem_peak_brk;   /* highest brk since the heap was last reset */
+static char *mem_map_base;   /* start of the mapping holding the heap */
+static size_t mem_map_size;  /* and its size */
+
+/* The first page of a heap file (mem_init_file) or shared memory
+   object (mem_init_shared) records the heap's extent, so that it can
+   be mapped again by a later process, or by several at once. */
+#define MEM_FILE_MAGIC 0x6d6d686561700001UL
+typedef struct {
+  size_t magic;
+  size_t brk;                /* heap size */
+  size_t fresh;              /* bytes below this have been handed out */
+} file_header_t;
+
+static int mem_fd = -1;      /* heap file, or -1 for an anonymous heap */
+static file_header_t *mem_file_header;
+static int mem_shared;       /* other processes may move the brk */
+
+/* how long mem_init_shared waits for the creator to publish the heap */
+#define PUBLISH_TIMEOUT 10
+
+/*
+ * save_brk - record the heap's extent in the heap file, if any
+ */
+static void save_brk(void)
+{
+  if (mem_file_header != NULL) {
+    mem_file_header->brk = mem_brk - mem_start_brk;
+    mem_file_header->fresh = mem_fresh_brk - mem_start_brk;
+  }
+}
+
+/*
+ * load_brk - pick up the heap's extent from a shared heap's header,
+ *    where another process may have moved it.  The caller serializes
+ *    with those processes (mm.c holds its heap lock).
+ */
+static void load_brk(void)
+{
+  if (mem_shared) {
+    mem_brk = mem_start_brk + mem_file_header->brk;
+    mem_fresh_brk = mem_start_brk + mem_file_header->fresh;
+  }
+}
+
+/*
+ * map_heap - map the heap file (or shared memory object) open on
+ *    mem_fd, a header page followed by the heap, and point the model
+ *    at it.  Returns 0 on success and -1 on error.
+ */
+static int map_heap(void)
+{
+  size_t header_size = mem_pagesize();
+  char *map;
+
+  map = (char *)mmap(NULL, header_size + MAX_HEAP, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, mem_fd, 0);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "mem_init: mmap error\n");
+    return -1;
+  }
+  mem_map_base = map;
+  mem_map_size = header_size + MAX_HEAP;
+  mem_file_header = (file_header_t *)map;
+  mem_start_brk = map + header_size;
+  mem_max_addr = mem_start_brk + MAX_HEAP;
+  return 0;
+}
+
+/*
+ * use_header - take the heap's extent from the header just mapped
+ */
+static void use_header(void)
+{
+  mem_brk = mem_start_brk + mem_file_header->brk;
+  mem_fresh_brk = mem_start_brk + mem_file_header->fresh;
+  mem_peak_brk = mem_brk;
+}
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
-  /* allocate the storage we will use to model the available VM */
-  if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-    fprintf(stderr, "mem_init_vm: malloc error\n");
+  /* allocate the storage we will use to model the available VM.  Like
+     the pages sbrk hands out, an anonymous mapping starts out zeroed.
+     Only the pages the heap touches take up memory, so no swap is
+     reserved for the rest (libmm.so models a large heap). */
+  mem_start_brk = (char *)mmap(NULL, MAX_HEAP, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                               -1, 0);
+  if (mem_start_brk == MAP_FAILED) {
+    fprintf(stderr, "mem_init_vm: mmap error\n");
     exit(1);
   }
 
+  mem_map_base = mem_start_brk;
+  mem_map_size = MAX_HEAP;
   mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
   mem_brk = mem_start_brk;                  /* heap is empty initially */
+  mem_fresh_brk = mem_start_brk;            /* and has never been touched */
+  mem_peak_brk = mem_start_brk;
+}
+
+/*
+ * mem_init_file - like mem_init, but keep the heap in the file at
+ *    path, mapped shared so that every change reaches the file.  A
+ *    file left by an earlier mem_init_file is mapped again with its
+ *    heap intact; anything else is replaced by an empty heap.  Returns
+ *    1 if an existing heap was reopened, 0 if the heap is new, and -1
+ *    (after printing why) if the file cannot be used.
+ */
+int mem_init_file(const char *path)
+{
+  size_t map_size = mem_pagesize() + MAX_HEAP;
+  file_header_t header;
+  struct stat st;
+  int reopened;
+
+  mem_fd = open(path, O_RDWR | O_CREAT, 0600);
+  if (mem_fd < 0 || fstat(mem_fd, &st) != 0) {
+    fprintf(stderr, "mem_init_file: %s: %s\n", path, strerror(errno));
+    goto fail;
+  }
+  reopened = st.st_size == (off_t)map_size &&
+    pread(mem_fd, &header, sizeof(header), 0) == sizeof(header) &&
+    header.magic == MEM_FILE_MAGIC &&
+    header.brk <= header.fresh && header.fresh <= MAX_HEAP;
+
+  /* a new heap starts out as a sparse file, which reads as zero */
+  if (!reopened &&
+      (ftruncate(mem_fd, 0) != 0 || ftruncate(mem_fd, map_size) != 0)) {
+    fprintf(stderr, "mem_init_file: %s: %s\n", path, strerror(errno));
+    goto fail;
+  }
+
+  if (map_heap() != 0)
+    goto fail;
+  if (!reopened) {
+    mem_file_header->magic = MEM_FILE_MAGIC;
+    mem_file_header->brk = 0;
+    mem_file_header->fresh = 0;
+  }
+  use_header();
+  return reopened;
+
+ fail:
+  if (mem_fd >= 0)
+    close(mem_fd);
+  mem_fd = -1;
+  return -1;
+}
+
+/*
+ * mem_init_shared - like mem_init_file, but keep the heap in the POSIX
+ *    shared memory object name (see shm_open), which several processes
+ *    can map at once, each at its own address.  The process that
+ *    creates the object must call mem_publish once it has set the heap
+ *    up; the others wait for that.  Returns 1 if an existing heap was
+ *    attached, 0 if a new one was created, and -1 (after printing why)
+ *    on error.
+ */
+int mem_init_shared(const char *name)
+{
+  size_t map_size = mem_pagesize() + MAX_HEAP;
+  struct timespec pause = { 0, 1000000 };
+  struct stat st;
+  int created = 1;
+  int waited;
+
+  mem_fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (mem_fd < 0 && errno == EEXIST) {
+    created = 0;
+    mem_fd = shm_open(name, O_RDWR, 0600);
+  }
+  if (mem_fd < 0) {
+    fprintf(stderr, "mem_init_shared: %s: %s\n", name, strerror(errno));
+    return -1;
+  }
+
+  if (created) {
+    /* a new object is zero-filled, so the header is not yet published */
+    if (ftruncate(mem_fd, map_size) != 0) {
+      fprintf(stderr, "mem_init_shared: %s: %s\n", name, strerror(errno));
+      goto fail;
+    }
+  } else {
+    for (waited = 0; fstat(mem_fd, &st) == 0 && st.st_size != (off_t)map_size;
+         waited++) {
+      if (waited == PUBLISH_TIMEOUT * 1000)
+        goto stale;
+      nanosleep(&pause, NULL);
+    }
+  }
+  if (map_heap() != 0)
+    goto fail;
+  if (!created) {
+    for (waited = 0;
+         __atomic_load_n(&mem_file_header->magic, __ATOMIC_ACQUIRE) != MEM_FILE_MAGIC;
+         waited++) {
+      if (waited == PUBLISH_TIMEOUT * 1000) {
+        munmap(mem_map_base, mem_map_size);
+        goto stale;
+      }
+      nanosleep(&pause, NULL);
+    }
+  }
+  mem_shared = 1;
+  use_header();
+  return !created;
+
+ stale:
+  fprintf(stderr, "mem_init_shared: %s was never set up\n", name);
+ fail:
+  close(mem_fd);
+  mem_fd = -1;
+  mem_file_header = NULL;
+  return -1;
+}
+
+/*
+ * mem_publish - let the processes waiting in mem_init_shared attach
+ *    to the heap this one created
+ */
+void mem_publish(void)
+{
+  __atomic_store_n(&mem_file_header->magic, MEM_FILE_MAGIC, __ATOMIC_RELEASE);
 }
 
 /* 
@@ -39,7 +256,27 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-  free(mem_start_brk);
+  munmap(mem_map_base, mem_map_size);
+  if (mem_fd >= 0)
+    close(mem_fd);
+  mem_fd = -1;
+  mem_file_header = NULL;
+  mem_shared = 0;
+}
+
+/*
+ * mem_sync - write the heap back to its file (see mem_init_file) and
+ *    wait until it is on disk.  Does nothing for an anonymous heap.
+ *    Returns 0 on success and -1 on error.
+ */
+int mem_sync(void)
+{
+  size_t len;
+
+  if (mem_file_header == NULL)
+    return 0;
+  len = (mem_start_brk - mem_map_base) + (mem_brk - mem_start_brk);
+  return msync(mem_map_base, len, MS_SYNC);
 }
 
 /*
@@ -48,26 +285,104 @@ void mem_deinit(void)
 void mem_reset_brk()
 {
   mem_brk = mem_start_brk;
+  mem_peak_brk = mem_start_brk;
+  save_brk();
+}
+
+/*
+ * mem_reset_fresh - reset the brk like mem_reset_brk, and also give
+ *    every page the heap has touched back to the OS, so that the next
+ *    run starts on zero-filled memory as a newly started process would
+ */
+void mem_reset_fresh()
+{
+  mem_purge(mem_start_brk, mem_fresh_brk - mem_start_brk);
+  mem_fresh_brk = mem_start_brk;
+  mem_brk = mem_start_brk;
+  mem_peak_brk = mem_start_brk;
+  save_brk();
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area. Use
+ *    mem_shrink to give space back.  The new area reads as
+ *    zero if it lies above mem_fresh_lo(); unlike sbrk, memory reused
+ *    after mem_reset_brk keeps whatever an earlier run left there.
+ *    If the heap cannot grow that far, returns (void *)-1 with errno
+ *    set to ENOMEM and says nothing: under libmm.so that is an
+ *    ordinary malloc failure, and the caller reports it.
  */
 void *mem_sbrk(size_t incr) 
 {
-  char *old_brk = mem_brk;
+  char *old_brk;
 
-  if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+  load_brk();
+  old_brk = mem_brk;
+  if (incr > (size_t)(mem_max_addr - mem_brk)) {
     errno = ENOMEM;
-    fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
     return (void *)-1;
   }
   mem_brk += incr;
+
+  if (mem_brk > mem_fresh_brk)
+    mem_fresh_brk = mem_brk;
+  if (mem_brk > mem_peak_brk)
+    mem_peak_brk = mem_brk;
+  save_brk();
+
   return (void *)old_brk;
 }
 
+/*
+ * mem_shrink - lower the brk pointer by decr bytes, as sbrk with a
+ *    negative increment would. The released bytes keep their contents
+ *    (they are not fresh) if a later mem_sbrk hands them out again.
+ */
+void mem_shrink(size_t decr)
+{
+  load_brk();
+  assert(decr <= (size_t)(mem_brk - mem_start_brk));
+  mem_brk -= decr;
+  save_brk();
+}
+
+/*
+ * mem_purge - zero the heap bytes [lo, lo+len), handing the whole
+ *    pages in that range back to the OS (they come back zero-filled
+ *    on the next touch) and clearing the partial pages at either end.
+ *    Pages of a heap file would come back with the file's contents,
+ *    so those are simply cleared.
+ */
+void mem_purge(void *lo, size_t len)
+{
+  size_t pagesize = mem_pagesize();
+  char *start = (char *)lo;
+  char *end = start + len;
+  char *page_lo = (char *)(((size_t)start + pagesize - 1) & ~(pagesize - 1));
+  char *page_hi = (char *)((size_t)end & ~(pagesize - 1));
+
+  if (page_lo >= page_hi || mem_file_header != NULL) {
+    memset(start, 0, len);
+    return;
+  }
+  memset(start, 0, page_lo - start);
+  if (madvise(page_lo, page_hi - page_lo, MADV_DONTNEED) != 0)
+    memset(page_lo, 0, page_hi - page_lo);
+  memset(page_hi, 0, end - page_hi);
+}
+
+/*
+ * mem_fresh_lo - return the lowest address that mem_sbrk has never
+ *    handed out since the last mem_init or mem_reset_fresh.  Memory
+ *    from there up to the maximum heap address reads as zero.
+ */
+void *mem_fresh_lo()
+{
+  load_brk();
+  return (void *)mem_fresh_brk;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -81,6 +396,7 @@ void *mem_heap_lo()
  */
 void *mem_heap_hi()
 {
+  load_brk();
   return (void *)(mem_brk - 1);
 }
 
@@ -89,9 +405,20 @@ void *mem_heap_hi()
  */
 size_t mem_heapsize() 
 {
+  load_brk();
   return (size_t)(mem_brk - mem_start_brk);
 }
 
+/*
+ * mem_peak_heapsize() - returns the largest heap size in bytes since
+ *    the heap was last reset, which differs from mem_heapsize() only
+ *    if the heap has been shrunk
+ */
+size_t mem_peak_heapsize()
+{
+  return (size_t)(mem_peak_brk - mem_start_brk);
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
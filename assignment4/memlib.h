@@ -1,11 +1,20 @@
 #include <unistd.h>
 
 void mem_init(void);               
+int mem_init_file(const char *path);
+int mem_init_shared(const char *name);
+void mem_publish(void);
 void mem_deinit(void);
+int mem_sync(void);
 void *mem_sbrk(size_t incr);
+void mem_shrink(size_t decr);
+void mem_purge(void *lo, size_t len);
 void mem_reset_brk(void); 
+void mem_reset_fresh(void);
+void *mem_fresh_lo(void);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_peak_heapsize(void);
 size_t mem_pagesize(void);
 
@@ -1,6 +1,7 @@
 /*-------------------------------------------------------------------
  * Lab 5 Starter code
  *        single doubly-linked free block list with LIFO policy
+ *        (or another, chosen at build time: see MM_PLACEMENT)
  *        with support for coalescing adjacent free blocks
  *
  * Terminology:
@@ -11,13 +12,28 @@
  *   in memory.
  *-------------------------------------------------------------------- */
 
+#define _GNU_SOURCE   // for dladdr
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <assert.h>
 #include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <unwind.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
 #include "memlib.h"
 #include "mm.h"
+#include "mmtrace.h"
+#include "fastmem.h"
 
 /* Macros for unscaled pointer arithmetic to keep other code cleaner.  
    Casting to a char* has the effect that pointer arithmetic happens at
@@ -32,14 +48,205 @@
 #define UNSCALED_POINTER_ADD(p,x) ((void*)((char*)(p) + (x)))
 #define UNSCALED_POINTER_SUB(p,x) ((void*)((char*)(p) - (x)))
 
+/* Build with -DMM_DEBUG=1 to have the allocator verify what callers
+   tell it (e.g. the size passed to mm_free_sized) against the heap. */
+#ifndef MM_DEBUG
+#define MM_DEBUG 0
+#endif
+
+/* Build with -DMM_INSTRUMENT=1 to record histograms of how far the
+   free-list searches go, what splits leave over, how many blocks each
+   coalesce merges, and how many cycles each call takes (see
+   mm_instrument_stats).  INSTRUMENT(statement) only runs the statement
+   in that build, so the normal build pays nothing. */
+#ifndef MM_INSTRUMENT
+#define MM_INSTRUMENT 0
+#endif
+
+#if MM_INSTRUMENT
+static mm_instrument_t instrument;
+#define INSTRUMENT(statement) statement
+
+/* The public calls are timed by wrappers at the end of the file; the
+   code below defines them under these names, which calls from inside
+   mm.c also use, so nested calls are not timed twice. */
+#define mm_malloc untimedMalloc
+#define mm_free untimedFree
+#define mm_free_sized untimedFreeSized
+#define mm_realloc untimedRealloc
+static void* untimedMalloc(size_t size);
+static void untimedFree(void* ptr);
+static void untimedFreeSized(void* ptr, size_t size);
+static void* untimedRealloc(void* ptr, size_t size);
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define READ_CYCLES() __rdtsc()
+#else
+#include <time.h>
+/* Nanoseconds stand in for cycles. */
+static unsigned long long readNanoseconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#define READ_CYCLES() readNanoseconds()
+#endif
+
+/* The log2 histogram bucket of value (see MM_HIST_BUCKETS). */
+static int histBucket(unsigned long long value) {
+  int bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+  return bucket < MM_HIST_BUCKETS ? bucket : MM_HIST_BUCKETS - 1;
+}
+#else
+#define INSTRUMENT(statement)
+#endif
+
 
 /******** FREE LIST IMPLEMENTATION ***********************************/
 
 
+/* The placement policy (how searchFreeList picks a block) and the
+   insertion policy (where insertFreeBlock puts one) are chosen at
+   build time; see mm.h.  Only the chosen ones are compiled in. */
+#ifndef MM_PLACEMENT
+#define MM_PLACEMENT MM_FIRST_FIT
+#endif
+#ifndef MM_INSERTION
+#define MM_INSERTION MM_LIFO
+#endif
+
+/* Good fit settles for a block at most reqSize / GOOD_FIT_SLACK bytes
+   bigger than needed. */
+#define GOOD_FIT_SLACK 8
+
+#if MM_PLACEMENT == MM_NEXT_FIT
+/* Next fit: offset of the free block the next search starts at, or 0
+   for the head.  When the block there leaves the list, the rover
+   moves on to the next one. */
+static size_t rover;
+#endif
+
+#if MM_INSERTION == MM_FIFO
+/* FIFO: offset of the last block in the free list, or 0. */
+static size_t freeListTail;
+#endif
+
+/* Address order: the free list is level 0 of a skip list, so that
+   insertFreeBlock finds a block's place in O(log n) rather than by
+   walking the list.  A free block with room for them keeps, after its
+   prev link, its level L and its links at levels 1 to L:
+
+   +--------------+
+   | sizeAndTags  |
+   +--------------+
+   |  next, prev  |  <-  level 0, as in every build
+   +--------------+
+   |      L       |  <-  blocks of MIN_BLOCK_SIZE have no room for it
+   +--------------+
+   |  next, max   |  <-  for each of levels 1 to L
+   |     ...      |
+   +--------------+
+   |     ...      |
+   | boundary tag |
+   +--------------+
+
+   Level L has probability about 8^-L, capped by the room in the
+   block.  The heap-header stands in for a block of every level before
+   the first one (SKIP_HEAD).
+
+   Each link at level 1 and up also carries the size of the biggest
+   free block from its own block up to the next one at that level (its
+   span), so a first-fit search can skip spans with nothing big enough,
+   and finds the block in O(log n) as well.  Inserting or removing a
+   block recomputes the spans it splits, joins or shrinks from the ones
+   a level below.
+
+   A block's skip words are cleared again when it leaves the list, so
+   known-zero blocks and the clean top of the heap only ever hold the
+   usual free-list words once they are handed out. */
+#if MM_INSERTION == MM_ADDRESS_ORDERED
+#define SKIP_LEVELS 8
+static uint64_t skipRandom = 0x2545f4914f6cdd1dUL;
+#else
+#define SKIP_LEVELS 0
+#endif
+#define SKIP_LEVEL(block) (((size_t*)(block))[3])
+#define SKIP_NEXT(block, level) (((size_t*)(block))[2 + 2 * (level)])
+#define SKIP_MAX(block, level) (((size_t*)(block))[3 + 2 * (level)])
+
+
+/* Bytes at or above cleanLo have never been handed out by this heap,
+   so apart from the free-list words (header, next, prev and boundary
+   tag) of the free blocks there, they read as zero.  This covers the
+   fresh memory at the top of the heap even after it has been merged
+   with dirty free blocks below it, which TAG_ZEROED cannot. */
+static char* cleanLo;
+
+/* Whether large blocks are colored (MM_OPT_COLORING), and the color
+   (index into colorOrder) of the next one. */
+static int colorLargeBlocks = 1;
+static size_t nextColor;
+
+/* Bytes freed since the last mm_compact.  mm_halloc only compacts
+   the heap when at least its request has been freed since, so a heap
+   that only grows is never walked. */
+static size_t freedSinceCompact;
+
+/* Whether the heap lives outside this process, in a file
+   (mm_open_persistent) or a shared memory object (mm_open_shared),
+   and whether to flush it there at every safe point (MM_OPT_SYNC). */
+static int mappedHeap;
+static int syncAtSafePoints;
+
+/* The lock serializing the processes that share a heap, or the
+   threads of this one (MM_OPT_THREADS), or NULL.  It is a recursive
+   mutex in the heap-header, robust and process-shared for a shared
+   heap.  Public calls take it on entry; the recursion lets them call
+   each other. */
+static pthread_mutex_t* heapLock;
+#define LOCK_HEAP() do { if (heapLock != NULL) lockHeap(); } while (0)
+#define UNLOCK_HEAP() do { if (heapLock != NULL) pthread_mutex_unlock(heapLock); } while (0)
+
+/* A safe point is the return from a public call that changed the
+   heap.  The heap is consistent there, so a copy of a heap file taken
+   at one reopens cleanly, and other processes may have the lock. */
+#define SAFE_POINT() do { if (syncAtSafePoints) mem_sync(); UNLOCK_HEAP(); } while (0)
+
+/* The trace file allocator events go to (mm_trace_start), or NULL, and
+   this thread's ring in it.  A thread claims its ring on its first
+   event; threads beyond MM_TRACE_RINGS share one that is never saved. */
+static mm_trace_file_t* traceFile;
+static __thread mm_trace_file_t* traceRingFile;
+static __thread mm_trace_ring_t* traceRing;
+static mm_trace_ring_t traceOverflow;
+
+/* Set while a public call makes others on its own behalf (mm_realloc
+   moving a block), so that only the outer call is recorded. */
+static __thread int traceMuted;
+
+/* Public calls record themselves with TRACE just before their safe
+   point, while they still hold the heap lock, so that the events on a
+   block are numbered in order even when different threads cause them.
+   Costs one test when tracing is off. */
+#define TRACE(op, size, address, previous) \
+  do { \
+    if (traceFile != NULL) { \
+      traceEvent((op), (size), (address), (previous), \
+                 __builtin_return_address(0)); \
+    } \
+  } while (0)
+
+
 /* A BlockInfo contains information about a block, including the size
-   and usage tags, as well as pointers to the next and previous blocks
+   and usage tags, as well as links to the next and previous blocks
    in the free list.  This is exactly the "explicit free list" structure
    illustrated in the lecture slides.
+
+   The links are byte offsets from the start of the heap rather than
+   pointers, so that a heap kept in a file (mm_open_persistent) is
+   still valid wherever it gets mapped the next time.  Offset 0 is the
+   heap-header, which is never a block, and stands for NULL.
    
    Note that the next and prev pointers and the boundary tag are only
    needed when the block is free.  To achieve better utilization, mm_malloc
@@ -67,23 +274,175 @@ struct BlockInfo {
   // block and its predecessor in memory are in use.  See the SIZE()
   // and TAG macros, below, for more details.
   size_t sizeAndTags;
-  // Pointer to the next block in the free list.
-  struct BlockInfo* next;
-  // Pointer to the previous block in the free list.
-  struct BlockInfo* prev;
+  // Offset of the next block in the free list.
+  size_t next;
+  // Offset of the previous block in the free list.
+  size_t prev;
 };
 typedef struct BlockInfo BlockInfo;
 
 
-/* Pointer to the first BlockInfo in the free list, the list's head. 
+/* An entry in the handle table.  Handle h refers to entry h - 1.  A
+   relocatable block stores the index of its entry in the first word
+   of its payload, so that mm_compact can find the entry to update
+   when it moves the block.
+
+   +--------------+
+   | sizeAndTags  |
+   +--------------+
+   | table index  |
+   +--------------+
+   |   payload    |  <-  Pointers returned by mm_hlock point here
+   |     ...      |
+   +--------------+
+*/
+typedef struct {
+  // The block, or NULL if the entry is not in use.
+  BlockInfo* block;
+  // Lock count of the block.  For an entry not in use, the index of
+  // the next unused entry instead.
+  size_t locks;
+} HandleEntry;
+
+/* The handle table itself is an ordinary (pinned) mm_malloc block,
+   grown with mm_realloc. */
+static HandleEntry* handleTable;
+static size_t handleCount;
+// First unused entry, or handleCount if there is none.
+static size_t freeHandle;
+
+
+/* Size classes.  Every SAMPLE_PERIOD-th mm_malloc request records its
+   block size in a small histogram.  After every EPOCH_SAMPLES samples,
+   the sizes that made up at least 1/CLASS_SHARE of them become the
+   size classes (at most NUM_CLASSES), and the histogram is halved so
+   that it follows the workload.
+
+   Each class caches freed blocks of exactly its size, linked through
+   their next field, and hands them out again without searching or
+   splitting.  A cached block keeps TAG_USED, so its neighbours do not
+   coalesce with it.  When the cache is empty, a slab of up to
+   slabBlocks blocks is carved at once.  A class that is dropped, and
+   every cache when the heap would otherwise have to grow, is drained
+   back into the free list.  Live blocks are never touched: a block of
+   a dropped class is simply freed the normal way. */
+#define SAMPLE_PERIOD 16
+#define EPOCH_SAMPLES 128
+#define CLASS_SHARE 16
+#define NUM_CLASSES MM_NUM_CLASSES
+#define HIST_SLOTS 64
+// A slab is at most this many bytes (but at least one block).
+#define SLAB_BYTES 4096
+// A class caches at most this many slabs' worth of freed blocks.
+#define CACHE_SLABS 4
+
+typedef struct {
+  // Block size of the class, or 0 for an unused slot.
+  size_t blockSize;
+  // Cached free blocks.
+  BlockInfo* head;
+  size_t cached;
+  // Blocks carved per refill.
+  size_t slabBlocks;
+  // Counters since the class was created.
+  size_t hits;
+  size_t refills;
+  size_t epochCreated;
+} SizeClass;
+
+static SizeClass sizeClasses[NUM_CLASSES];
+static int numClasses;
+
+// The histogram: block sizes with their (decaying) sample counts,
+// open addressed on the size.
+static struct {
+  size_t blockSize;
+  size_t count;
+} sizeHistogram[HIST_SLOTS];
+static size_t sampleCountdown;
+static size_t epochSamples;
+
+// Counters over the whole run.
+static size_t classEpochs;
+static size_t classesRetired;
+static size_t classDrains;
+
+/* Event counters for mm_stats, since mm_init.  Only these increments
+   happen on the hot path; mm_stats works out everything else by
+   walking the heap when it is asked.  Blocks are binned by size (see
+   statsBin). */
+static size_t sbrkCalls;
+static size_t splitCounts[MM_STATS_BINS];
+static size_t coalesceCounts[MM_STATS_BINS];
+
+/* The heap profiler (mm_profile_start) samples about one allocation
+   per profileInterval bytes.  The gaps between samples are drawn from
+   an exponential distribution with that mean, so that every byte is
+   equally likely to be sampled whatever the allocation pattern.
+   profileCountdown counts down the bytes to the next sample, and is
+   all an allocation that is not sampled touches; while the profiler
+   is off it starts so high that it never runs out.
+
+   A sampled block's stack is kept, open addressed on the block, until
+   the block is freed.  Frees only look there while some block is
+   sampled. */
+#define PROFILE_SLOTS 8192
+#define PROFILE_DEPTH 24
+
+typedef struct {
+  void* ptr;          // the block, NULL for an empty slot
+  size_t size;        // what the caller asked for
+  int depth;
+  void* stack[PROFILE_DEPTH];
+} ProfileSample;
+
+static ProfileSample profileSamples[PROFILE_SLOTS];
+static size_t profileLive;
+static size_t profileDropped;
+static size_t profileInterval;
+static ssize_t profileCountdown = SSIZE_MAX;
+static uint64_t profileRandom = 0x2545f4914f6cdd1dUL;
+
+#define PROFILE(ptr, size) \
+  do { \
+    if ((profileCountdown -= (ssize_t)(size)) < 0) { \
+      profileSample((ptr), (size)); \
+    } \
+  } while (0)
+
+/* Where the incremental heap check (mm_check_mode) carries on: the
+   offset of the next block it looks at, or 0 for the first block.
+   Whatever merges that block into the one before it moves the cursor
+   back to the start of the merged block.  (Another process sharing
+   the heap cannot do that, so there only the other modes are
+   reliable.) */
+static size_t checkCursor;
+static uint64_t checkRandom = 0x9e3779b97f4a7c15UL;
+
+
+/* Start of the heap, mem_heap_lo(), which free-list offsets are
+   relative to.  Set by mm_init and mm_open_persistent. */
+static char* heapBase;
+
+/* Convert between a block and its free-list offset. */
+#define BLOCK_OFFSET(block) ((block) == NULL ? 0 : (size_t)((char*)(block) - heapBase))
+#define OFFSET_BLOCK(offset) ((offset) == 0 ? NULL : (BlockInfo*)(heapBase + (offset)))
+
+/* The blocks before and after a free block in the free list. */
+#define NEXT_FREE(block) OFFSET_BLOCK((block)->next)
+#define PREV_FREE(block) OFFSET_BLOCK((block)->prev)
+
+/* Offset of the first BlockInfo in the free list, the list's head. 
    
-   A pointer to the head of the free list in this implementation is
-   always stored in the first word in the heap.  mem_heap_lo() returns
-   a pointer to the first word in the heap, so we cast the result of
-   mem_heap_lo() to a BlockInfo** (a pointer to a pointer to
-   BlockInfo) and dereference this to get a pointer to the first
-   BlockInfo in the free list. */
-#define FREE_LIST_HEAD *((BlockInfo **)mem_heap_lo())
+   The head of the free list in this implementation is always stored
+   in the first word of the heap-header.  The second word holds the
+   offset of the root object (see mm_set_root), and the heap lock of a
+   shared heap comes after that. */
+#define FREE_LIST_HEAD (*(size_t*)heapBase)
+#define ROOT_OFFSET (*(size_t*)(heapBase + WORD_SIZE))
+#define HEAP_LOCK ((pthread_mutex_t*)(heapBase + 2 * WORD_SIZE))
+#define SKIP_HEAD(level) (((size_t*)(heapBase + 2 * WORD_SIZE + sizeof(pthread_mutex_t)))[2 * (level) - 2])
+#define SKIP_HEAD_MAX(level) (((size_t*)(heapBase + 2 * WORD_SIZE + sizeof(pthread_mutex_t)))[2 * (level) - 1])
 
 /* Size of a word on this architecture. */
 #define WORD_SIZE sizeof(void*)
@@ -92,8 +451,21 @@ typedef struct BlockInfo BlockInfo;
    and boundary tag) */
 #define MIN_BLOCK_SIZE (sizeof(BlockInfo) + WORD_SIZE)
 
-/* Alignment of blocks returned by mm_malloc. */
+/* Alignment of blocks returned by mm_malloc.  Block sizes are
+   multiples of it, so every payload stays aligned once the first one
+   is.  libmm.so is built with MM_ALIGNMENT=16, which is what the C
+   library's malloc guarantees on 64-bit targets. */
+#ifdef MM_ALIGNMENT
+#define ALIGNMENT MM_ALIGNMENT
+#else
 #define ALIGNMENT 8
+#endif
+
+/* Size of the heap-header: the free-list head, the root offset, the
+   heap lock and any skip-list heads, padded so that the first payload
+   is aligned. */
+#define HEAP_HEADER_SIZE ((2 * WORD_SIZE + sizeof(pthread_mutex_t) + 2 * SKIP_LEVELS * WORD_SIZE + WORD_SIZE + \
+                           ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT - WORD_SIZE)
 
 /* SIZE(blockInfo->sizeAndTags) extracts the size of a 'sizeAndTags' field.
    Also, calling SIZE(size) selects just the higher bits of 'size' to ensure
@@ -107,11 +479,12 @@ typedef struct BlockInfo BlockInfo;
         ^                                       ^
       high bit                               low bit
 
-   Since ALIGNMENT == 8, we reserve the low 3 bits of sizeAndTags for tag
+   Since ALIGNMENT >= 8, we reserve the low 3 bits of sizeAndTags for tag
    bits, and we use bits 3-63 to store the size.
 
    Bit 0 (2^0 == 1): TAG_USED
    Bit 1 (2^1 == 2): TAG_PRECEDING_USED
+   Bit 2 (2^2 == 4): TAG_ZEROED (free blocks only)
 */
 #define SIZE(x) ((x) & ~(ALIGNMENT - 1))
 
@@ -124,57 +497,415 @@ typedef struct BlockInfo BlockInfo;
    of the previous block from its boundary tag */
 #define TAG_PRECEDING_USED 2
 
+/* TAG_ZEROED marks a free block whose bytes are all known to be zero,
+   except for the words the free list itself writes: the header, the
+   next and prev pointers, and the boundary tag.  mm_trim leaves purged
+   blocks this way, and mm_calloc can hand such a block out after
+   clearing just those few words. */
+#define TAG_ZEROED 4
+
+/* Large blocks get their payloads staggered within a page: the n-th
+   large block's payload starts at one of NUM_COLORS offsets spread
+   evenly over COLOR_SPAN, taken in bit-reversed order so that blocks
+   allocated one after the other land far apart.  Otherwise big arrays
+   tend to start at the same offset within a page, map to the same
+   cache sets, and stall on 4K aliasing when a loop walks several of
+   them together.  (Offsets only a few cache lines apart are no good:
+   a load running just ahead of a store to another array aliases it.)
+   The lead gap this costs (under COLOR_SPAN bytes) becomes a free
+   block. */
+#define COLOR_MIN_SIZE (32 * 1024)
+#define NUM_COLORS 8
+#define COLOR_SPAN 4096
+static const unsigned char colorOrder[NUM_COLORS] = { 0, 4, 2, 6, 1, 5, 3, 7 };
+
+/* mm_trim purges free blocks at least this big (hands their pages
+   back to the OS via mem_purge) so they come back zeroed.  This is not
+   done on every free: the page faults to bring the memory back cost
+   far more than the allocator saves. */
+#define PURGE_THRESHOLD (64 * 1024)
+
+
+/* Largest payload any request may ask for.  Nothing bigger could ever
+   fit in the heap, and rounding it up to a block size could wrap. */
+#define MAX_REQUEST ((size_t)1 << 48)
+
+/* Convert a payload size requested by the user into the size of the
+   block that mm_malloc carves out for it (size <= MAX_REQUEST). */
+static size_t requestToBlockSize(size_t size) {
+  // Add one word for the initial size header.
+  // Note that we don't need to boundary tag when the block is used!
+  size += WORD_SIZE;
+  if (size <= MIN_BLOCK_SIZE) {
+    // Make sure we allocate enough space for a blockInfo in case we
+    // free this block (when we free this block, we'll need to use the
+    // next pointer, the prev pointer, and the boundary tag).
+    return MIN_BLOCK_SIZE;
+  }
+  // Round up for correct alignment
+  return ALIGNMENT * ((size + ALIGNMENT - 1) / ALIGNMENT);
+}
+
+/* Number of bytes to skip from the start of 'block' so that the
+   payload lands 'offset' bytes past an 'align' boundary.  The skipped
+   bytes become a free block of their own, so the gap is either 0 or
+   at least MIN_BLOCK_SIZE. */
+static size_t alignedGap(BlockInfo* block, size_t align, size_t offset) {
+  size_t payload = (size_t)UNSCALED_POINTER_ADD(block, WORD_SIZE);
+  size_t gap = (offset - payload) & (align - 1);
+  while (gap != 0 && gap < MIN_BLOCK_SIZE) {
+    gap += align;
+  }
+  return gap;
+}
+
+/* The mm_stats bin of a block of blockSize bytes: bin i holds blocks
+   of MIN_BLOCK_SIZE << i bytes up to twice that, and the last bin
+   everything bigger. */
+static int statsBin(size_t blockSize) {
+  int bin = 63 - __builtin_clzl(blockSize / MIN_BLOCK_SIZE);
+  return bin < MM_STATS_BINS ? bin : MM_STATS_BINS - 1;
+}
+
+#if MM_INSERTION == MM_ADDRESS_ORDERED
+/* The link and the span size of 'node' at 'level', where NULL stands
+   for the heap-header. */
+static size_t* skipNext(BlockInfo* node, int level) {
+  return node != NULL ? &SKIP_NEXT(node, level) : &SKIP_HEAD(level);
+}
+
+static size_t* skipMax(BlockInfo* node, int level) {
+  return node != NULL ? &SKIP_MAX(node, level) : &SKIP_HEAD_MAX(level);
+}
+
+/* Work out the span size of 'node' at 'level' from the blocks of its
+   span (level 1), or from the spans one level down that make it up. */
+static size_t skipSpanMax(BlockInfo* node, int level) {
+  size_t end = *skipNext(node, level);
+  size_t max = 0;
+
+  if (level == 1) {
+    BlockInfo* block = node != NULL ? node : OFFSET_BLOCK(FREE_LIST_HEAD);
+    for (; block != NULL && BLOCK_OFFSET(block) != end; block = NEXT_FREE(block)) {
+      if (SIZE(block->sizeAndTags) > max) {
+        max = SIZE(block->sizeAndTags);
+      }
+    }
+  } else {
+    do {
+      if (*skipMax(node, level - 1) > max) {
+        max = *skipMax(node, level - 1);
+      }
+      node = OFFSET_BLOCK(*skipNext(node, level - 1));
+    } while (node != NULL && BLOCK_OFFSET(node) != end);
+  }
+  return max;
+}
+
+/* Fill in below[level], for each level from 1 up, with the last node
+   at that level below 'block' (NULL for the heap-header). */
+static void skipBelow(BlockInfo* block, BlockInfo** below) {
+  BlockInfo* node = NULL;
+  int level;
+
+  for (level = SKIP_LEVELS; level > 0; level--) {
+    size_t next;
+    while ((next = *skipNext(node, level)) != 0 && OFFSET_BLOCK(next) < block) {
+      node = OFFSET_BLOCK(next);
+    }
+    below[level] = node;
+  }
+}
+
+/* A random skip-list level for a free block of 'size' bytes: L with
+   probability about 8^-L, but no more than it has room for between
+   its prev link and its boundary tag. */
+static int skipLevel(size_t size) {
+  int room = ((int)(size / WORD_SIZE) - 5) / 2;
+  int level;
+
+  // xorshift64
+  skipRandom ^= skipRandom << 13;
+  skipRandom ^= skipRandom >> 7;
+  skipRandom ^= skipRandom << 17;
+  level = __builtin_ctzll(skipRandom | (1ULL << 62)) / 3;
+  if (level > room) {
+    level = room;
+  }
+  return level < SKIP_LEVELS ? level : SKIP_LEVELS;
+}
+
+/* Link freeBlock, already in level 0, into the levels above, given
+   the nodes below it at each level. */
+static void skipInsert(BlockInfo* freeBlock, BlockInfo** below) {
+  size_t size = SIZE(freeBlock->sizeAndTags);
+  int top = 0;
+  int level;
+
+  if (size > MIN_BLOCK_SIZE) {
+    top = skipLevel(size);
+    SKIP_LEVEL(freeBlock) = top;
+  }
+  for (level = 1; level <= SKIP_LEVELS; level++) {
+    if (level <= top) {
+      // It splits the span it lands in.
+      SKIP_NEXT(freeBlock, level) = *skipNext(below[level], level);
+      *skipNext(below[level], level) = BLOCK_OFFSET(freeBlock);
+      SKIP_MAX(freeBlock, level) = skipSpanMax(freeBlock, level);
+      *skipMax(below[level], level) = skipSpanMax(below[level], level);
+    } else if (*skipMax(below[level], level) < size) {
+      *skipMax(below[level], level) = size;
+    }
+  }
+}
+
+/* Unlink freeBlock, already out of level 0, from the levels above,
+   and clear its skip words. */
+static void skipRemove(BlockInfo* freeBlock) {
+  BlockInfo* below[SKIP_LEVELS + 1];
+  size_t size = SIZE(freeBlock->sizeAndTags);
+  int top = size > MIN_BLOCK_SIZE ? (int)SKIP_LEVEL(freeBlock) : 0;
+  int level;
+
+  skipBelow(freeBlock, below);
+  for (level = 1; level <= SKIP_LEVELS; level++) {
+    if (level <= top) {
+      // Its span joins the one before.
+      *skipNext(below[level], level) = SKIP_NEXT(freeBlock, level);
+      SKIP_NEXT(freeBlock, level) = 0;
+      SKIP_MAX(freeBlock, level) = 0;
+      *skipMax(below[level], level) = skipSpanMax(below[level], level);
+    } else if (*skipMax(below[level], level) == size) {
+      // It may have been the biggest in its span.
+      *skipMax(below[level], level) = skipSpanMax(below[level], level);
+    }
+  }
+  if (size > MIN_BLOCK_SIZE) {
+    SKIP_LEVEL(freeBlock) = 0;
+  }
+}
+
+#if MM_PLACEMENT == MM_FIRST_FIT
+/* First fit by address: follow each level as far as the first span
+   with a block big enough, and go down into it. */
+static BlockInfo* skipSearch(size_t reqSize) {
+  BlockInfo* node = NULL;
+  int level;
+  INSTRUMENT(size_t visited = 0);
+
+  for (level = SKIP_LEVELS; level > 0; level--) {
+    while (*skipMax(node, level) < reqSize) {
+      INSTRUMENT(visited++);
+      if ((node = OFFSET_BLOCK(*skipNext(node, level))) == NULL) {
+        INSTRUMENT(instrument.search_length[histBucket(visited)]++);
+        return NULL;
+      }
+    }
+  }
+  if (node == NULL) {
+    node = OFFSET_BLOCK(FREE_LIST_HEAD);
+  }
+  while (SIZE(node->sizeAndTags) < reqSize) {
+    INSTRUMENT(visited++);
+    node = NEXT_FREE(node);
+  }
+  INSTRUMENT(instrument.search_length[histBucket(visited + 1)]++);
+  return node;
+}
+#endif
+#endif
 
-/* Find a free block of the requested size in the free list.  Returns
-   NULL if no free block is large enough. */
+/* Find a free block of the requested size in the free list, as the
+   placement policy says.  Returns NULL if no free block is large
+   enough. */
 static void * searchFreeList(size_t reqSize) {   
   BlockInfo* freeBlock;
+  BlockInfo* found = NULL;
+  INSTRUMENT(size_t visited = 0);
 
-  freeBlock = FREE_LIST_HEAD;
-  while (freeBlock != NULL){
+#if MM_PLACEMENT == MM_NEXT_FIT
+  // Go once round the list, starting at the rover.
+  BlockInfo* start = rover != 0 ? OFFSET_BLOCK(rover) : OFFSET_BLOCK(FREE_LIST_HEAD);
+
+  freeBlock = start;
+  while (freeBlock != NULL) {
+    INSTRUMENT(visited++);
+    if (SIZE(freeBlock->sizeAndTags) >= reqSize) {
+      found = freeBlock;
+      // Taking it out of the list moves the rover on past it.
+      rover = BLOCK_OFFSET(found);
+      break;
+    }
+    freeBlock = freeBlock->next != 0 ? NEXT_FREE(freeBlock) : OFFSET_BLOCK(FREE_LIST_HEAD);
+    if (freeBlock == start) {
+      break;
+    }
+  }
+#elif MM_PLACEMENT == MM_FIRST_FIT && MM_INSERTION == MM_ADDRESS_ORDERED
+  (void)freeBlock;
+  return skipSearch(reqSize);
+#elif MM_PLACEMENT == MM_FIRST_FIT
+  for (freeBlock = OFFSET_BLOCK(FREE_LIST_HEAD); freeBlock != NULL; freeBlock = NEXT_FREE(freeBlock)) {
+    INSTRUMENT(visited++);
     if (SIZE(freeBlock->sizeAndTags) >= reqSize) {
+      found = freeBlock;
+      break;
+    }
+  }
+#else
+  // Keep the smallest block that fits.  Best fit only stops early at
+  // an exact fit, good fit at one that is close enough.
+  size_t slack = MM_PLACEMENT == MM_GOOD_FIT ? reqSize / GOOD_FIT_SLACK : 0;
+
+  for (freeBlock = OFFSET_BLOCK(FREE_LIST_HEAD); freeBlock != NULL; freeBlock = NEXT_FREE(freeBlock)) {
+    size_t size = SIZE(freeBlock->sizeAndTags);
+    INSTRUMENT(visited++);
+    if (size >= reqSize && (found == NULL || size < SIZE(found->sizeAndTags))) {
+      found = freeBlock;
+      if (size - reqSize <= slack) {
+        break;
+      }
+    }
+  }
+#endif
+  INSTRUMENT(instrument.search_length[histBucket(visited)]++);
+  return found;
+}
+
+/* Find a free block that can hold a block of reqSize bytes whose
+   payload is 'offset' bytes past an 'align' boundary, after giving up
+   the leading gap.  The gap is returned through gapOut.  Returns NULL
+   if no free block is large enough. */
+static void * searchAlignedFreeList(size_t reqSize, size_t align, size_t offset,
+                                    size_t* gapOut) {
+  BlockInfo* freeBlock;
+  INSTRUMENT(size_t visited = 0);
+
+  freeBlock = OFFSET_BLOCK(FREE_LIST_HEAD);
+  while (freeBlock != NULL){
+    size_t gap = alignedGap(freeBlock, align, offset);
+    INSTRUMENT(visited++);
+    if (SIZE(freeBlock->sizeAndTags) >= gap + reqSize) {
+      INSTRUMENT(instrument.search_length[histBucket(visited)]++);
+      *gapOut = gap;
       return freeBlock;
-    } else {
-      freeBlock = freeBlock->next;
     }
+    freeBlock = NEXT_FREE(freeBlock);
   }
+  INSTRUMENT(instrument.search_length[histBucket(visited)]++);
   return NULL;
 }
            
-/* Insert freeBlock at the head of the list.  (LIFO) */
+/* Insert freeBlock into the free list where the insertion policy
+   says: at the head (LIFO), at the tail (FIFO), or after the last
+   block below it in memory (address-ordered). */
 static void insertFreeBlock(BlockInfo* freeBlock) {
-  BlockInfo* oldHead = FREE_LIST_HEAD;
-  freeBlock->next = oldHead;
+#if MM_INSERTION == MM_LIFO
+  BlockInfo* oldHead = OFFSET_BLOCK(FREE_LIST_HEAD);
+  freeBlock->next = FREE_LIST_HEAD;
   if (oldHead != NULL) {
-    oldHead->prev = freeBlock;
+    oldHead->prev = BLOCK_OFFSET(freeBlock);
+  }
+  // The head has no previous block.  Nothing follows a NULL prev, but
+  // leaving a stale one here would hide real link errors from mm_check.
+  freeBlock->prev = 0;
+  FREE_LIST_HEAD = BLOCK_OFFSET(freeBlock);
+#else
+  BlockInfo* prevFree;
+  BlockInfo* nextFree;
+
+#if MM_INSERTION == MM_FIFO
+  prevFree = OFFSET_BLOCK(freeListTail);
+  nextFree = NULL;
+  freeListTail = BLOCK_OFFSET(freeBlock);
+#else
+  BlockInfo* below[SKIP_LEVELS + 1];
+
+  // Skip to the last block below it at level 1, then walk level 0.
+  skipBelow(freeBlock, below);
+  prevFree = below[1];
+  nextFree = prevFree != NULL ? NEXT_FREE(prevFree) : OFFSET_BLOCK(FREE_LIST_HEAD);
+  while (nextFree != NULL && nextFree < freeBlock) {
+    prevFree = nextFree;
+    nextFree = NEXT_FREE(nextFree);
+  }
+  if (nextFree != NULL) {
+    nextFree->prev = BLOCK_OFFSET(freeBlock);
   }
-  //  freeBlock->prev = NULL;
-  FREE_LIST_HEAD = freeBlock;
+#endif
+  freeBlock->next = BLOCK_OFFSET(nextFree);
+  freeBlock->prev = BLOCK_OFFSET(prevFree);
+  if (prevFree != NULL) {
+    prevFree->next = BLOCK_OFFSET(freeBlock);
+  } else {
+    FREE_LIST_HEAD = BLOCK_OFFSET(freeBlock);
+  }
+#if MM_INSERTION == MM_ADDRESS_ORDERED
+  skipInsert(freeBlock, below);
+#endif
+#endif
 }      
 
 /* Remove a free block from the free list. */
 static void removeFreeBlock(BlockInfo* freeBlock) {
   BlockInfo *nextFree, *prevFree;
   
-  nextFree = freeBlock->next;
-  prevFree = freeBlock->prev;
+  nextFree = NEXT_FREE(freeBlock);
+  prevFree = PREV_FREE(freeBlock);
+#if MM_PLACEMENT == MM_NEXT_FIT
+  if (rover == BLOCK_OFFSET(freeBlock)) {
+    rover = freeBlock->next;
+  }
+#endif
+#if MM_INSERTION == MM_FIFO
+  if (nextFree == NULL) {
+    freeListTail = freeBlock->prev;
+  }
+#endif
 
-  // If the next block is not null, patch its prev pointer.
+  // If the next block is not null, patch its prev link.
   if (nextFree != NULL) {
-    nextFree->prev = prevFree;
+    nextFree->prev = freeBlock->prev;
   }
 
   // If we're removing the head of the free list, set the head to be
-  // the next block, otherwise patch the previous block's next pointer.
-  if (freeBlock == FREE_LIST_HEAD) {
-    FREE_LIST_HEAD = nextFree;
+  // the next block, otherwise patch the previous block's next link.
+  if (freeBlock == OFFSET_BLOCK(FREE_LIST_HEAD)) {
+    FREE_LIST_HEAD = freeBlock->next;
   } else {
-    prevFree->next = nextFree;
+    prevFree->next = freeBlock->next;
+  }
+#if MM_INSERTION == MM_ADDRESS_ORDERED
+  skipRemove(freeBlock);
+#endif
+}
+
+/* The free blocks running from 'first' up to 'end' are being merged
+   into one.  Zero their header, next, prev and boundary tag words that
+   lie at or above 'lo' and end up inside the merged block (everything
+   but the outer header and boundary tag, which it reuses).  Sizes are
+   read from the headers before they are cleared. */
+static void clearFreeListWords(BlockInfo* first, BlockInfo* end, void* lo) {
+  BlockInfo* block = first;
+  while (block != end) {
+    BlockInfo* following = (BlockInfo*)UNSCALED_POINTER_ADD(block, SIZE(block->sizeAndTags));
+    if ((void*)UNSCALED_POINTER_ADD(block, sizeof(BlockInfo)) > lo) {
+      if (block != first) {
+        block->sizeAndTags = 0;
+      }
+      block->next = 0;
+      block->prev = 0;
+    }
+    if (following != end && (void*)following > lo) {
+      *(size_t*)UNSCALED_POINTER_SUB(following, WORD_SIZE) = 0;
+    }
+    block = following;
   }
 }
 
-/* Coalesce 'oldBlock' with any preceeding or following free blocks. */
-static void coalesceFreeBlock(BlockInfo* oldBlock) {
+/* Coalesce 'oldBlock' with any preceeding or following free blocks.
+   Returns the (possibly larger) free block that now contains it. */
+static BlockInfo* coalesceFreeBlock(BlockInfo* oldBlock) {
   BlockInfo *blockCursor;
   BlockInfo *newBlock;
   BlockInfo *freeBlock;
@@ -182,6 +913,9 @@ static void coalesceFreeBlock(BlockInfo* oldBlock) {
   size_t oldSize = SIZE(oldBlock->sizeAndTags);
   // running sum to be size of final coalesced block
   size_t newSize = oldSize;
+  // stays set only if every merged block is known to be zero
+  size_t zeroedTag = oldBlock->sizeAndTags & TAG_ZEROED;
+  INSTRUMENT(int merged = 1);
 
   // Coalesce with any preceding free block
   blockCursor = oldBlock;
@@ -198,7 +932,9 @@ static void coalesceFreeBlock(BlockInfo* oldBlock) {
 
     // Count that block's size and update the current block pointer.
     newSize += size;
+    zeroedTag &= freeBlock->sizeAndTags;
     blockCursor = freeBlock;
+    INSTRUMENT(merged++);
   }
   newBlock = blockCursor;
 
@@ -213,31 +949,163 @@ static void coalesceFreeBlock(BlockInfo* oldBlock) {
     removeFreeBlock(blockCursor);
     // Count its size and step to the following block.
     newSize += size;
+    zeroedTag &= blockCursor->sizeAndTags;
     blockCursor = (BlockInfo*)UNSCALED_POINTER_ADD(blockCursor, size);
+    INSTRUMENT(merged++);
   }
   
+  INSTRUMENT(instrument.coalesce_fanin[merged < MM_HIST_BUCKETS ?
+                                        merged : MM_HIST_BUCKETS - 1]++);
+
   // If the block actually grew, remove the old entry from the free
   // list and add the new entry.
   if (newSize != oldSize) {
     // Remove the original block from the free list
     removeFreeBlock(oldBlock);
+    if (checkCursor > BLOCK_OFFSET(newBlock) && checkCursor < BLOCK_OFFSET(blockCursor)) {
+      checkCursor = BLOCK_OFFSET(newBlock);
+    }
+
+    // The free-list words of the merged blocks are now in the middle
+    // of the new block.  Clear them if that keeps it known-zero, or
+    // at least the ones in the clean part of the heap.
+    if (zeroedTag) {
+      clearFreeListWords(newBlock, blockCursor, newBlock);
+    } else if ((char*)blockCursor > cleanLo) {
+      clearFreeListWords(newBlock, blockCursor, cleanLo);
+    }
 
     // Save the new size in the block info and in the boundary tag
     // and tag it to show the preceding block is used (otherwise, it
     // would have become part of this one!).
-    newBlock->sizeAndTags = newSize | TAG_PRECEDING_USED;
+    newBlock->sizeAndTags = newSize | TAG_PRECEDING_USED | zeroedTag;
     // The boundary tag of the preceding block is the word immediately
     // preceding block in memory where we left off advancing blockCursor.
-    *(size_t*)UNSCALED_POINTER_SUB(blockCursor, WORD_SIZE) = newSize | TAG_PRECEDING_USED;  
+    *(size_t*)UNSCALED_POINTER_SUB(blockCursor, WORD_SIZE) = newSize | TAG_PRECEDING_USED | zeroedTag;
 
     // Put the new block in the free list.
     insertFreeBlock(newBlock);
+    coalesceCounts[statsBin(newSize)]++;
+  }
+  return newBlock;
+}
+
+/* Append an event to this thread's trace ring (see mmtrace.h).  The
+   record is filled in before the head moves past it, so a reader only
+   ever sees complete records. */
+static void traceEvent(int op, size_t size, void* address, size_t previous,
+                       void* caller) {
+  mm_trace_ring_t* ring;
+  mm_trace_record_t* record;
+  uint64_t head;
+
+  if (traceMuted) {
+    return;
+  }
+  if (traceRingFile != traceFile) {
+    uint64_t index = __atomic_fetch_add(&traceFile->rings, 1, __ATOMIC_RELAXED);
+    traceRing = index < MM_TRACE_RINGS ? &traceFile->ring[index] : &traceOverflow;
+    traceRing->tid = syscall(SYS_gettid);
+    traceRingFile = traceFile;
+  }
+  ring = traceRing;
+  head = ring->head;
+  record = &ring->records[head % MM_TRACE_RECORDS];
+  record->seq = __atomic_fetch_add(&traceFile->events, 1, __ATOMIC_RELAXED);
+  record->size_and_op = (uint64_t)size << 8 | op;
+  record->address = (uintptr_t)address;
+  record->previous = previous;
+  record->caller = (uintptr_t)caller;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* The number of bytes until the next sample: exponentially
+   distributed with mean profileInterval. */
+static ssize_t nextSampleGap() {
+  double uniform;
+
+  // xorshift64*, scaled into (0, 1]
+  profileRandom ^= profileRandom >> 12;
+  profileRandom ^= profileRandom << 25;
+  profileRandom ^= profileRandom >> 27;
+  uniform = ((profileRandom * 0x2545f4914f6cdd1dUL >> 11) + 1) / 9007199254740992.0;
+  return (ssize_t)(-log(uniform) * profileInterval) + 1;
+}
+
+/* The slot of the sample of block ptr, or the empty slot where it
+   would go. */
+static ProfileSample* findSample(void* ptr) {
+  size_t i = ((uintptr_t)ptr >> 3) * 0x9e3779b97f4a7c15UL % PROFILE_SLOTS;
+
+  while (profileSamples[i].ptr != NULL && profileSamples[i].ptr != ptr) {
+    i = (i + 1) % PROFILE_SLOTS;
+  }
+  return &profileSamples[i];
+}
+
+/* _Unwind_Backtrace callback: store one return address. */
+static _Unwind_Reason_Code addFrame(struct _Unwind_Context* context, void* arg) {
+  ProfileSample* sample = arg;
+
+  void* pc = (void*)_Unwind_GetIP(context);
+
+  if (sample->depth == PROFILE_DEPTH || pc == NULL) {
+    return _URC_END_OF_STACK;
+  }
+  sample->stack[sample->depth++] = pc;
+  return _URC_NO_REASON;
+}
+
+/* The countdown ran out on block ptr: remember where it was allocated
+   and start the next countdown.  Not inlined, so the frames to skip
+   are this one and the public call's.  (_Unwind_Backtrace, unlike
+   backtrace(3), never calls malloc.) */
+__attribute__((noinline))
+static void profileSample(void* ptr, size_t size) {
+  ProfileSample* sample;
+  ProfileSample frames;
+
+  profileCountdown = nextSampleGap();
+  if (profileLive >= PROFILE_SLOTS / 2) {
+    profileDropped++;
+    return;
+  }
+  frames.depth = 0;
+  _Unwind_Backtrace(addFrame, &frames);
+  sample = findSample(ptr);
+  sample->ptr = ptr;
+  sample->size = size;
+  sample->depth = frames.depth > 2 ? frames.depth - 2 : 0;
+  memcpy(sample->stack, frames.stack + 2, sample->depth * sizeof(void*));
+  profileLive++;
+}
+
+/* Block ptr is being freed: drop its sample if it has one.  The
+   samples after it in its run are put back where a search finds them
+   without the freed slot. */
+static void profileForget(void* ptr) {
+  ProfileSample* sample = findSample(ptr);
+  size_t i;
+
+  if (sample->ptr == NULL) {
+    return;
+  }
+  sample->ptr = NULL;
+  profileLive--;
+  for (i = (sample - profileSamples + 1) % PROFILE_SLOTS;
+       profileSamples[i].ptr != NULL;
+       i = (i + 1) % PROFILE_SLOTS) {
+    ProfileSample* home = findSample(profileSamples[i].ptr);
+    if (home != &profileSamples[i]) {
+      *home = profileSamples[i];
+      profileSamples[i].ptr = NULL;
+    }
   }
-  return;
 }
 
-/* Get more heap space of size at least reqSize. */
-static void requestMoreSpace(size_t reqSize) {
+/* Get more heap space of size at least reqSize.  Returns -1, leaving
+   the heap as it was, if the heap cannot grow that far. */
+static int requestMoreSpace(size_t reqSize) {
   size_t pagesize = mem_pagesize();
   size_t numPages = (reqSize + pagesize - 1) / pagesize;
   BlockInfo *newBlock;
@@ -245,10 +1113,11 @@ static void requestMoreSpace(size_t reqSize) {
   size_t prevLastWordMask;
 
   void* mem_sbrk_result = mem_sbrk(totalSize);
+  sbrkCalls++;
   if ((size_t)mem_sbrk_result == -1) {
-    printf("ERROR: mem_sbrk failed in requestMoreSpace\n");
-    exit(0);
+    return -1;
   }
+  TRACE(MM_TRACE_SBRK, totalSize, mem_sbrk_result, 0);
   newBlock = (BlockInfo*)UNSCALED_POINTER_SUB(mem_sbrk_result, WORD_SIZE);
 
   /* initialize header, inherit TAG_PRECEDING_USED status from the
@@ -272,211 +1141,135 @@ static void requestMoreSpace(size_t reqSize) {
   // allocated memory space
   insertFreeBlock(newBlock);
   coalesceFreeBlock(newBlock);
+  return 0;
 }
 
-
-/* Print the heap by iterating through it as an implicit free list. */
-static void examine_heap() {
-  BlockInfo *block;
-
-  /* print to stderr so output isn't buffered and not output if we crash */
-  fprintf(stderr, "FREE_LIST_HEAD: %p\n", (void *)FREE_LIST_HEAD);
-
-  for (block = (BlockInfo *)UNSCALED_POINTER_ADD(mem_heap_lo(), WORD_SIZE); /* first block on hea\
-									       p */
-       SIZE(block->sizeAndTags) != 0 && (void*)block < (void*)mem_heap_hi();
-       block = (BlockInfo *)UNSCALED_POINTER_ADD(block, SIZE(block->sizeAndTags))) {
-
-    /* print out common block attributes */
-    fprintf(stderr, "%p: %ld %ld %ld\t",
-            (void *)block,
-            SIZE(block->sizeAndTags),
-            block->sizeAndTags & TAG_PRECEDING_USED,
-            block->sizeAndTags & TAG_USED);
-
-    /* and allocated/free specific data */
-    if (block->sizeAndTags & TAG_USED) {
-      fprintf(stderr, "ALLOCATED\n");
-    } else {
-      fprintf(stderr, "FREE\tnext: %p, prev: %p\n",
-              (void *)block->next,
-              (void *)block->prev);
-    }
+/* The used block 'block' is about to be handed out, so it is no longer
+   part of the clean (never handed out) top of the heap. */
+static void markHandedOut(BlockInfo* block) {
+  char* usedEnd = (char*)UNSCALED_POINTER_ADD(block, SIZE(block->sizeAndTags));
+  if (usedEnd > cleanLo) {
+    cleanLo = usedEnd;
   }
-  fprintf(stderr, "END OF HEAP\n\n");
 }
 
-/* Initialize the allocator. */
-int mm_init () {
-  // Head of the free list.
-  BlockInfo *firstFreeBlock;
-
-  // Initial heap size: WORD_SIZE byte heap-header (stores pointer to head
-  // of free list), MIN_BLOCK_SIZE bytes of space, WORD_SIZE byte heap-footer.
-  size_t initSize = WORD_SIZE+MIN_BLOCK_SIZE+WORD_SIZE;
-  size_t totalSize;
-
-  void* mem_sbrk_result = mem_sbrk(initSize);
-  //  printf("mem_sbrk returned %p\n", mem_sbrk_result);
-  if ((ssize_t)mem_sbrk_result == -1) {
-    printf("ERROR: mem_sbrk failed in mm_init, returning %p\n", 
-           mem_sbrk_result);
-    exit(1);
-  }
-
-  firstFreeBlock = (BlockInfo*)UNSCALED_POINTER_ADD(mem_heap_lo(), WORD_SIZE);
-
-  // Total usable size is full size minus heap-header and heap-footer words
-  // NOTE: These are different than the "header" and "footer" of a block!
-  // The heap-header is a pointer to the first free block in the free list.
-  // The heap-footer is used to keep the data structures consistent (see
-  // requestMoreSpace() for more info, but you should be able to ignore it).
-  totalSize = initSize - WORD_SIZE - WORD_SIZE;
-
-  // The heap starts with one free block, which we initialize now.
-  firstFreeBlock->sizeAndTags = totalSize | TAG_PRECEDING_USED;
-  firstFreeBlock->next = NULL;
-  firstFreeBlock->prev = NULL;
-  // boundary tag
-  *((size_t*)UNSCALED_POINTER_ADD(firstFreeBlock, totalSize - WORD_SIZE)) = totalSize | TAG_PRECEDING_USED;
-  
-  // Tag "useless" word at end of heap as used.
-  // This is the is the heap-footer.
-  *((size_t*)UNSCALED_POINTER_SUB(mem_heap_hi(), WORD_SIZE - 1)) = TAG_USED;
-
-  // set the head of the free list to this new free block.
-  FREE_LIST_HEAD = firstFreeBlock;
-  return 0;
+/* Is 'block' the last block before the heap-footer? */
+static int endsHeap(BlockInfo* block) {
+  return UNSCALED_POINTER_ADD(block, SIZE(block->sizeAndTags)) ==
+    UNSCALED_POINTER_SUB(mem_heap_hi(), WORD_SIZE - 1);
 }
 
+/* Split everything past the first reqSize bytes off the used block
+   'block' and free it, if that is enough for a block of its own.  The
+   block following 'block' in memory must be used. */
+static void shrinkUsedBlock(BlockInfo* block, size_t reqSize) {
+  size_t blockSize = SIZE(block->sizeAndTags);
+  size_t rem_size = blockSize - reqSize;
+  BlockInfo* remBlock;
+  BlockInfo* followingBlock;
 
-// TOP-LEVEL ALLOCATOR INTERFACE ------------------------------------
-
-/* Allocate a block of size size and return a pointer to it. */
-void* mm_malloc (size_t size) {
-  size_t reqSize;
-  BlockInfo * ptrFreeBlock = NULL;
-  size_t blockSize;
-  size_t precedingBlockUseTag;
-
-  // Zero-size requests get NULL.
-  if (size == 0) {
-    return NULL;
-  }
-
-  // Add one word for the initial size header.
-  // Note that we don't need to boundary tag when the block is used!
-  size += WORD_SIZE;
-  if (size <= MIN_BLOCK_SIZE) {
-    // Make sure we allocate enough space for a blockInfo in case we
-    // free this block (when we free this block, we'll need to use the
-    // next pointer, the prev pointer, and the boundary tag).
-    reqSize = MIN_BLOCK_SIZE;
-  } else {
-    // Round up for correct alignment
-    reqSize = ALIGNMENT * ((size + ALIGNMENT - 1) / ALIGNMENT);
+  if (rem_size < MIN_BLOCK_SIZE) {
+    return;
   }
-  
-  
-  // Infinite loop to find a free block of at least reqSize
-  while (1) {
-    // Search the free list for a block of size reqSize or larger
-    ptrFreeBlock = searchFreeList(reqSize);
-    // Check if a suitable block was found
-    if (ptrFreeBlock != NULL) {
-        // Remove the found block from the free list
-        removeFreeBlock(ptrFreeBlock);
-        // Exit the loop since a block was successfully obtained
-        break;
-    }
-    // Check if no suitable block was found after searching the free list
-    if (ptrFreeBlock == NULL) {
-        // Request more space to be added to the free list
-        requestMoreSpace(reqSize);
-        // Search the free list again after obtaining more space
-        ptrFreeBlock = searchFreeList(reqSize);
-    }
+  splitCounts[statsBin(blockSize)]++;
+  INSTRUMENT(instrument.split_remainder[histBucket(rem_size)]++);
+  block->sizeAndTags = reqSize | (block->sizeAndTags & (TAG_PRECEDING_USED | TAG_USED));
+
+  remBlock = (BlockInfo*)UNSCALED_POINTER_ADD(block, reqSize);
+  remBlock->sizeAndTags = rem_size | TAG_PRECEDING_USED;
+  *(size_t*)UNSCALED_POINTER_ADD(remBlock, rem_size - WORD_SIZE) = rem_size | TAG_PRECEDING_USED;
+  // The following block now comes after a free one.
+  followingBlock = (BlockInfo*)UNSCALED_POINTER_ADD(remBlock, rem_size);
+  followingBlock->sizeAndTags &= ~TAG_PRECEDING_USED;
+
+  insertFreeBlock(remBlock);
+  coalesceFreeBlock(remBlock);
 }
 
-
+/* Mark the first reqSize bytes of ptrFreeBlock (already removed from
+   the free list) as used.  If the rest is big enough to be a block of
+   its own, split it off and return it to the free list; otherwise the
+   whole block is handed out. */
+static void placeBlock(BlockInfo* ptrFreeBlock, size_t reqSize) {
   // Extracting the size and tags from the free block 
   size_t blocksize_tags = ptrFreeBlock->sizeAndTags;
   // Extracting tag which indicates whether the preceding block is in use
-  precedingBlockUseTag = blocksize_tags & TAG_PRECEDING_USED;
+  size_t precedingBlockUseTag = blocksize_tags & TAG_PRECEDING_USED;
   // Calculating the size of the block
-  blockSize = SIZE(blocksize_tags);
+  size_t blockSize = SIZE(blocksize_tags);
   // Calculating the size of the block but without the tags
   size_t rem_size = blockSize - reqSize;
 
-  // Infinite loop to handle the splitting of a free block
-  while (1) {
-    // Check if the remainder size is large enough to split the block
-    if (rem_size >= MIN_BLOCK_SIZE) {
-        // Combine reqSize with precedingBlockUseTag using bitwise OR
-        size_t tempValue = reqSize | precedingBlockUseTag;
-        // Set sizeAndTagsValue by combining tempValue with TAG_USED
-        size_t sizeAndTagsValue = tempValue | TAG_USED;
-        // Update the size and tags of the current block
-        ptrFreeBlock->sizeAndTags = sizeAndTagsValue;
-        // Calculate the pointer to the remainder block
-        BlockInfo *ptr_remblock;
-        ptr_remblock = (BlockInfo*)UNSCALED_POINTER_ADD(ptrFreeBlock, reqSize);
-        // Set the size and tags of the remainder block
-        ptr_remblock->sizeAndTags = rem_size | TAG_PRECEDING_USED;
-        // Calculate the location for the boundary tag in the remainder block
-        size_t* tagLocation = (size_t*)UNSCALED_POINTER_ADD(ptr_remblock, rem_size - WORD_SIZE);
-        // Set the boundary tag value in the remainder block
-        *tagLocation = rem_size | TAG_PRECEDING_USED;
-        // Add the remainder block to the free list
-        insertFreeBlock(ptr_remblock);
-        // Coalesce the remainder block with adjacent free blocks
-        coalesceFreeBlock(ptr_remblock);
-        // Exit the loop since the block has been split
-        break;
-    }
+  // Check if the remainder size is large enough to split the block
+  if (rem_size >= MIN_BLOCK_SIZE) {
+    splitCounts[statsBin(blockSize)]++;
+    INSTRUMENT(instrument.split_remainder[histBucket(rem_size)]++);
+    // Update the size and tags of the current block
+    ptrFreeBlock->sizeAndTags = reqSize | precedingBlockUseTag | TAG_USED;
+    // Calculate the pointer to the remainder block
+    BlockInfo *ptr_remblock;
+    ptr_remblock = (BlockInfo*)UNSCALED_POINTER_ADD(ptrFreeBlock, reqSize);
+    // Set the size and tags of the remainder block; it is as
+    // known-zero as the block it came from
+    ptr_remblock->sizeAndTags = rem_size | TAG_PRECEDING_USED | (blocksize_tags & TAG_ZEROED);
+    // Set the boundary tag value in the remainder block
+    *(size_t*)UNSCALED_POINTER_ADD(ptr_remblock, rem_size - WORD_SIZE) = ptr_remblock->sizeAndTags;
+    // Add the remainder block to the free list
+    insertFreeBlock(ptr_remblock);
+    // Coalesce the remainder block with adjacent free blocks
+    coalesceFreeBlock(ptr_remblock);
+  } else {
+    // Mark the whole block as used
+    ptrFreeBlock->sizeAndTags = (blocksize_tags & ~TAG_ZEROED) | TAG_USED;
+    // Update the size and tags of the next block to indicate the preceding block is used
+    BlockInfo *ptr_nextblock = (BlockInfo*)UNSCALED_POINTER_ADD(ptrFreeBlock, blockSize);
+    ptr_nextblock->sizeAndTags |= TAG_PRECEDING_USED;
+  }
 
-    // Check if the remainder size is less than MIN_BLOCK_SIZE
-    if (rem_size < MIN_BLOCK_SIZE) {
-        // Update sizeAndTagsValue to mark the block as used
-        blocksize_tags = blocksize_tags | TAG_USED;
-        // Calculate the pointer to the next block
-        BlockInfo *ptr_nextblock;
-        ptr_nextblock = (BlockInfo*)UNSCALED_POINTER_ADD(ptrFreeBlock, blockSize);
-        // Get a pointer to the size and tags field of the next block
-        size_t* ptrSizeAndTags = &ptr_nextblock->sizeAndTags;
-        // Update the size and tags of the next block to indicate the preceding block is used
-        *ptrSizeAndTags |= TAG_PRECEDING_USED;
-    }
+  markHandedOut(ptrFreeBlock);
 }
 
-  // Implement mm_malloc.  You can change or remove any of the above
-  // code.  It is included as a suggestion of where to start.
-  // You will want to replace this return statement...
-  return UNSCALED_POINTER_ADD(ptrFreeBlock, WORD_SIZE); 
+/* Split the first 'gap' bytes (0 or at least MIN_BLOCK_SIZE) of
+   ptrFreeBlock (already removed from the free list) off as a free
+   block of their own, and return the rest, still outside the free
+   list, for placeBlock.  The lead keeps the original block's
+   preceding-used tag, and since the original block was fully
+   coalesced and the rest is about to be used, it needs no
+   coalescing. */
+static BlockInfo* splitOffLead(BlockInfo* ptrFreeBlock, size_t gap) {
+  size_t blockSize = SIZE(ptrFreeBlock->sizeAndTags);
+  size_t precedingBlockUseTag = ptrFreeBlock->sizeAndTags & TAG_PRECEDING_USED;
+  size_t zeroedTag = ptrFreeBlock->sizeAndTags & TAG_ZEROED;
+  BlockInfo* lead = ptrFreeBlock;
+
+  splitCounts[statsBin(blockSize)]++;
+  INSTRUMENT(instrument.split_remainder[histBucket(gap)]++);
+  lead->sizeAndTags = gap | precedingBlockUseTag | zeroedTag;
+  *(size_t*)UNSCALED_POINTER_ADD(lead, gap - WORD_SIZE) = lead->sizeAndTags;
+  insertFreeBlock(lead);
+
+  ptrFreeBlock = (BlockInfo*)UNSCALED_POINTER_ADD(lead, gap);
+  ptrFreeBlock->sizeAndTags = (blockSize - gap) | zeroedTag;
+  return ptrFreeBlock;
 }
 
-/* Free the block referenced by ptr. */
-void mm_free (void *ptr) {
+/* Free the used block blockInfo: put it in the free list and
+   coalesce it. */
+static void freeBlock(BlockInfo* blockInfo) {
   size_t payloadSize;
-  BlockInfo * blockInfo;
   BlockInfo * followingBlock;
 
-  // Implement mm_free.  You can change or remove the declaraions
-  // above.  They are included as minor hints. 
-  
-  // Calculate the header pointer by subtracting the size of a word
-  void* headerPtr = UNSCALED_POINTER_SUB(ptr, WORD_SIZE);
-  // Convert the header pointer to a BlockInfo pointer
-  blockInfo = (BlockInfo*)headerPtr;
   // Extract the size and tags information from the block header
   size_t size_tags = blockInfo->sizeAndTags;
   // Calculate the payload size by masking out the tag bits
   payloadSize = SIZE(size_tags);
-  // Clear the TAG_USED bit to mark the block as free
-  size_tags = size_tags & (~TAG_USED);
+  // Clear the TAG_USED bit to mark the block as free; whatever the
+  // user left in it, it is not known to be zero
+  size_tags = size_tags & ~(TAG_USED | TAG_ZEROED);
   // Calculate the offset to the boundary tag
   size_t offset = payloadSize - WORD_SIZE;
-  // Calculate the pointer to the boundary tag and update its value
+  // Write the free tags to the header and the boundary tag
+  blockInfo->sizeAndTags = size_tags;
   size_t* footer = (size_t*)UNSCALED_POINTER_ADD(blockInfo, offset);
   *footer = size_tags;
   // Calculate the offset to the following block
@@ -489,20 +1282,1736 @@ void mm_free (void *ptr) {
   tmp &= ~TAG_PRECEDING_USED;
   // Update the size and tags information in the following block
   followingBlock->sizeAndTags = tmp;
+  freedSinceCompact += payloadSize;
   // Add the current block to the free list
   insertFreeBlock(blockInfo);
   // Coalesce the current block with adjacent free blocks
   coalesceFreeBlock(blockInfo);
 }
 
+/* Give all the blocks cached by 'sizeClass' back to the free list. */
+static void drainClass(SizeClass* sizeClass) {
+  BlockInfo* block = sizeClass->head;
 
-// Implement a heap consistency checker as needed.
-int mm_check() {
-  return 0;
+  while (block != NULL) {
+    BlockInfo* next = NEXT_FREE(block);
+    freeBlock(block);
+    block = next;
+  }
+  sizeClass->head = NULL;
+  sizeClass->cached = 0;
 }
 
-// Extra credit.
-void* mm_realloc(void* ptr, size_t size) {
-  // ... implementation here ...
+/* Drain every class cache, because the heap would have to grow
+   otherwise.  Classes that had blocks cached carve smaller slabs from
+   now on: under memory pressure the slab only ends up drained again.
+   Returns the number of blocks drained. */
+static size_t drainClasses(void) {
+  size_t drained = 0;
+  int i;
+
+  for (i = 0; i < numClasses; i++) {
+    if (sizeClasses[i].cached != 0) {
+      drained += sizeClasses[i].cached;
+      drainClass(&sizeClasses[i]);
+      sizeClasses[i].slabBlocks = (sizeClasses[i].slabBlocks + 1) / 2;
+    }
+  }
+  if (drained != 0) {
+    classDrains++;
+  }
+  return drained;
+}
+
+/* Find a free block of at least reqSize bytes, growing the heap if
+   there is none, and remove it from the free list.  Blocks cached by
+   the size classes are given back before the heap is grown.  Returns
+   NULL if the heap cannot grow enough. */
+static BlockInfo* takeFreeBlock(size_t reqSize) {
+  BlockInfo* freeBlock;
+
+  while ((freeBlock = searchFreeList(reqSize)) == NULL) {
+    if (drainClasses() == 0 && requestMoreSpace(reqSize) < 0) {
+      return NULL;
+    }
+  }
+  removeFreeBlock(freeBlock);
+  return freeBlock;
+}
+
+/* Like takeFreeBlock, but the payload of the block returned is
+   'offset' bytes past an 'align' boundary.  The space in front of it
+   is split off and goes back to the free list. */
+static BlockInfo* takeAlignedBlock(size_t reqSize, size_t align, size_t offset) {
+  BlockInfo* freeBlock;
+  size_t gap;
+
+  while ((freeBlock = searchAlignedFreeList(reqSize, align, offset, &gap)) == NULL) {
+    // Ask for exactly enough to put an aligned block right after the
+    // current end of the heap.  For page-sized alignments this makes
+    // the payload start on the first page boundary past the old brk
+    // instead of somewhere inside an over-sized request.
+    BlockInfo* heapEnd = (BlockInfo*)UNSCALED_POINTER_SUB(mem_heap_hi(), WORD_SIZE - 1);
+    if (drainClasses() == 0 &&
+        requestMoreSpace(alignedGap(heapEnd, align, offset) + reqSize) < 0) {
+      return NULL;
+    }
+  }
+  removeFreeBlock(freeBlock);
+
+  if (gap != 0) {
+    freeBlock = splitOffLead(freeBlock, gap);
+  }
+  return freeBlock;
+}
+
+/* The class for blocks of exactly blockSize bytes, or NULL. */
+static SizeClass* findClass(size_t blockSize) {
+  int i;
+
+  for (i = 0; i < numClasses; i++) {
+    if (sizeClasses[i].blockSize == blockSize) {
+      return &sizeClasses[i];
+    }
+  }
   return NULL;
 }
+
+/* Pick the size classes for the next epoch from the histogram.
+   Classes that stay keep their cache and counters; dropped ones are
+   drained.  A class that had to carve more slabs than it served from
+   its cache is not paying for itself (its blocks are not reused
+   before the caches get drained), so it is dropped, and its size has
+   to regain its share of the histogram to come back. */
+static void deriveClasses(void) {
+  SizeClass oldClasses[NUM_CLASSES];
+  int oldCount = numClasses;
+  size_t sizes[HIST_SLOTS];
+  size_t counts[HIST_SLOTS];
+  int numSizes = 0;
+  int i, j;
+
+  memcpy(oldClasses, sizeClasses, sizeof(sizeClasses));
+  numClasses = 0;
+
+  for (j = 0; j < oldCount; j++) {
+    if (oldClasses[j].hits < oldClasses[j].refills) {
+      for (i = 0; i < HIST_SLOTS; i++) {
+        if (sizeHistogram[i].blockSize == oldClasses[j].blockSize) {
+          sizeHistogram[i].count = 0;
+        }
+      }
+    }
+  }
+
+  // Take the most frequent sizes, as long as they are common enough.
+  while (numClasses < NUM_CLASSES) {
+    int best = -1;
+    for (i = 0; i < HIST_SLOTS; i++) {
+      if (sizeHistogram[i].count * CLASS_SHARE >= EPOCH_SAMPLES &&
+          findClass(sizeHistogram[i].blockSize) == NULL &&
+          (best < 0 || sizeHistogram[i].count > sizeHistogram[best].count)) {
+        best = i;
+      }
+    }
+    if (best < 0) {
+      break;
+    }
+
+    SizeClass* sizeClass = &sizeClasses[numClasses++];
+    size_t blockSize = sizeHistogram[best].blockSize;
+    memset(sizeClass, 0, sizeof(SizeClass));
+    sizeClass->blockSize = blockSize;
+    sizeClass->epochCreated = classEpochs;
+    for (j = 0; j < oldCount; j++) {
+      if (oldClasses[j].blockSize == blockSize) {
+        *sizeClass = oldClasses[j];
+        oldClasses[j].blockSize = 0;
+      }
+    }
+    // The more popular the size, the more blocks to carve at once.
+    sizeClass->slabBlocks = (SLAB_BYTES / blockSize) * sizeHistogram[best].count / EPOCH_SAMPLES;
+    if (sizeClass->slabBlocks == 0) {
+      sizeClass->slabBlocks = 1;
+    }
+  }
+
+  for (j = 0; j < oldCount; j++) {
+    if (oldClasses[j].blockSize != 0) {
+      drainClass(&oldClasses[j]);
+      classesRetired++;
+    }
+  }
+
+  // Halve the counts, dropping the sizes that reach zero, and rehash
+  // what is left.
+  for (i = 0; i < HIST_SLOTS; i++) {
+    if (sizeHistogram[i].count / 2 != 0) {
+      sizes[numSizes] = sizeHistogram[i].blockSize;
+      counts[numSizes++] = sizeHistogram[i].count / 2;
+    }
+  }
+  memset(sizeHistogram, 0, sizeof(sizeHistogram));
+  for (j = 0; j < numSizes; j++) {
+    i = (sizes[j] / ALIGNMENT) & (HIST_SLOTS - 1);
+    while (sizeHistogram[i].blockSize != 0) {
+      i = (i + 1) & (HIST_SLOTS - 1);
+    }
+    sizeHistogram[i].blockSize = sizes[j];
+    sizeHistogram[i].count = counts[j];
+  }
+  classEpochs++;
+}
+
+/* Record one sampled request for a block of blockSize bytes. */
+static void sampleRequest(size_t blockSize) {
+  int i = (blockSize / ALIGNMENT) & (HIST_SLOTS - 1);
+  int probes;
+
+  sampleCountdown = SAMPLE_PERIOD;
+  for (probes = 0; probes < HIST_SLOTS; probes++) {
+    if (sizeHistogram[i].blockSize == blockSize ||
+        sizeHistogram[i].blockSize == 0) {
+      sizeHistogram[i].blockSize = blockSize;
+      sizeHistogram[i].count++;
+      break;
+    }
+    i = (i + 1) & (HIST_SLOTS - 1);
+  }
+  // (If every slot holds another size, the sample is dropped.)
+  if (++epochSamples == EPOCH_SAMPLES) {
+    epochSamples = 0;
+    deriveClasses();
+  }
+}
+
+/* The class cache of 'sizeClass' is empty: carve a slab of blocks out
+   of one free block, cache all but the last and return that one.
+   Returns NULL if the heap is out of space. */
+static BlockInfo* refillClass(SizeClass* sizeClass) {
+  size_t blockSize = sizeClass->blockSize;
+  BlockInfo* slab = takeFreeBlock(blockSize);
+  size_t numBlocks;
+  size_t slabSize;
+  size_t precedingBlockUseTag;
+  BlockInfo* block;
+  size_t i;
+
+  if (slab == NULL) {
+    return NULL;
+  }
+  numBlocks = SIZE(slab->sizeAndTags) / blockSize;
+
+  if (numBlocks > sizeClass->slabBlocks) {
+    numBlocks = sizeClass->slabBlocks;
+  }
+  placeBlock(slab, numBlocks * blockSize);
+  // placeBlock may have kept a sliver too small to split off, which
+  // goes to the last block.
+  slabSize = SIZE(slab->sizeAndTags);
+  precedingBlockUseTag = slab->sizeAndTags & TAG_PRECEDING_USED;
+  sizeClass->refills++;
+
+  // Every block is used as far as the heap is concerned; only the
+  // first one can follow a free block.
+  for (i = 0; i + 1 < numBlocks; i++) {
+    block = (BlockInfo*)UNSCALED_POINTER_ADD(slab, i * blockSize);
+    block->sizeAndTags = blockSize | TAG_USED |
+      (i == 0 ? precedingBlockUseTag : TAG_PRECEDING_USED);
+    block->next = BLOCK_OFFSET(sizeClass->head);
+    sizeClass->head = block;
+    sizeClass->cached++;
+  }
+  block = (BlockInfo*)UNSCALED_POINTER_ADD(slab, i * blockSize);
+  block->sizeAndTags = (slabSize - i * blockSize) | TAG_USED |
+    (i == 0 ? precedingBlockUseTag : TAG_PRECEDING_USED);
+  return block;
+}
+
+/* Put the used block 'block' in the cache of its size class, if it
+   has one and the cache is not full.  Returns whether it did. */
+static int cacheBlock(BlockInfo* block) {
+  SizeClass* sizeClass = findClass(SIZE(block->sizeAndTags));
+
+  if (sizeClass == NULL || sizeClass->cached >= CACHE_SLABS * sizeClass->slabBlocks) {
+    return 0;
+  }
+  block->next = BLOCK_OFFSET(sizeClass->head);
+  sizeClass->head = block;
+  sizeClass->cached++;
+  return 1;
+}
+
+/* Hand the pages of a large free block back to the OS so that it reads
+   as zero again, and tag it that way.  The header, free-list pointers
+   and boundary tag are kept. */
+static void purgeFreeBlock(BlockInfo* freeBlock) {
+  size_t blockSize = SIZE(freeBlock->sizeAndTags);
+  void* lo = UNSCALED_POINTER_ADD(freeBlock, sizeof(BlockInfo));
+
+#if MM_INSERTION == MM_ADDRESS_ORDERED
+  // Keep its skip words.
+  lo = UNSCALED_POINTER_ADD(lo, (2 * SKIP_LEVEL(freeBlock) + 1) * WORD_SIZE);
+#endif
+  mem_purge(lo, (char*)freeBlock + blockSize - WORD_SIZE - (char*)lo);
+  freeBlock->sizeAndTags |= TAG_ZEROED;
+  *(size_t*)UNSCALED_POINTER_ADD(freeBlock, blockSize - WORD_SIZE) = freeBlock->sizeAndTags;
+}
+
+/* Print the heap by iterating through it as an implicit free list. */
+static void examine_heap() {
+  BlockInfo *block;
+
+  /* print to stderr so output isn't buffered and not output if we crash */
+  fprintf(stderr, "FREE_LIST_HEAD: %p\n", (void *)OFFSET_BLOCK(FREE_LIST_HEAD));
+
+  for (block = (BlockInfo *)UNSCALED_POINTER_ADD(heapBase, HEAP_HEADER_SIZE); /* first block on hea\
+									       p */
+       SIZE(block->sizeAndTags) != 0 && (void*)block < (void*)mem_heap_hi();
+       block = (BlockInfo *)UNSCALED_POINTER_ADD(block, SIZE(block->sizeAndTags))) {
+
+    /* print out common block attributes */
+    fprintf(stderr, "%p: %ld %ld %ld\t",
+            (void *)block,
+            SIZE(block->sizeAndTags),
+            block->sizeAndTags & TAG_PRECEDING_USED,
+            block->sizeAndTags & TAG_USED);
+
+    /* and allocated/free specific data */
+    if (block->sizeAndTags & TAG_USED) {
+      fprintf(stderr, "ALLOCATED\n");
+    } else {
+      fprintf(stderr, "FREE\tnext: %p, prev: %p\n",
+              (void *)NEXT_FREE(block),
+              (void *)PREV_FREE(block));
+    }
+  }
+  fprintf(stderr, "END OF HEAP\n\n");
+}
+
+/* Take the heap lock.  If the process holding it died, the call it
+   was in may have left the heap inconsistent; there is nothing to roll
+   back, so say so and carry on rather than leave every other process
+   blocked. */
+static void lockHeap() {
+  int result = pthread_mutex_lock(heapLock);
+
+  if (result == EOWNERDEAD) {
+    fprintf(stderr, "WARNING: a process died holding the heap lock\n");
+    pthread_mutex_consistent(heapLock);
+  } else if (result != 0) {
+    printf("ERROR: cannot take the heap lock: %s\n", strerror(result));
+    exit(1);
+  }
+}
+
+/* Reset everything the allocator keeps outside the heap itself. */
+static void resetState() {
+  heapBase = (char*)mem_heap_lo();
+  heapLock = NULL;
+  // Whatever mem_sbrk has not handed out before is still zero.
+  cleanLo = (char*)mem_fresh_lo();
+  freedSinceCompact = 0;
+  nextColor = 0;
+  // The old handle table went away with the old heap.
+  handleTable = NULL;
+  handleCount = 0;
+  freeHandle = 0;
+  // Start learning size classes from scratch.
+  memset(sizeClasses, 0, sizeof(sizeClasses));
+  memset(sizeHistogram, 0, sizeof(sizeHistogram));
+  numClasses = 0;
+  sampleCountdown = SAMPLE_PERIOD;
+  epochSamples = 0;
+  classEpochs = 0;
+  classesRetired = 0;
+  classDrains = 0;
+  memset(splitCounts, 0, sizeof(splitCounts));
+  memset(coalesceCounts, 0, sizeof(coalesceCounts));
+  checkCursor = 0;
+  INSTRUMENT(memset(&instrument, 0, sizeof(instrument)));
+  // Samples of the old heap's blocks are gone with it.
+  if (profileLive != 0) {
+    memset(profileSamples, 0, sizeof(profileSamples));
+    profileLive = 0;
+  }
+}
+
+/* Set up what the placement and insertion policies keep outside the
+   heap (the rover, the free list's tail) for the free list as it is
+   now. */
+static void resetPolicyState() {
+#if MM_PLACEMENT == MM_NEXT_FIT
+  rover = 0;
+#endif
+#if MM_INSERTION == MM_FIFO
+  BlockInfo* freeBlock;
+
+  freeListTail = 0;
+  for (freeBlock = OFFSET_BLOCK(FREE_LIST_HEAD); freeBlock != NULL; freeBlock = NEXT_FREE(freeBlock)) {
+    freeListTail = BLOCK_OFFSET(freeBlock);
+  }
+#endif
+}
+
+/* The policies mm.c was built with, e.g. "first-fit/lifo". */
+const char* mm_policy (void) {
+  static const char* placements[] = { "first-fit", "next-fit", "best-fit", "good-fit" };
+  static const char* insertions[] = { "lifo", "fifo", "address" };
+  static char name[32];
+
+  snprintf(name, sizeof(name), "%s/%s", placements[MM_PLACEMENT], insertions[MM_INSERTION]);
+  return name;
+}
+
+/* Initialize the allocator. */
+int mm_init () {
+  // Head of the free list.
+  BlockInfo *firstFreeBlock;
+
+  // Initial heap size: HEAP_HEADER_SIZE byte heap-header (stores the
+  // offsets of the head of the free list and of the root), MIN_BLOCK_SIZE
+  // bytes of space, WORD_SIZE byte heap-footer.
+  size_t initSize = HEAP_HEADER_SIZE+MIN_BLOCK_SIZE+WORD_SIZE;
+  size_t totalSize;
+#if SKIP_LEVELS > 0
+  int level;
+#endif
+
+  resetState();
+
+  void* mem_sbrk_result = mem_sbrk(initSize);
+  sbrkCalls = 1;
+  //  printf("mem_sbrk returned %p\n", mem_sbrk_result);
+  if ((ssize_t)mem_sbrk_result == -1) {
+    printf("ERROR: mem_sbrk failed in mm_init, returning %p\n", 
+           mem_sbrk_result);
+    exit(1);
+  }
+  TRACE(MM_TRACE_INIT, 0, heapBase, 0);
+  TRACE(MM_TRACE_SBRK, initSize, mem_sbrk_result, 0);
+
+  firstFreeBlock = (BlockInfo*)UNSCALED_POINTER_ADD(heapBase, HEAP_HEADER_SIZE);
+
+  // Total usable size is full size minus heap-header and heap-footer words
+  // NOTE: These are different than the "header" and "footer" of a block!
+  // The heap-header locates the first free block in the free list.
+  // The heap-footer is used to keep the data structures consistent (see
+  // requestMoreSpace() for more info, but you should be able to ignore it).
+  totalSize = initSize - HEAP_HEADER_SIZE - WORD_SIZE;
+
+  // The heap starts with one free block, which we initialize now.
+  firstFreeBlock->sizeAndTags = totalSize | TAG_PRECEDING_USED;
+  firstFreeBlock->next = 0;
+  firstFreeBlock->prev = 0;
+  // boundary tag
+  *((size_t*)UNSCALED_POINTER_ADD(firstFreeBlock, totalSize - WORD_SIZE)) = firstFreeBlock->sizeAndTags;
+  
+  // Tag "useless" word at end of heap as used.
+  // This is the is the heap-footer.
+  *((size_t*)UNSCALED_POINTER_SUB(mem_heap_hi(), WORD_SIZE - 1)) = TAG_USED;
+
+  // set the head of the free list to this new free block.
+  FREE_LIST_HEAD = BLOCK_OFFSET(firstFreeBlock);
+  ROOT_OFFSET = 0;
+#if SKIP_LEVELS > 0
+  // ... and the only block in the span of the heap-header at every
+  // skip-list level.
+  for (level = 1; level <= SKIP_LEVELS; level++) {
+    SKIP_HEAD(level) = 0;
+    SKIP_HEAD_MAX(level) = totalSize;
+  }
+#endif
+  resetPolicyState();
+  return 0;
+}
+
+/* Use the heap kept in the file at 'path', creating the file with an
+   empty heap if it does not hold one yet.  The heap stays in the file
+   after the process exits, and all free-list links are heap offsets,
+   so it is valid wherever the next process maps it; the application
+   finds its data again through mm_get_root.  Size classes are off for
+   a persistent heap, and handles (mm_halloc) do not survive reopening
+   it.  Returns 0 on success and -1 if the file cannot be used. */
+int mm_open_persistent (const char *path) {
+  int reopened = mem_init_file(path);
+
+  if (reopened < 0) {
+    return -1;
+  }
+  mappedHeap = 1;
+  if (!reopened || mem_heapsize() == 0) {
+    return mm_init();
+  }
+  resetState();
+  resetPolicyState();
+  return 0;
+}
+
+/* Use the heap in the POSIX shared memory object 'name' (see
+   shm_open), creating it if it does not exist yet.  Every process
+   that opens the same name shares one heap, mapped wherever it lands
+   in each of them, so blocks are passed between processes as offsets
+   (mm_offset and mm_pointer).  Any process may free any block.  Calls
+   are serialized by the heap lock.  Size classes are off and handles
+   are private to the process that made them, as for a persistent
+   heap.  Returns 0 on success and -1 if the object cannot be used. */
+int mm_open_shared (const char *name) {
+  pthread_mutexattr_t attr;
+  int attached;
+
+#if MM_PLACEMENT == MM_NEXT_FIT || MM_INSERTION == MM_FIFO
+  // The rover and the list's tail live in each process, and would go
+  // stale as the others change the free list.
+  fprintf(stderr, "mm_open_shared: a %s build cannot share its heap\n", mm_policy());
+  return -1;
+#endif
+  attached = mem_init_shared(name);
+  if (attached < 0) {
+    return -1;
+  }
+  mappedHeap = 1;
+  if (attached) {
+    resetState();
+  } else {
+    mm_init();
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(HEAP_LOCK, &attr);
+    pthread_mutexattr_destroy(&attr);
+    mem_publish();
+  }
+  heapLock = HEAP_LOCK;
+  // Other processes hand out parts of the heap without this one
+  // knowing, so no part of it is known to be clean.
+  cleanLo = (char*)UINTPTR_MAX;
+  return 0;
+}
+
+/* Detach from a shared heap.  The heap itself lives on until the
+   object is removed with shm_unlink. */
+void mm_close_shared (void) {
+  heapLock = NULL;
+  mem_deinit();
+  mappedHeap = 0;
+}
+
+/* The offset of 'ptr', a payload pointer from this heap, which means
+   the same block in every process sharing the heap. */
+size_t mm_offset (void *ptr) {
+  return (char*)ptr - heapBase;
+}
+
+/* The payload pointer for an offset from mm_offset. */
+void* mm_pointer (size_t offset) {
+  return heapBase + offset;
+}
+
+/* Flush the heap to its file and unmap it. */
+void mm_close_persistent (void) {
+  mem_sync();
+  mem_deinit();
+  mappedHeap = 0;
+  syncAtSafePoints = 0;
+}
+
+/* Flush a persistent heap to its file. */
+void mm_sync (void) {
+  mem_sync();
+}
+
+/* Remember 'root', a payload pointer from this heap (or NULL), as the
+   entry point to the application's data in a persistent heap.  It is
+   stored as an offset in the heap-header. */
+void mm_set_root (void *root) {
+  LOCK_HEAP();
+  ROOT_OFFSET = root == NULL ? 0 : (size_t)((char*)root - heapBase);
+  SAFE_POINT();
+}
+
+/* Return the root last set with mm_set_root, or NULL. */
+void* mm_get_root (void) {
+  return ROOT_OFFSET == 0 ? NULL : heapBase + ROOT_OFFSET;
+}
+
+
+// TOP-LEVEL ALLOCATOR INTERFACE ------------------------------------
+
+/* Allocate a block of size size and return a pointer to it. */
+void* mm_malloc (size_t size) {
+  size_t reqSize;
+  BlockInfo * ptrFreeBlock = NULL;
+  SizeClass * sizeClass;
+
+  // Zero-size and impossibly large requests get NULL.
+  if (size == 0 || size > MAX_REQUEST) {
+    return NULL;
+  }
+
+  LOCK_HEAP();
+  reqSize = requestToBlockSize(size);
+  // Classes cache blocks in process memory, so a heap that outlives
+  // or is shared with other processes does not use them.
+  if (!mappedHeap && --sampleCountdown == 0) {
+    sampleRequest(reqSize);
+  }
+
+  // Serve sizes with a class from its cache.
+  sizeClass = findClass(reqSize);
+  if (sizeClass != NULL) {
+    if (sizeClass->head == NULL) {
+      ptrFreeBlock = refillClass(sizeClass);
+      if (ptrFreeBlock == NULL) {
+        UNLOCK_HEAP();
+        return NULL;
+      }
+    } else {
+      ptrFreeBlock = sizeClass->head;
+      sizeClass->head = NEXT_FREE(ptrFreeBlock);
+      sizeClass->cached--;
+      sizeClass->hits++;
+    }
+    TRACE(MM_TRACE_MALLOC, size, UNSCALED_POINTER_ADD(ptrFreeBlock, WORD_SIZE), 0);
+    PROFILE(UNSCALED_POINTER_ADD(ptrFreeBlock, WORD_SIZE), size);
+    SAFE_POINT();
+    return UNSCALED_POINTER_ADD(ptrFreeBlock, WORD_SIZE);
+  }
+
+  if (colorLargeBlocks && reqSize >= COLOR_MIN_SIZE) {
+    size_t offset = colorOrder[nextColor] * (COLOR_SPAN / NUM_COLORS);
+    ptrFreeBlock = takeAlignedBlock(reqSize, COLOR_SPAN, offset);
+    nextColor = (nextColor + 1) % NUM_COLORS;
+  } else {
+    ptrFreeBlock = takeFreeBlock(reqSize);
+  }
+  if (ptrFreeBlock == NULL) {
+    UNLOCK_HEAP();
+    return NULL;
+  }
+  // Carve reqSize bytes out of the block.
+  placeBlock(ptrFreeBlock, reqSize);
+
+  TRACE(MM_TRACE_MALLOC, size, UNSCALED_POINTER_ADD(ptrFreeBlock, WORD_SIZE), 0);
+  PROFILE(UNSCALED_POINTER_ADD(ptrFreeBlock, WORD_SIZE), size);
+  SAFE_POINT();
+  return UNSCALED_POINTER_ADD(ptrFreeBlock, WORD_SIZE); 
+}
+
+/* Allocate a block of size size, like mm_malloc, placed according to
+   how long the caller expects it to live.  Short-lived blocks are
+   carved from the top end of the free block first fit picks, and
+   everything else from the bottom end, so that when the short-lived
+   ones die they coalesce with the rest of the hole instead of leaving
+   it split between long-lived neighbours. */
+void* mm_malloc_hint (size_t size, int lifetime) {
+  size_t reqSize;
+  size_t blockSize;
+  BlockInfo * ptrFreeBlock = NULL;
+
+  if (lifetime != MM_LIFETIME_SHORT) {
+    return mm_malloc(size);
+  }
+  if (size == 0 || size > MAX_REQUEST) {
+    return NULL;
+  }
+
+  LOCK_HEAP();
+  reqSize = requestToBlockSize(size);
+  ptrFreeBlock = takeFreeBlock(reqSize);
+  if (ptrFreeBlock == NULL) {
+    UNLOCK_HEAP();
+    return NULL;
+  }
+  blockSize = SIZE(ptrFreeBlock->sizeAndTags);
+  if (blockSize - reqSize >= MIN_BLOCK_SIZE) {
+    ptrFreeBlock = splitOffLead(ptrFreeBlock, blockSize - reqSize);
+  }
+  placeBlock(ptrFreeBlock, reqSize);
+
+  TRACE(MM_TRACE_MALLOC, size, UNSCALED_POINTER_ADD(ptrFreeBlock, WORD_SIZE), 0);
+  PROFILE(UNSCALED_POINTER_ADD(ptrFreeBlock, WORD_SIZE), size);
+  SAFE_POINT();
+  return UNSCALED_POINTER_ADD(ptrFreeBlock, WORD_SIZE);
+}
+
+/* Allocate zeroed space for an array of nmemb elements of size bytes
+   each.  Only the part of the block that is not already known to be
+   zero gets cleared. */
+void* mm_calloc (size_t nmemb, size_t size) {
+  size_t payloadSize;
+  size_t reqSize;
+  size_t blockSize;
+  BlockInfo * ptrFreeBlock = NULL;
+  char* payload;
+  char* dirtyEnd;
+
+  // Zero-size, overflowing and impossibly large requests get NULL.
+  if (nmemb == 0 || size == 0 || nmemb > MAX_REQUEST / size) {
+    return NULL;
+  }
+  payloadSize = nmemb * size;
+
+  LOCK_HEAP();
+  reqSize = requestToBlockSize(payloadSize);
+  ptrFreeBlock = takeFreeBlock(reqSize);
+  if (ptrFreeBlock == NULL) {
+    UNLOCK_HEAP();
+    return NULL;
+  }
+  blockSize = SIZE(ptrFreeBlock->sizeAndTags);
+  payload = (char*)UNSCALED_POINTER_ADD(ptrFreeBlock, WORD_SIZE);
+
+  // Work out how much of the payload may hold old data: none of a
+  // zeroed block, otherwise whatever lies below the clean part of the
+  // heap.  (Read cleanLo before placeBlock moves it past this block.)
+  if (ptrFreeBlock->sizeAndTags & TAG_ZEROED) {
+    dirtyEnd = payload;
+  } else if (cleanLo < payload) {
+    dirtyEnd = payload;
+  } else if (cleanLo > payload + payloadSize) {
+    dirtyEnd = payload + payloadSize;
+  } else {
+    dirtyEnd = cleanLo;
+  }
+
+  placeBlock(ptrFreeBlock, reqSize);
+  fast_zero(payload, dirtyEnd - payload);
+
+  // The rest can only hold this block's own free-list words: next and
+  // prev at the start of the payload, and the boundary tag if the block
+  // was not split (otherwise it now belongs to the remainder).
+  ptrFreeBlock->next = 0;
+  ptrFreeBlock->prev = 0;
+  if (SIZE(ptrFreeBlock->sizeAndTags) == blockSize) {
+    *(size_t*)UNSCALED_POINTER_ADD(ptrFreeBlock, blockSize - WORD_SIZE) = 0;
+  }
+  TRACE(MM_TRACE_CALLOC, payloadSize, payload, 0);
+  PROFILE(payload, payloadSize);
+  SAFE_POINT();
+  return payload;
+}
+
+/* Allocate a block of size size whose payload address is a multiple
+   of align (a power of two).  Returns NULL if align is not a power of
+   two, size is zero or there is no room. */
+void* mm_memalign (size_t align, size_t size) {
+  size_t reqSize;
+  BlockInfo * ptrFreeBlock = NULL;
+
+  if (size == 0 || size > MAX_REQUEST || align > MAX_REQUEST ||
+      (align & (align - 1)) != 0) {
+    return NULL;
+  }
+  // Every block is already ALIGNMENT-aligned.
+  if (align <= ALIGNMENT) {
+    return mm_malloc(size);
+  }
+
+  LOCK_HEAP();
+  reqSize = requestToBlockSize(size);
+  ptrFreeBlock = takeAlignedBlock(reqSize, align, 0);
+  if (ptrFreeBlock == NULL) {
+    UNLOCK_HEAP();
+    return NULL;
+  }
+  placeBlock(ptrFreeBlock, reqSize);
+
+  TRACE(MM_TRACE_MEMALIGN, size, UNSCALED_POINTER_ADD(ptrFreeBlock, WORD_SIZE), align);
+  PROFILE(UNSCALED_POINTER_ADD(ptrFreeBlock, WORD_SIZE), size);
+  SAFE_POINT();
+  return UNSCALED_POINTER_ADD(ptrFreeBlock, WORD_SIZE);
+}
+
+/* C11 aligned_alloc: like mm_memalign, but size is meant to be a
+   multiple of align. */
+void* mm_aligned_alloc (size_t align, size_t size) {
+  return mm_memalign(align, size);
+}
+
+/* Free the block referenced by ptr. */
+void mm_free (void *ptr) {
+  BlockInfo * blockInfo = (BlockInfo*)UNSCALED_POINTER_SUB(ptr, WORD_SIZE);
+
+  LOCK_HEAP();
+  if (profileLive != 0) {
+    profileForget(ptr);
+  }
+  // Blocks of a size class are kept for reuse.
+  if (!cacheBlock(blockInfo)) {
+    freeBlock(blockInfo);
+  }
+  TRACE(MM_TRACE_FREE, 0, ptr, 0);
+  SAFE_POINT();
+}
+
+/* Free the block referenced by ptr, which the caller promises was
+   allocated with a payload of 'size' bytes (as C++ sized delete does).
+   If that size has a class with room in its cache and the header
+   agrees with it, the block goes straight onto the cache. */
+void mm_free_sized (void *ptr, size_t size) {
+  BlockInfo * blockInfo = (BlockInfo*)UNSCALED_POINTER_SUB(ptr, WORD_SIZE);
+  size_t reqSize = requestToBlockSize(size);
+  SizeClass * sizeClass;
+
+#if MM_DEBUG
+  {
+    // A block mm_realloc resized at the end of the heap may keep up
+    // to a page of slack past the size it was given.
+    size_t blockSize = SIZE(blockInfo->sizeAndTags);
+    if ((blockInfo->sizeAndTags & TAG_USED) == 0 ||
+        blockSize < reqSize || blockSize - reqSize >= mem_pagesize()) {
+      printf("ERROR: mm_free_sized(%p, %zu) does not match the %s block "
+             "of size %zu\n", ptr, size,
+             (blockInfo->sizeAndTags & TAG_USED) ? "allocated" : "free",
+             blockSize);
+      exit(1);
+    }
+  }
+#endif
+
+  // The caller's size picks the class, and the header only has to
+  // confirm it.  A block with slack (left by placeBlock or mm_realloc)
+  // or a wrong size from the caller goes the normal way instead, so a
+  // cache only ever holds blocks of exactly its size.
+  LOCK_HEAP();
+  sizeClass = findClass(reqSize);
+  if (sizeClass != NULL && SIZE(blockInfo->sizeAndTags) == reqSize &&
+      sizeClass->cached < CACHE_SLABS * sizeClass->slabBlocks) {
+    if (profileLive != 0) {
+      profileForget(ptr);
+    }
+    blockInfo->next = BLOCK_OFFSET(sizeClass->head);
+    sizeClass->head = blockInfo;
+    sizeClass->cached++;
+    TRACE(MM_TRACE_FREE, 0, ptr, 0);
+    SAFE_POINT();
+    return;
+  }
+  UNLOCK_HEAP();
+
+  // Otherwise the block is coalesced, which needs its header.  The
+  // size still tells us where the following block starts: mm_malloc
+  // leaves less than MIN_BLOCK_SIZE of slack at the end of a block
+  // (mm_realloc less than a page), so its header is usually on or just
+  // past this line.  Start fetching it now so it overlaps with the
+  // (possibly cold) header read in mm_free.
+  __builtin_prefetch(UNSCALED_POINTER_ADD(blockInfo, reqSize), 1);
+  mm_free(ptr);
+}
+
+/* The number of bytes the caller may use in the block referenced by
+   ptr, which is at least what it asked for. */
+size_t mm_usable_size (void *ptr) {
+  BlockInfo * blockInfo = (BlockInfo*)UNSCALED_POINTER_SUB(ptr, WORD_SIZE);
+
+  return SIZE(blockInfo->sizeAndTags) - WORD_SIZE;
+}
+
+/* Give the pages of large free blocks back to the OS.  Besides
+   shrinking the resident set of an idle process, this makes those
+   blocks known-zero, so mm_calloc can hand them out without clearing
+   them.  Returns the number of blocks purged. */
+int mm_trim (void) {
+  BlockInfo* freeBlock;
+  int purged = 0;
+
+  LOCK_HEAP();
+  drainClasses();
+  for (freeBlock = OFFSET_BLOCK(FREE_LIST_HEAD); freeBlock != NULL; freeBlock = NEXT_FREE(freeBlock)) {
+    if ((freeBlock->sizeAndTags & TAG_ZEROED) == 0 &&
+        SIZE(freeBlock->sizeAndTags) >= PURGE_THRESHOLD) {
+      purgeFreeBlock(freeBlock);
+      purged++;
+    }
+  }
+  SAFE_POINT();
+  return purged;
+}
+
+/* A forked child stops tracing: its blocks are at the same addresses
+   as its parent's, so the two cannot share a trace file. */
+static void traceForked() {
+  mm_trace_stop();
+}
+
+/* Start recording every mm_malloc, mm_calloc, mm_memalign, mm_realloc,
+   mm_free and heap extension in the file at 'path' (laid out as in
+   mmtrace.h), replacing what it held.  Each thread keeps its latest
+   MM_TRACE_RECORDS events there; the file is written as they happen,
+   so it can be read (tracedump) while the process runs or after it
+   dies.  Children forked after this are not traced.  Returns 0 on
+   success and -1 if the file cannot be set up. */
+int mm_trace_start (const char *path) {
+  static int forkHandlerSet;
+  void* map;
+  int fd;
+
+  mm_trace_stop();
+  fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+  if (ftruncate(fd, sizeof(mm_trace_file_t)) < 0) {
+    close(fd);
+    return -1;
+  }
+  map = mmap(NULL, sizeof(mm_trace_file_t), PROT_READ | PROT_WRITE,
+             MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+  ((mm_trace_file_t*)map)->magic = MM_TRACE_MAGIC;
+  if (!forkHandlerSet) {
+    pthread_atfork(NULL, NULL, traceForked);
+    forkHandlerSet = 1;
+  }
+  traceFile = map;
+  return 0;
+}
+
+/* Stop recording events and close the trace file.  No other thread may
+   be in the allocator at the time. */
+void mm_trace_stop (void) {
+  if (traceFile != NULL) {
+    munmap(traceFile, sizeof(mm_trace_file_t));
+    traceFile = NULL;
+  }
+}
+
+/* Start sampling about one allocation per 'interval' bytes for the
+   heap profile (mm_profile_dump), or change the interval. */
+void mm_profile_start (size_t interval) {
+  LOCK_HEAP();
+  profileInterval = interval;
+  profileCountdown = nextSampleGap();
+  UNLOCK_HEAP();
+}
+
+/* Stop sampling and forget the samples taken. */
+void mm_profile_stop (void) {
+  LOCK_HEAP();
+  profileInterval = 0;
+  profileCountdown = SSIZE_MAX;
+  memset(profileSamples, 0, sizeof(profileSamples));
+  profileLive = 0;
+  UNLOCK_HEAP();
+}
+
+/* Whether samples a and b were allocated from the same stack. */
+static int sameStack(ProfileSample* a, ProfileSample* b) {
+  return a->depth == b->depth &&
+    memcmp(a->stack, b->stack, a->depth * sizeof(void*)) == 0;
+}
+
+/* printf to fd through a buffer on the stack: dprintf would allocate
+   one with malloc, which may be us. */
+static void printTo(int fd, const char* format, ...) {
+  char buffer[512];
+  va_list args;
+  int n;
+
+  va_start(args, format);
+  n = vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+  if (n > (int)sizeof(buffer) - 1) {
+    n = sizeof(buffer) - 1;
+  }
+  if (n > 0) {
+    // Nothing useful to do if the write fails.
+    n = write(fd, buffer, n);
+  }
+}
+
+/* Write one frame of a folded stack: the function (or failing that,
+   the file) it is in, and its offset there. */
+static void writeFrame(int fd, void* pc) {
+  Dl_info info;
+  const char* name;
+
+  // pc is a return address; pc - 1 is in the call instruction.
+  if (!dladdr((char*)pc - 1, &info)) {
+    printTo(fd, "%p", pc);
+  } else if (info.dli_sname != NULL) {
+    printTo(fd, "%s", info.dli_sname);
+  } else {
+    name = strrchr(info.dli_fname, '/');
+    printTo(fd, "%s+0x%lx", name != NULL ? name + 1 : info.dli_fname,
+            (unsigned long)((char*)pc - (char*)info.dli_fbase));
+  }
+}
+
+/* Write the blocks that are sampled and still allocated to fd, summed
+   by stack, as a gperftools heap profile (MM_PROFILE_PPROF, which
+   pprof reads, scaling the samples up itself) or as folded stacks
+   with their estimated bytes (MM_PROFILE_FOLDED, for flamegraph.pl).
+   Uses neither malloc nor stdio streams, so it may be called at exit
+   from a program whose malloc this is.  Returns the number of samples
+   written. */
+int mm_profile_dump (int fd, int format) {
+  static char printed[PROFILE_SLOTS];
+  size_t inuseBlocks = 0, inuseBytes = 0;
+  ProfileSample* a;
+  ProfileSample* b;
+  char buffer[4096];
+  ssize_t n;
+  int i, j, k;
+  int maps;
+
+  LOCK_HEAP();
+  // Summing by stack is quadratic in the samples, but there are at
+  // most PROFILE_SLOTS / 2 and it needs no memory.
+  memset(printed, 0, sizeof(printed));
+  for (i = 0; i < PROFILE_SLOTS; i++) {
+    if (profileSamples[i].ptr != NULL) {
+      inuseBlocks++;
+      inuseBytes += profileSamples[i].size;
+    }
+  }
+  if (format == MM_PROFILE_PPROF) {
+    printTo(fd, "heap profile: %zu: %zu [0: 0] @ heap_v2/%zu\n",
+            inuseBlocks, inuseBytes, profileInterval);
+  }
+  for (i = 0; i < PROFILE_SLOTS; i++) {
+    size_t blocks = 0, bytes = 0;
+    double estimate = 0;
+
+    a = &profileSamples[i];
+    if (a->ptr == NULL || printed[i]) {
+      continue;
+    }
+    for (j = i; j < PROFILE_SLOTS; j++) {
+      b = &profileSamples[j];
+      if (b->ptr != NULL && !printed[j] && sameStack(a, b)) {
+        printed[j] = 1;
+        blocks++;
+        bytes += b->size;
+        // Each byte was sampled with probability 1 / profileInterval,
+        // so a block of s bytes with probability 1 - e^(-s/interval).
+        estimate += b->size / -expm1(-(double)b->size / profileInterval);
+      }
+    }
+    if (format == MM_PROFILE_PPROF) {
+      printTo(fd, "%zu: %zu [0: 0] @", blocks, bytes);
+      for (k = 0; k < a->depth; k++) {
+        printTo(fd, " %p", a->stack[k]);
+      }
+    } else {
+      for (k = a->depth - 1; k >= 0; k--) {
+        writeFrame(fd, a->stack[k]);
+        if (k > 0) {
+          printTo(fd, ";");
+        }
+      }
+      printTo(fd, " %lu", (unsigned long)estimate);
+    }
+    printTo(fd, "\n");
+  }
+  UNLOCK_HEAP();
+
+  // pprof needs to know where the code was mapped to name the frames.
+  if (format == MM_PROFILE_PPROF) {
+    printTo(fd, "\nMAPPED_LIBRARIES:\n");
+    if ((maps = open("/proc/self/maps", O_RDONLY)) >= 0) {
+      while ((n = read(maps, buffer, sizeof(buffer))) > 0) {
+        if (write(fd, buffer, n) != n) {
+          break;
+        }
+      }
+      close(maps);
+    }
+  }
+  return inuseBlocks;
+}
+
+/* Set a tuning parameter (one of the MM_OPT_ constants) to value.
+   Returns 1 on success and 0 if the parameter is unknown, like
+   mallopt. */
+int mm_mallopt (int param, int value) {
+  pthread_mutexattr_t attr;
+
+  switch (param) {
+  case MM_OPT_COLORING:
+    colorLargeBlocks = value;
+    return 1;
+  case MM_OPT_SYNC:
+    syncAtSafePoints = value;
+    return 1;
+  case MM_OPT_THREADS:
+    // Only turning it on does anything: mm_init turns it off again,
+    // and a shared heap is always locked.
+    if (value && heapLock == NULL) {
+      pthread_mutexattr_init(&attr);
+      pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+      pthread_mutex_init(HEAP_LOCK, &attr);
+      pthread_mutexattr_destroy(&attr);
+      heapLock = HEAP_LOCK;
+    }
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/* Report the current size classes and how they got there. */
+void mm_class_stats (mm_class_stats_t *stats) {
+  int i;
+
+  stats->epochs = classEpochs;
+  stats->retired = classesRetired;
+  stats->drains = classDrains;
+  stats->num_classes = numClasses;
+  for (i = 0; i < numClasses; i++) {
+    stats->classes[i].block_size = sizeClasses[i].blockSize;
+    stats->classes[i].slab_blocks = sizeClasses[i].slabBlocks;
+    stats->classes[i].cached = sizeClasses[i].cached;
+    stats->classes[i].hits = sizeClasses[i].hits;
+    stats->classes[i].refills = sizeClasses[i].refills;
+    stats->classes[i].epoch_created = sizeClasses[i].epochCreated;
+  }
+}
+
+/* Report what the heap looks like now, and what happened to it since
+   mm_init.  This walks the whole heap. */
+void mm_stats (mm_stats_t *stats) {
+  BlockInfo* block;
+  size_t size;
+  int i;
+
+  LOCK_HEAP();
+  memset(stats, 0, sizeof(*stats));
+  stats->heap_size = mem_heapsize();
+  stats->sbrk_calls = sbrkCalls;
+  for (block = (BlockInfo*)UNSCALED_POINTER_ADD(heapBase, HEAP_HEADER_SIZE);
+       (size = SIZE(block->sizeAndTags)) != 0;
+       block = (BlockInfo*)UNSCALED_POINTER_ADD(block, size)) {
+    if (block->sizeAndTags & TAG_USED) {
+      stats->bytes_allocated += size;
+      stats->bins[statsBin(size)].live_blocks++;
+    } else {
+      stats->bytes_free += size;
+      stats->free_list_length++;
+      stats->bins[statsBin(size)].free_blocks++;
+    }
+  }
+  // Blocks waiting in a size-class cache look used, but are not.
+  for (i = 0; i < numClasses; i++) {
+    for (block = sizeClasses[i].head; block != NULL; block = NEXT_FREE(block)) {
+      size = SIZE(block->sizeAndTags);
+      stats->bytes_allocated -= size;
+      stats->bytes_cached += size;
+      stats->bins[statsBin(size)].live_blocks--;
+      stats->bins[statsBin(size)].cached_blocks++;
+    }
+  }
+  for (i = 0; i < MM_STATS_BINS; i++) {
+    stats->bins[i].splits = splitCounts[i];
+    stats->bins[i].coalesces = coalesceCounts[i];
+  }
+  UNLOCK_HEAP();
+}
+
+
+// HEAP CONSISTENCY CHECKS -------------------------------------------
+
+/* Report a problem with the block at 'where' and count it. */
+static void checkFailed(int* problems, void* where, const char* format, ...) {
+  va_list args;
+
+  fprintf(stderr, "mm_check: %p: ", where);
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fputc('\n', stderr);
+  (*problems)++;
+}
+
+/* Could 'block' be a block: is it between the heap-header and the
+   heap-footer, with its payload aligned? */
+static int inHeap(BlockInfo* block, BlockInfo* heapEnd) {
+  return (char*)block >= heapBase + HEAP_HEADER_SIZE && block < heapEnd &&
+    ((uintptr_t)block + WORD_SIZE) % ALIGNMENT == 0;
+}
+
+/* Check what can be checked of 'block' from the block itself: its
+   header against the following block's, and for a free block its
+   boundary tag, that it is coalesced, and that its free-list
+   neighbours link back to it.  Returns the following block, or NULL
+   if the size is so wrong that the heap cannot be walked further. */
+static BlockInfo* checkBlock(BlockInfo* block, BlockInfo* heapEnd, int* problems) {
+  size_t tags = block->sizeAndTags;
+  size_t size = SIZE(tags);
+  BlockInfo* following = (BlockInfo*)UNSCALED_POINTER_ADD(block, size);
+  BlockInfo* next;
+  BlockInfo* prev;
+  size_t boundaryTag;
+
+  if (((uintptr_t)block + WORD_SIZE) % ALIGNMENT != 0) {
+    checkFailed(problems, block, "payload is not %d-byte aligned", (int)ALIGNMENT);
+  }
+  if (size < MIN_BLOCK_SIZE || following > heapEnd) {
+    checkFailed(problems, block, "impossible size %zu", size);
+    return NULL;
+  }
+  if ((tags & (ALIGNMENT - 1) & ~(size_t)(TAG_USED | TAG_PRECEDING_USED | TAG_ZEROED)) != 0) {
+    checkFailed(problems, block, "stray bits in header %#zx", tags);
+  }
+  if (((following->sizeAndTags & TAG_PRECEDING_USED) != 0) != ((tags & TAG_USED) != 0)) {
+    checkFailed(problems, block, "%s, but the following block's TAG_PRECEDING_USED says otherwise",
+                (tags & TAG_USED) ? "used" : "free");
+  }
+  if (tags & TAG_USED) {
+    return following;
+  }
+
+  boundaryTag = *(size_t*)UNSCALED_POINTER_SUB(following, WORD_SIZE);
+  if (SIZE(boundaryTag) != size || (boundaryTag & TAG_USED) != 0) {
+    checkFailed(problems, block, "boundary tag %#zx does not match header %#zx",
+                boundaryTag, tags);
+  }
+  // Freeing always coalesces, so no two free blocks are adjacent.
+  if ((tags & TAG_PRECEDING_USED) == 0) {
+    checkFailed(problems, block, "free, and so is the preceding block");
+  }
+  if ((following->sizeAndTags & TAG_USED) == 0) {
+    checkFailed(problems, block, "free, and so is the following block");
+  }
+  next = NEXT_FREE(block);
+  prev = PREV_FREE(block);
+  if (next != NULL && (!inHeap(next, heapEnd) || PREV_FREE(next) != block)) {
+    checkFailed(problems, block, "next free block %p does not link back", (void*)next);
+  }
+  if (prev == NULL && OFFSET_BLOCK(FREE_LIST_HEAD) != block) {
+    checkFailed(problems, block, "first in the free list, but the list starts at %p",
+                (void*)OFFSET_BLOCK(FREE_LIST_HEAD));
+  } else if (prev != NULL && (!inHeap(prev, heapEnd) || NEXT_FREE(prev) != block)) {
+    checkFailed(problems, block, "previous free block %p does not link to it", (void*)prev);
+  }
+  return following;
+}
+
+/* Check that each size class caches used blocks of exactly its size,
+   as many as it counts. */
+static void checkClasses(BlockInfo* heapEnd, int* problems) {
+  int i;
+
+  for (i = 0; i < numClasses; i++) {
+    SizeClass* sizeClass = &sizeClasses[i];
+    BlockInfo* block;
+    size_t count = 0;
+
+    // Stop one past the count, in case the list has a cycle.
+    for (block = sizeClass->head; block != NULL && count <= sizeClass->cached;
+         block = NEXT_FREE(block)) {
+      count++;
+      if (!inHeap(block, heapEnd)) {
+        checkFailed(problems, block, "cached by the %zu-byte class, outside the heap",
+                    sizeClass->blockSize);
+        break;
+      }
+      if ((block->sizeAndTags & TAG_USED) == 0 ||
+          SIZE(block->sizeAndTags) != sizeClass->blockSize) {
+        checkFailed(problems, block, "cached by the %zu-byte class, but header is %#zx",
+                    sizeClass->blockSize, block->sizeAndTags);
+      }
+    }
+    if (count != sizeClass->cached) {
+      checkFailed(problems, sizeClass->head, "the %zu-byte class caches %zu%s blocks, not %zu",
+                  sizeClass->blockSize, count, block != NULL ? " or more" : "",
+                  sizeClass->cached);
+    }
+  }
+}
+
+#if MM_INSERTION == MM_ADDRESS_ORDERED
+/* Check that each level of the skip list runs up the heap through
+   free blocks of at least that level, holds all of them, and has the
+   right span sizes.  Only called once the free list itself has checked
+   out. */
+static void checkSkipList(BlockInfo* heapEnd, int* problems) {
+  size_t expected[SKIP_LEVELS + 1] = { 0 };
+  BlockInfo* block;
+  int level;
+
+  for (block = OFFSET_BLOCK(FREE_LIST_HEAD); block != NULL; block = NEXT_FREE(block)) {
+    if (SIZE(block->sizeAndTags) > MIN_BLOCK_SIZE) {
+      if (SKIP_LEVEL(block) > (size_t)SKIP_LEVELS ||
+          SKIP_LEVEL(block) > (SIZE(block->sizeAndTags) / WORD_SIZE - 5) / 2) {
+        checkFailed(problems, block, "impossible skip-list level %zu", SKIP_LEVEL(block));
+        return;
+      }
+      for (level = 1; level <= (int)SKIP_LEVEL(block); level++) {
+        expected[level]++;
+      }
+    }
+  }
+  for (level = 1; level <= SKIP_LEVELS; level++) {
+    BlockInfo* prev = NULL;
+    size_t listed = 0;
+
+    // The heap-header (NULL) first, then each block at this level.
+    block = NULL;
+    do {
+      if (block != NULL &&
+          (listed++ == expected[level] || !inHeap(block, heapEnd) ||
+           (block->sizeAndTags & TAG_USED) != 0 || SIZE(block->sizeAndTags) <= MIN_BLOCK_SIZE ||
+           (int)SKIP_LEVEL(block) < level || (prev != NULL && prev >= block))) {
+        checkFailed(problems, block, "does not belong at level %d of the skip list, after %p",
+                    level, (void*)prev);
+        return;
+      }
+      if (*skipMax(block, level) != skipSpanMax(block, level)) {
+        checkFailed(problems, block != NULL ? (void*)block : (void*)heapBase,
+                    "biggest block in its level %d span is %zu, not %zu", level,
+                    skipSpanMax(block, level), *skipMax(block, level));
+      }
+      prev = block;
+      block = OFFSET_BLOCK(*skipNext(block, level));
+    } while (block != NULL);
+    if (listed != expected[level]) {
+      checkFailed(problems, heapBase, "level %d of the skip list holds %zu of its %zu blocks",
+                  level, listed, expected[level]);
+    }
+  }
+}
+#endif
+
+/* Check every block, then that the free list holds exactly the free
+   blocks, then the size-class caches. */
+static void checkHeap(BlockInfo* heapEnd, int* problems) {
+  BlockInfo* block = (BlockInfo*)UNSCALED_POINTER_ADD(heapBase, HEAP_HEADER_SIZE);
+  BlockInfo* prev = NULL;
+  size_t freeBlocks = 0;
+  size_t listed = 0;
+
+  if ((block->sizeAndTags & TAG_PRECEDING_USED) == 0) {
+    checkFailed(problems, block, "first block, but TAG_PRECEDING_USED is clear");
+  }
+  while (block != heapEnd) {
+    if ((block->sizeAndTags & TAG_USED) == 0) {
+      freeBlocks++;
+    }
+    if ((block = checkBlock(block, heapEnd, problems)) == NULL) {
+      return;
+    }
+  }
+  if (SIZE(heapEnd->sizeAndTags) != 0 || (heapEnd->sizeAndTags & TAG_USED) == 0) {
+    checkFailed(problems, heapEnd, "heap-footer is %#zx", heapEnd->sizeAndTags);
+  }
+
+  // The walk counted the free blocks, which also bounds the list walk
+  // if the list has a cycle.
+  for (block = OFFSET_BLOCK(FREE_LIST_HEAD); block != NULL; block = NEXT_FREE(block)) {
+    if (listed++ == freeBlocks) {
+      checkFailed(problems, block, "the free list is longer than the %zu free blocks",
+                  freeBlocks);
+      break;
+    }
+    if (!inHeap(block, heapEnd)) {
+      checkFailed(problems, block, "in the free list, outside the heap");
+      break;
+    }
+    if (block->sizeAndTags & TAG_USED) {
+      checkFailed(problems, block, "used, but in the free list");
+    }
+    if (PREV_FREE(block) != prev) {
+      checkFailed(problems, block, "prev is %p, not %p", (void*)PREV_FREE(block), (void*)prev);
+    }
+#if MM_INSERTION == MM_ADDRESS_ORDERED
+    if (prev != NULL && prev > block) {
+      checkFailed(problems, block, "in the free list after %p, out of address order",
+                  (void*)prev);
+    }
+#endif
+    prev = block;
+  }
+#if MM_INSERTION == MM_FIFO
+  if (block == NULL && OFFSET_BLOCK(freeListTail) != prev) {
+    checkFailed(problems, OFFSET_BLOCK(freeListTail), "the free list's tail, not %p",
+                (void*)prev);
+  }
+#endif
+  if (listed < freeBlocks) {
+    checkFailed(problems, heapBase, "the free list holds %zu of the %zu free blocks",
+                listed, freeBlocks);
+  }
+#if MM_INSERTION == MM_ADDRESS_ORDERED
+  if (*problems == 0) {
+    checkSkipList(heapEnd, problems);
+  }
+#endif
+  checkClasses(heapEnd, problems);
+}
+
+/* Check the next 'budget' blocks from checkCursor on.  Each time the
+   walk gets round to the end of the heap, the size-class caches are
+   checked too.  The free list as a whole is not: each free block's
+   links are checked as the walk passes it. */
+static void checkSomeBlocks(BlockInfo* heapEnd, size_t budget, int* problems) {
+  BlockInfo* first = (BlockInfo*)UNSCALED_POINTER_ADD(heapBase, HEAP_HEADER_SIZE);
+  BlockInfo* block = OFFSET_BLOCK(checkCursor);
+
+  // The heap may have shrunk under the cursor.
+  if (block == NULL || block > heapEnd) {
+    block = first;
+  }
+  while (budget-- > 0) {
+    if (block == heapEnd) {
+      checkClasses(heapEnd, problems);
+      block = first;
+    } else if ((block = checkBlock(block, heapEnd, problems)) == NULL) {
+      block = first;
+      break;
+    }
+  }
+  checkCursor = BLOCK_OFFSET(block);
+}
+
+/* Check the whole heap.  Returns the number of problems found, each
+   of which is printed to stderr. */
+int mm_check() {
+  return mm_check_mode(MM_CHECK_FULL, 0);
+}
+
+/* Check the heap as thoroughly as 'mode' says (see mm.h); a mode
+   mm.h does not know means MM_CHECK_FULL.  A full check walks the
+   whole heap and free list, so calling it after every operation makes
+   a run quadratic; the other modes keep the cost per call bounded. */
+int mm_check_mode (int mode, size_t budget) {
+  BlockInfo* heapEnd;
+  int problems = 0;
+
+  LOCK_HEAP();
+  heapEnd = (BlockInfo*)UNSCALED_POINTER_SUB(mem_heap_hi(), WORD_SIZE - 1);
+  if (mode == MM_CHECK_INCREMENTAL) {
+    checkSomeBlocks(heapEnd, budget, &problems);
+  } else if (mode == MM_CHECK_SAMPLED) {
+    // xorshift64
+    checkRandom ^= checkRandom << 13;
+    checkRandom ^= checkRandom >> 7;
+    checkRandom ^= checkRandom << 17;
+    if (budget <= 1 || checkRandom % budget == 0) {
+      checkHeap(heapEnd, &problems);
+    }
+  } else {
+    checkHeap(heapEnd, &problems);
+  }
+  UNLOCK_HEAP();
+  return problems;
+}
+
+/* Resize the block referenced by ptr to hold size bytes, moving it
+   only if it cannot grow in place.  Behaves like mm_malloc if ptr is
+   NULL and like mm_free if size is zero.  If there is no room, returns
+   NULL and leaves the block as it was. */
+void* mm_realloc(void* ptr, size_t size) {
+  BlockInfo* block;
+  BlockInfo* followingBlock;
+  size_t reqSize;
+  size_t blockSize;
+  size_t followingTags;
+  void* newPtr;
+
+  if (ptr == NULL) {
+    return mm_malloc(size);
+  }
+  if (size == 0) {
+    mm_free(ptr);
+    return NULL;
+  }
+  if (size > MAX_REQUEST) {
+    return NULL;
+  }
+
+  LOCK_HEAP();
+  block = (BlockInfo*)UNSCALED_POINTER_SUB(ptr, WORD_SIZE);
+  blockSize = SIZE(block->sizeAndTags);
+  reqSize = requestToBlockSize(size);
+
+  // Shrinking (or staying the same) always works in place.  At the end
+  // of the heap, up to a page of the old size is kept as slack for the
+  // next grow instead of being split off: a small mm_malloc would land
+  // in it and pin this block in place.
+  if (reqSize <= blockSize) {
+    if (!endsHeap(block) || blockSize - reqSize >= mem_pagesize()) {
+      shrinkUsedBlock(block, reqSize);
+    }
+    TRACE(MM_TRACE_REALLOC, size, ptr, (uintptr_t)ptr);
+    SAFE_POINT();
+    return ptr;
+  }
+
+  // Growing: if the following block is the end of the heap, or a free
+  // block at the end of it, extend the heap first so there is room to
+  // grow into.  This is the common case for a buffer that keeps
+  // growing, and it saves copying it every time.  If the heap cannot
+  // grow, the move below fails too.
+  followingBlock = (BlockInfo*)UNSCALED_POINTER_ADD(block, blockSize);
+  followingTags = followingBlock->sizeAndTags;
+  if (endsHeap(block)) {
+    requestMoreSpace(reqSize - blockSize);
+  } else if ((followingTags & TAG_USED) == 0 &&
+             blockSize + SIZE(followingTags) < reqSize &&
+             endsHeap(followingBlock)) {
+    requestMoreSpace(reqSize - blockSize - SIZE(followingTags));
+  }
+
+  // Absorb the following block if it is free and big enough.
+  followingTags = followingBlock->sizeAndTags;
+  if ((followingTags & TAG_USED) == 0 && blockSize + SIZE(followingTags) >= reqSize) {
+    BlockInfo* afterBlock;
+
+    removeFreeBlock(followingBlock);
+    if (checkCursor == BLOCK_OFFSET(followingBlock)) {
+      checkCursor = BLOCK_OFFSET(block);
+    }
+    blockSize += SIZE(followingTags);
+    block->sizeAndTags = blockSize | (block->sizeAndTags & (TAG_PRECEDING_USED | TAG_USED));
+    afterBlock = (BlockInfo*)UNSCALED_POINTER_ADD(block, blockSize);
+    afterBlock->sizeAndTags |= TAG_PRECEDING_USED;
+
+    // Again, keep less than a page of slack at the end of the heap.
+    if (!endsHeap(block) || blockSize - reqSize >= mem_pagesize()) {
+      shrinkUsedBlock(block, reqSize);
+    }
+    markHandedOut(block);
+    TRACE(MM_TRACE_REALLOC, size, ptr, (uintptr_t)ptr);
+    SAFE_POINT();
+    return ptr;
+  }
+
+  // Otherwise move it.  Multi-KB blocks are copied with streaming
+  // stores so the move does not flush the caller's working set.
+  traceMuted++;
+  newPtr = mm_malloc(size);
+  if (newPtr == NULL) {
+    traceMuted--;
+    UNLOCK_HEAP();
+    return NULL;
+  }
+  fast_copy(newPtr, ptr, blockSize - WORD_SIZE);
+  mm_free(ptr);
+  traceMuted--;
+  TRACE(MM_TRACE_REALLOC, size, newPtr, (uintptr_t)ptr);
+  SAFE_POINT();
+  return newPtr;
+}
+
+
+// RELOCATABLE (HANDLE) ALLOCATIONS ---------------------------------
+
+/* Is the used block 'block' a relocatable block that nothing has
+   locked?  A plain block's first payload word is user data, but it
+   can never name a table entry that points back at the block. */
+static int isMovableBlock(BlockInfo* block) {
+  size_t index = *(size_t*)UNSCALED_POINTER_ADD(block, WORD_SIZE);
+  return index < handleCount && handleTable[index].block == block &&
+    handleTable[index].locks == 0;
+}
+
+/* Turn the space from 'hole' up to the used block 'end' into a free
+   block.  Both its neighbours are used, so it needs no coalescing. */
+static void closeHole(BlockInfo* hole, BlockInfo* end) {
+  size_t size = (char*)end - (char*)hole;
+
+  hole->sizeAndTags = size | TAG_PRECEDING_USED;
+  *(size_t*)UNSCALED_POINTER_SUB(end, WORD_SIZE) = hole->sizeAndTags;
+  end->sizeAndTags &= ~TAG_PRECEDING_USED;
+  insertFreeBlock(hole);
+}
+
+/* Allocate a relocatable block of size bytes and return its handle,
+   or 0 if size is zero or there is no room.  If no free block fits,
+   the heap is compacted before it is grown. */
+mm_handle_t mm_halloc (size_t size) {
+  size_t reqSize;
+  size_t index;
+  BlockInfo* block;
+
+  if (size == 0 || size > MAX_REQUEST) {
+    return 0;
+  }
+  LOCK_HEAP();
+  reqSize = requestToBlockSize(size + WORD_SIZE);
+
+  // Take a table entry first: growing the table may move it, and
+  // must not happen between placing the block and filling it in.
+  if (freeHandle == handleCount) {
+    size_t newCount = handleCount ? 2 * handleCount : 16;
+    HandleEntry* newTable = mm_realloc(handleTable, newCount * sizeof(HandleEntry));
+    if (newTable == NULL) {
+      UNLOCK_HEAP();
+      return 0;
+    }
+    handleTable = newTable;
+    for (index = handleCount; index < newCount; index++) {
+      handleTable[index].block = NULL;
+      handleTable[index].locks = index + 1;
+    }
+    handleCount = newCount;
+  }
+  index = freeHandle;
+  freeHandle = handleTable[index].locks;
+
+  if (searchFreeList(reqSize) == NULL && freedSinceCompact >= reqSize) {
+    mm_compact();
+  }
+  block = takeFreeBlock(reqSize);
+  if (block == NULL) {
+    handleTable[index].locks = freeHandle;
+    freeHandle = index;
+    UNLOCK_HEAP();
+    return 0;
+  }
+  placeBlock(block, reqSize);
+
+  *(size_t*)UNSCALED_POINTER_ADD(block, WORD_SIZE) = index;
+  handleTable[index].block = block;
+  handleTable[index].locks = 0;
+  SAFE_POINT();
+  return index + 1;
+}
+
+/* Pin the block of 'handle' and return its payload.  The pointer
+   stays valid until the matching mm_hunlock.  Locks nest. */
+void* mm_hlock (mm_handle_t handle) {
+  HandleEntry* entry;
+  void* payload;
+
+  // mm_halloc may move the table and mm_compact the block.
+  LOCK_HEAP();
+  entry = &handleTable[handle - 1];
+  entry->locks++;
+  payload = UNSCALED_POINTER_ADD(entry->block, 2 * WORD_SIZE);
+  SAFE_POINT();
+  return payload;
+}
+
+/* Undo one mm_hlock of 'handle'. */
+void mm_hunlock (mm_handle_t handle) {
+  LOCK_HEAP();
+  handleTable[handle - 1].locks--;
+  SAFE_POINT();
+}
+
+/* Free the block of 'handle', locked or not.  The handle may be
+   reused by a later mm_halloc. */
+void mm_hfree (mm_handle_t handle) {
+  size_t index = handle - 1;
+
+  LOCK_HEAP();
+  mm_free(UNSCALED_POINTER_ADD(handleTable[index].block, WORD_SIZE));
+  handleTable[index].block = NULL;
+  handleTable[index].locks = freeHandle;
+  freeHandle = index;
+  SAFE_POINT();
+}
+
+/* Slide every unlocked relocatable block down over the free space
+   below it, as far as the nearest pinned block (any mm_malloc block,
+   or a locked one), and lower the brk past the free space left at
+   the top of the heap.  Returns the number of bytes the heap shrank
+   by. */
+size_t mm_compact (void) {
+  BlockInfo* heapEnd;
+  BlockInfo* block = (BlockInfo*)UNSCALED_POINTER_ADD(heapBase, HEAP_HEADER_SIZE);
+  // Start of the free space collected since the last pinned block,
+  // if any.  Everything from here up to 'block' is free.
+  BlockInfo* hole = NULL;
+  size_t shrink;
+
+  LOCK_HEAP();
+  heapEnd = (BlockInfo*)UNSCALED_POINTER_SUB(mem_heap_hi(), WORD_SIZE - 1);
+  // Cached blocks would pin everything above them.
+  drainClasses();
+  freedSinceCompact = 0;
+  // Blocks move, so the incremental check starts over.
+  checkCursor = 0;
+
+  while (block != heapEnd) {
+    size_t size = SIZE(block->sizeAndTags);
+    BlockInfo* following = (BlockInfo*)UNSCALED_POINTER_ADD(block, size);
+
+    if ((block->sizeAndTags & TAG_USED) == 0) {
+      // Free blocks all become part of some hole.
+      removeFreeBlock(block);
+      if (hole == NULL) {
+        hole = block;
+      }
+    } else if (hole != NULL && isMovableBlock(block)) {
+      size_t index = *(size_t*)UNSCALED_POINTER_ADD(block, WORD_SIZE);
+      // The hole moves up past the block, keeping its size.  Whatever
+      // is below it is used now.
+      memmove(hole, block, size);
+      hole->sizeAndTags = size | TAG_PRECEDING_USED | TAG_USED;
+      handleTable[index].block = hole;
+      hole = (BlockInfo*)UNSCALED_POINTER_ADD(hole, size);
+    } else if (hole != NULL) {
+      closeHole(hole, block);
+      hole = NULL;
+    }
+    block = following;
+  }
+
+  if (hole == NULL) {
+    SAFE_POINT();
+    return 0;
+  }
+
+  // Hand the free space at the top back: 'hole' becomes the new
+  // heap-footer.  The stale data above it is no longer clean.
+  shrink = (char*)heapEnd - (char*)hole;
+  if ((char*)heapEnd + WORD_SIZE > cleanLo) {
+    cleanLo = (char*)heapEnd + WORD_SIZE;
+  }
+  mem_shrink(shrink);
+  hole->sizeAndTags = TAG_USED | TAG_PRECEDING_USED;
+  SAFE_POINT();
+  return shrink;
+}
+
+/* Copy out the histograms recorded since mm_init; all zero unless
+   mm.c was built with MM_INSTRUMENT. */
+void mm_instrument_stats (mm_instrument_t *stats) {
+#if MM_INSTRUMENT
+  *stats = instrument;
+#else
+  memset(stats, 0, sizeof(*stats));
+#endif
+}
+
+#if MM_INSTRUMENT
+/* The timed public calls. */
+#undef mm_malloc
+#undef mm_free
+#undef mm_free_sized
+#undef mm_realloc
+
+void* mm_malloc (size_t size) {
+  unsigned long long start = READ_CYCLES();
+  void* ptr = untimedMalloc(size);
+  instrument.cycles[MM_INSTR_MALLOC][histBucket(READ_CYCLES() - start)]++;
+  return ptr;
+}
+
+void mm_free (void *ptr) {
+  unsigned long long start = READ_CYCLES();
+  untimedFree(ptr);
+  instrument.cycles[MM_INSTR_FREE][histBucket(READ_CYCLES() - start)]++;
+}
+
+void mm_free_sized (void *ptr, size_t size) {
+  unsigned long long start = READ_CYCLES();
+  untimedFreeSized(ptr, size);
+  instrument.cycles[MM_INSTR_FREE][histBucket(READ_CYCLES() - start)]++;
+}
+
+void* mm_realloc (void* ptr, size_t size) {
+  unsigned long long start = READ_CYCLES();
+  void* newPtr = untimedRealloc(ptr, size);
+  instrument.cycles[MM_INSTR_REALLOC][histBucket(READ_CYCLES() - start)]++;
+  return newPtr;
+}
+#endif
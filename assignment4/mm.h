@@ -2,7 +2,147 @@
 
 extern int mm_init (void);
 extern void *mm_malloc (size_t size);
+extern void *mm_malloc_hint (size_t size, int lifetime);
+extern void *mm_memalign (size_t align, size_t size);
+extern void *mm_aligned_alloc (size_t align, size_t size);
+extern void *mm_calloc (size_t nmemb, size_t size);
 extern void mm_free (void *ptr);
+extern void mm_free_sized (void *ptr, size_t size);
+extern size_t mm_usable_size (void *ptr);
+extern int mm_trim (void);
+
+// Tuning parameters for mm_mallopt
+#define MM_OPT_COLORING 1   // stagger large blocks across cache sets (default 1)
+#define MM_OPT_SYNC 2       // msync a persistent heap after every call (default 0)
+#define MM_OPT_THREADS 3    // lock every call, for threads sharing the heap (default 0)
+extern int mm_mallopt (int param, int value);
+
+// Lifetime classes for mm_malloc_hint
+#define MM_LIFETIME_UNKNOWN 0
+#define MM_LIFETIME_SHORT 1
+#define MM_LIFETIME_LONG 2
+
+// Size classes, re-derived while the program runs from a sampled
+// histogram of request sizes (see mm.c)
+#define MM_NUM_CLASSES 8
+typedef struct {
+  size_t block_size;    // block size served by the class
+  size_t slab_blocks;   // blocks carved per refill
+  size_t cached;        // freed blocks waiting for reuse
+  size_t hits;          // mm_malloc calls served from the cache
+  size_t refills;       // slabs carved
+  size_t epoch_created; // epoch in which the class first appeared
+} mm_size_class_t;
+typedef struct {
+  size_t epochs;        // times the classes were re-derived
+  size_t retired;       // classes dropped again
+  size_t drains;        // times every cache was flushed to avoid growing
+  int num_classes;
+  mm_size_class_t classes[MM_NUM_CLASSES];
+} mm_class_stats_t;
+extern void mm_class_stats (mm_class_stats_t *stats);
+
+// Allocator statistics (mm_stats).  Block sizes include the header.
+// Bin i counts blocks of 32 << i bytes up to twice that; the last bin
+// also counts everything bigger.
+#define MM_STATS_BINS 16
+typedef struct {
+  size_t live_blocks;   // allocated blocks
+  size_t free_blocks;   // blocks on the free list
+  size_t cached_blocks; // freed blocks in size-class caches
+  size_t splits;        // blocks of this size split since mm_init
+  size_t coalesces;     // merges since mm_init that made a block this size
+} mm_bin_stats_t;
+typedef struct {
+  size_t bytes_allocated;  // in allocated blocks
+  size_t bytes_free;       // in free blocks
+  size_t bytes_cached;     // in size-class caches
+  size_t heap_size;
+  size_t sbrk_calls;       // since mm_init
+  size_t free_list_length;
+  mm_bin_stats_t bins[MM_STATS_BINS];
+} mm_stats_t;
+extern void mm_stats (mm_stats_t *stats);
+
+// Event tracing to a file of per-thread rings (see mmtrace.h), which
+// tracedump turns into a trace
+extern int mm_trace_start (const char *path);
+extern void mm_trace_stop (void);
+
+// Sampling heap profiler: samples about one allocation per interval
+// bytes, and dumps the stacks of the sampled blocks still allocated
+#define MM_PROFILE_PPROF 0    // gperftools heap profile, for pprof
+#define MM_PROFILE_FOLDED 1   // folded stacks, for flamegraph.pl
+extern void mm_profile_start (size_t interval);
+extern void mm_profile_stop (void);
+extern int mm_profile_dump (int fd, int format);
+
+// Histograms mm.c records when built with -DMM_INSTRUMENT=1.  Bucket
+// 0 counts zeros, and bucket b > 0 values from 2^(b-1) up to 2^b;
+// the last bucket also counts everything bigger.  Coalesce fan-in is
+// not bucketed: entry i counts coalesces that merged i blocks (1
+// means nothing merged).
+#define MM_HIST_BUCKETS 24
+#define MM_INSTR_MALLOC 0
+#define MM_INSTR_FREE 1
+#define MM_INSTR_REALLOC 2
+#define MM_INSTR_OPS 3
+typedef struct {
+  size_t search_length[MM_HIST_BUCKETS];    // free blocks visited per search
+  size_t split_remainder[MM_HIST_BUCKETS];  // bytes split off a block
+  size_t coalesce_fanin[MM_HIST_BUCKETS];   // blocks merged per coalesce
+  size_t cycles[MM_INSTR_OPS][MM_HIST_BUCKETS]; // cycles per call
+} mm_instrument_t;
+extern void mm_instrument_stats (mm_instrument_t *stats);
+
+// Heap consistency checks.  Both return the number of problems found
+// (0 if the heap is consistent), printing each one to stderr.
+// mm_check checks the whole heap.  mm_check_mode can instead check the
+// next budget blocks, carrying on where the last call stopped, or the
+// whole heap on about one call in budget.
+#define MM_CHECK_FULL 0          // budget is ignored
+#define MM_CHECK_INCREMENTAL 1   // budget blocks per call
+#define MM_CHECK_SAMPLED 2       // a full check once per budget calls
+extern int mm_check (void);
+extern int mm_check_mode (int mode, size_t budget);
+
+// Free-list policies.  mm.c is built with one placement and one
+// insertion policy, chosen with -DMM_PLACEMENT=... -DMM_INSERTION=...
+// (default first fit, LIFO); "make policies" builds every pair.
+#define MM_FIRST_FIT 0
+#define MM_NEXT_FIT 1           // first fit from where the last search stopped
+#define MM_BEST_FIT 2
+#define MM_GOOD_FIT 3           // the first block within 1/8 of the request,
+                                // else the best
+#define MM_LIFO 0
+#define MM_FIFO 1
+#define MM_ADDRESS_ORDERED 2
+extern const char *mm_policy (void);   // e.g. "first-fit/lifo"
+
+// Relocatable blocks, reached through a handle.  A block is only
+// pinned while it is locked; otherwise mm_halloc and mm_compact may
+// move it.  Handle 0 is never returned.
+typedef size_t mm_handle_t;
+extern mm_handle_t mm_halloc (size_t size);
+extern void *mm_hlock (mm_handle_t handle);
+extern void mm_hunlock (mm_handle_t handle);
+extern void mm_hfree (mm_handle_t handle);
+extern size_t mm_compact (void);
+
+// A heap kept in a file, which outlives the process.  The root is
+// how the next process finds the data again.
+extern int mm_open_persistent (const char *path);
+extern void mm_close_persistent (void);
+extern void mm_sync (void);
+extern void mm_set_root (void *root);
+extern void *mm_get_root (void);
+
+// A heap in shared memory, used by several processes at once.  Blocks
+// are passed between them as offsets.
+extern int mm_open_shared (const char *name);
+extern void mm_close_shared (void);
+extern size_t mm_offset (void *ptr);
+extern void *mm_pointer (size_t offset);
 
 // Extra credit
 extern void* mm_realloc(void* ptr, size_t size);
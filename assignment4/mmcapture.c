@@ -0,0 +1,517 @@
+/*
+ * mmcapture.c - records the allocations a real program makes with the
+ *    C library's own malloc as a trace for mdriver, for building
+ *    libmmcapture.so.  Running a program with
+ *
+ *        MM_CAPTURE=<file> LD_PRELOAD=./libmmcapture.so program ...
+ *
+ *    writes its malloc, calloc, realloc and free calls to <file>.<pid>
+ *    as "a <id> <size>", "r <id> <size>" and "f <id>" lines (calloc is
+ *    an "a"), which mdriver-realloc replays.  With MM_CAPTURE_SPLIT
+ *    set as well, each realloc is written as an allocation and a free
+ *    instead, for mdriver.  Unlike MM_TRACE with libmm.so, the program
+ *    runs on glibc's allocator, so this shows what it does in
+ *    production.
+ *
+ *    Ids: each live block has one, found from its address in an
+ *    open-addressed table, and the ids of freed blocks are handed out
+ *    again, so the trace needs only as many as are ever live at once.
+ *    Frees of blocks we never saw allocated are left out.
+ *
+ *    Output: lines are collected in a buffer and written out when it
+ *    fills, and each time the header (written at a fixed width, so it
+ *    can be) is rewritten with the counts so far, so the file is a
+ *    complete trace even if the program is killed.
+ *
+ *    Reentrancy: our own bookkeeping never calls malloc (its tables
+ *    come from mmap), and a thread flag passes any call made while we
+ *    are in the middle of one, say from dlsym, straight through
+ *    unrecorded.  dlsym allocates while looking up the real calloc, so
+ *    that is served from a small static arena.
+ *
+ *    Threads and fork: one lock guards the tables and the buffer.  A
+ *    free is recorded before the block is released, and a realloc
+ *    under the lock, so a block's address is never handed to another
+ *    thread while the trace still thinks it is live.  A child process
+ *    stops recording; one that runs a new program starts over in a
+ *    file of its own.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define BUFFER_SIZE (1 << 20)
+#define HEADER_SIZE 80           /* three counts of 20 digits, and a 1 */
+#define ARENA_SIZE 65536         /* for dlsym, before we have calloc */
+
+/* live blocks: an open-addressed table from address to block id */
+typedef struct {
+  uintptr_t address;             /* 0 if empty */
+  uint32_t id;
+  size_t size;
+} slot_t;
+
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void (*real_free)(void *);
+
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int busy __attribute__((tls_model("initial-exec")));
+static int capturing = 0;
+static int split_reallocs = 0;
+static int fd = -1;
+
+static slot_t *slots;
+static size_t num_slots, num_live;   /* num_slots is a power of two */
+static uint32_t *free_ids;
+static size_t num_free_ids, max_ids;
+static uint32_t num_ids;
+static uint64_t num_ops, live_bytes, peak_bytes;
+
+static char buffer[BUFFER_SIZE];
+static size_t buffered;
+
+static char arena[ARENA_SIZE] __attribute__((aligned(16)));
+static size_t arena_used;
+
+/*
+ * map - zeroed memory straight from the kernel
+ */
+static void *map(size_t size)
+{
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  return p == MAP_FAILED ? NULL : p;
+}
+
+/*
+ * write_all - write n bytes at offset (or, if offset is -1, at the end)
+ */
+static void write_all(const char *p, size_t n, off_t offset)
+{
+  ssize_t k;
+
+  while (n > 0) {
+    k = offset < 0 ? write(fd, p, n) : pwrite(fd, p, n, offset);
+    if (k <= 0) {
+      capturing = 0;             /* disk full, say: stop quietly */
+      return;
+    }
+    p += k;
+    n -= k;
+    if (offset >= 0)
+      offset += k;
+  }
+}
+
+/*
+ * put_number - append n in decimal, right-aligned in width columns
+ */
+static char *put_number(char *p, uint64_t n, int width)
+{
+  char digits[20];
+  int k = 0;
+
+  do {
+    digits[k++] = '0' + n % 10;
+    n /= 10;
+  } while (n > 0);
+  while (width-- > k)
+    *p++ = ' ';
+  while (k > 0)
+    *p++ = digits[--k];
+  return p;
+}
+
+/*
+ * write_header - write the header with the counts so far, at offset
+ *    (or, if offset is -1, at the end)
+ */
+static void write_header(off_t offset)
+{
+  char header[HEADER_SIZE], *p = header;
+
+  p = put_number(p, peak_bytes, 20);
+  *p++ = '\n';
+  p = put_number(p, num_ids, 20);
+  *p++ = '\n';
+  p = put_number(p, num_ops, 20);
+  *p++ = '\n';
+  *p++ = '1';
+  *p++ = '\n';
+  write_all(header, p - header, offset);
+}
+
+/*
+ * flush - write out the buffer, then bring the header up to date
+ */
+static void flush(void)
+{
+  if (!capturing)
+    return;
+  write_all(buffer, buffered, -1);
+  buffered = 0;
+  write_header(0);
+}
+
+/*
+ * emit - append a trace line: type, id and (unless 0) size
+ */
+static void emit(char type, uint32_t id, size_t size)
+{
+  char *p;
+
+  if (BUFFER_SIZE - buffered < 48)
+    flush();
+  p = buffer + buffered;
+  *p++ = type;
+  *p++ = ' ';
+  p = put_number(p, id, 0);
+  if (type != 'f') {
+    *p++ = ' ';
+    p = put_number(p, size, 0);
+  }
+  *p++ = '\n';
+  buffered = p - buffer;
+  num_ops++;
+}
+
+/*
+ * find - the slot holding address, or the empty slot where it would go
+ */
+static slot_t *find(uintptr_t address)
+{
+  size_t i = (address >> 4) * 0x9e3779b97f4a7c15UL;
+
+  for (i &= num_slots - 1; slots[i].address != 0; i = (i + 1) & (num_slots - 1))
+    if (slots[i].address == address)
+      return &slots[i];
+  return &slots[i];
+}
+
+/*
+ * grow - double the table, or the free id stack, when it fills up.
+ *    Returns 0 if there is no memory for it, and recording stops.
+ */
+static int grow(void)
+{
+  slot_t *old = slots, *s;
+  size_t old_slots = num_slots, i;
+  uint32_t *ids;
+
+  if (num_free_ids == 0 && num_ids == max_ids) {
+    if ((ids = map(2 * max_ids * sizeof(uint32_t))) == NULL)
+      return capturing = 0;
+    memcpy(ids, free_ids, num_free_ids * sizeof(uint32_t));
+    munmap(free_ids, max_ids * sizeof(uint32_t));
+    free_ids = ids;
+    max_ids *= 2;
+  }
+  if (2 * (num_live + 1) > num_slots) {
+    if ((slots = map(2 * old_slots * sizeof(slot_t))) == NULL) {
+      slots = old;
+      return capturing = 0;
+    }
+    num_slots = 2 * old_slots;
+    for (i = 0; i < old_slots; i++)
+      if (old[i].address != 0) {
+        s = find(old[i].address);
+        *s = old[i];
+      }
+    munmap(old, old_slots * sizeof(slot_t));
+  }
+  return 1;
+}
+
+/*
+ * remove_slot - empty a slot, moving later ones of its run back so
+ *    that find still reaches them
+ */
+static void remove_slot(slot_t *slot)
+{
+  size_t i = slot - slots, j = i, k;
+
+  for (;;) {
+    j = (j + 1) & (num_slots - 1);
+    if (slots[j].address == 0)
+      break;
+    k = ((slots[j].address >> 4) * 0x9e3779b97f4a7c15UL) & (num_slots - 1);
+    /* slot j can move to i if its home is not in (i, j] */
+    if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+      slots[i] = slots[j];
+      i = j;
+    }
+  }
+  slots[i].address = 0;
+  num_live--;
+}
+
+/*
+ * record_free - write the free of a block we know of
+ */
+static void record_free(void *p)
+{
+  slot_t *slot;
+
+  if (p == NULL)
+    return;
+  slot = find((uintptr_t)p);
+  if (slot->address == 0)
+    return;
+  emit('f', slot->id, 0);
+  live_bytes -= slot->size;
+  free_ids[num_free_ids++] = slot->id;
+  remove_slot(slot);
+}
+
+/*
+ * record_alloc - write a new block at p as an "a" line, or, given the
+ *    id of the block it was realloced from, as an "r" line.  A
+ *    zero-byte request is written as one byte, which is what libmm.so
+ *    asks mm_malloc for: mm_malloc(0) returns NULL, and mdriver would
+ *    reject the trace.
+ */
+static void record_alloc(void *p, size_t size, int64_t id)
+{
+  slot_t *slot;
+
+  if (p == NULL || !grow())
+    return;
+  if (size == 0)
+    size = 1;
+  slot = find((uintptr_t)p);
+  if (slot->address != 0)        /* its free went by unseen */
+    record_free(p);
+  slot = find((uintptr_t)p);
+  slot->address = (uintptr_t)p;
+  if (id >= 0) {
+    emit('r', id, size);
+  } else {
+    id = num_free_ids > 0 ? free_ids[--num_free_ids] : num_ids++;
+    emit('a', id, size);
+  }
+  slot->id = id;
+  slot->size = size;
+  num_live++;
+  live_bytes += size;
+  if (live_bytes > peak_bytes)
+    peak_bytes = live_bytes;
+}
+
+/*
+ * find_real - look up the C library's functions behind ours
+ */
+static void find_real(void)
+{
+  busy++;
+  real_calloc = dlsym(RTLD_NEXT, "calloc");
+  real_malloc = dlsym(RTLD_NEXT, "malloc");
+  real_realloc = dlsym(RTLD_NEXT, "realloc");
+  real_free = dlsym(RTLD_NEXT, "free");
+  busy--;
+}
+
+/*
+ * from_arena - whether p came from the static arena
+ */
+static int from_arena(void *p)
+{
+  return (char *)p >= arena && (char *)p < arena + ARENA_SIZE;
+}
+
+/*
+ * arena_alloc - a zeroed block from the arena, for dlsym
+ */
+static void *arena_alloc(size_t size)
+{
+  void *p;
+
+  if (size > ARENA_SIZE)
+    return NULL;
+  size = (size + 15) & ~15UL;
+  if (size > ARENA_SIZE - arena_used)
+    return NULL;
+  p = arena + arena_used;
+  arena_used += size;
+  return p;
+}
+
+void *malloc(size_t size)
+{
+  void *p;
+
+  if (real_malloc == NULL) {
+    if (busy)
+      return arena_alloc(size);
+    find_real();
+  }
+  if (!capturing || busy)
+    return real_malloc(size);
+  busy++;
+  p = real_malloc(size);
+  pthread_mutex_lock(&capture_lock);
+  record_alloc(p, size, -1);
+  pthread_mutex_unlock(&capture_lock);
+  busy--;
+  return p;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+  void *p;
+
+  if (real_calloc == NULL) {
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+      errno = ENOMEM;
+      return NULL;
+    }
+    if (busy)
+      return arena_alloc(nmemb * size);
+    find_real();
+  }
+  if (!capturing || busy)
+    return real_calloc(nmemb, size);
+  busy++;
+  p = real_calloc(nmemb, size);
+  pthread_mutex_lock(&capture_lock);
+  record_alloc(p, nmemb * size, -1);
+  pthread_mutex_unlock(&capture_lock);
+  busy--;
+  return p;
+}
+
+void free(void *p)
+{
+  if (from_arena(p))
+    return;
+  if (real_free == NULL)
+    find_real();
+  if (!capturing || busy || p == NULL) {
+    real_free(p);
+    return;
+  }
+  busy++;
+  pthread_mutex_lock(&capture_lock);
+  record_free(p);
+  pthread_mutex_unlock(&capture_lock);
+  real_free(p);
+  busy--;
+}
+
+void *realloc(void *p, size_t size)
+{
+  slot_t *slot;
+  void *q;
+  int64_t id = -1;
+
+  if (from_arena(p)) {
+    /* the block cannot run past the end of the arena */
+    if ((q = malloc(size)) != NULL)
+      memcpy(q, p, size < (size_t)(arena + ARENA_SIZE - (char *)p) ? size :
+             (size_t)(arena + ARENA_SIZE - (char *)p));
+    return q;
+  }
+  if (real_realloc == NULL)
+    find_real();
+  if (!capturing || busy)
+    return real_realloc(p, size);
+  busy++;
+  pthread_mutex_lock(&capture_lock);
+  q = real_realloc(p, size);
+  if (p == NULL) {
+    record_alloc(q, size, -1);
+  } else if (q == NULL) {
+    if (size == 0)               /* glibc frees p */
+      record_free(p);
+  } else if ((slot = find((uintptr_t)p))->address == 0) {
+    record_alloc(q, size, -1);   /* a block we never saw */
+  } else {
+    id = slot->id;
+    live_bytes -= slot->size;
+    remove_slot(slot);
+    if (split_reallocs) {
+      record_alloc(q, size, -1);
+      emit('f', id, 0);
+      free_ids[num_free_ids++] = id;
+    } else {
+      record_alloc(q, size, id);
+    }
+  }
+  pthread_mutex_unlock(&capture_lock);
+  busy--;
+  return q;
+}
+
+/*
+ * fork handlers: flush and hold the lock across fork; the child stops
+ *    recording, since its blocks are the parent's
+ */
+static void before_fork(void)
+{
+  pthread_mutex_lock(&capture_lock);
+  flush();
+}
+
+static void after_fork_parent(void)
+{
+  pthread_mutex_unlock(&capture_lock);
+}
+
+static void after_fork_child(void)
+{
+  if (capturing) {
+    capturing = 0;
+    close(fd);
+  }
+  pthread_mutex_unlock(&capture_lock);
+}
+
+/*
+ * start - runs when libmmcapture.so is loaded: opens the trace file and
+ *    sets up the tables, if MM_CAPTURE asks for a trace
+ */
+__attribute__((constructor))
+static void start(void)
+{
+  char *capture = getenv("MM_CAPTURE");
+  char path[4096];
+
+  if (real_malloc == NULL)
+    find_real();
+  if (capture == NULL)
+    return;
+  split_reallocs = getenv("MM_CAPTURE_SPLIT") != NULL;
+  busy++;
+  pthread_atfork(before_fork, after_fork_parent, after_fork_child);
+  snprintf(path, sizeof(path), "%s.%d", capture, (int)getpid());
+  num_slots = 1024;
+  max_ids = 1024;
+  if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+    perror(path);
+  } else if ((slots = map(num_slots * sizeof(slot_t))) == NULL ||
+             (free_ids = map(max_ids * sizeof(uint32_t))) == NULL) {
+    close(fd);
+  } else {
+    capturing = 1;
+    write_header(-1);            /* before any lines */
+  }
+  busy--;
+}
+
+__attribute__((destructor))
+static void finish(void)
+{
+  pthread_mutex_lock(&capture_lock);
+  flush();
+  pthread_mutex_unlock(&capture_lock);
+}
@@ -0,0 +1,311 @@
+/*
+ * mmpreload.c - the C library's malloc interface on top of mm.c, for
+ *    building libmm.so.  Running a program with
+ *
+ *        LD_PRELOAD=./libmm.so program ...
+ *
+ *    makes every allocation it (and libc on its behalf) does go to
+ *    mm_malloc and friends, so real programs can be measured instead
+ *    of traces.
+ *
+ *    Bootstrap: the heap is set up on the first call, whichever it is.
+ *    memlib gets its memory straight from mmap, and neither it nor
+ *    mm.c calls back into malloc, so this is safe even while libc and
+ *    the dynamic linker are still starting up.
+ *
+ *    Threads and fork: one lock serializes every call.  It is taken
+ *    around fork, so the child never inherits a heap in the middle of
+ *    an update, and released again on both sides.
+ *
+ *    Tracing: with MM_TRACE=<file> in the environment, every call is
+ *    recorded in <file>.<pid> (mm_trace_start), and tracedump turns
+ *    that into a trace for mdriver.  Each program the traced one runs
+ *    gets its own file.
+ *
+ *    Profiling: with MM_PROFILE=<file>, about one allocation per
+ *    MM_PROFILE_INTERVAL bytes (default 512K) is sampled, and at exit
+ *    the stacks of the sampled blocks still allocated are written to
+ *    <file>.<pid>.heap for pprof and <file>.<pid>.folded for
+ *    flamegraph.pl (mm_profile_dump).
+ *
+ *    Pointers that did not come from our heap (the dynamic linker
+ *    allocates a few before we are loaded) are never freed, and
+ *    realloc copies them into our heap.
+ *
+ *    Out of memory: requests the heap cannot hold return NULL with
+ *    errno set to ENOMEM, as glibc's do.
+ */
+#define _GNU_SOURCE   /* for process_vm_readv */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+/* Default bytes between heap profile samples */
+#define PROFILE_INTERVAL (512 * 1024)
+
+static char profile_path[4096];
+
+/* What glibc guarantees on 64-bit targets, and what compilers assume
+   of malloc'ed memory when they vectorize.  mm.c is built to align
+   every block this way (MM_ALIGNMENT), so only larger alignments need
+   mm_memalign. */
+#define MALLOC_ALIGN 16
+
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static int heap_ready = 0;
+
+/*
+ * lock - take the lock, setting up the heap on first use
+ */
+static void lock(void)
+{
+  pthread_mutex_lock(&heap_lock);
+  if (!heap_ready) {
+    mem_init();
+    mm_init();
+    heap_ready = 1;
+  }
+}
+
+static void unlock(void)
+{
+  pthread_mutex_unlock(&heap_lock);
+}
+
+/*
+ * ours - whether p points into our heap
+ */
+static int ours(void *p)
+{
+  return heap_ready && (char *)p >= (char *)mem_heap_lo() &&
+    (char *)p <= (char *)mem_heap_hi();
+}
+
+void *malloc(size_t size)
+{
+  void *p;
+
+  lock();
+  /* malloc(0) must return a pointer that can be freed */
+  p = mm_malloc(size ? size : 1);
+  unlock();
+  if (p == NULL)
+    errno = ENOMEM;
+  return p;
+}
+
+void free(void *p)
+{
+  lock();
+  if (ours(p))
+    mm_free(p);
+  unlock();
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+  void *p;
+
+  if (size != 0 && nmemb > SIZE_MAX / size) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  lock();
+  if (nmemb == 0 || size == 0)
+    p = mm_calloc(1, 1);
+  else
+    p = mm_calloc(nmemb, size);
+  unlock();
+  if (p == NULL)
+    errno = ENOMEM;
+  return p;
+}
+
+/*
+ * copy_foreign - copy up to size bytes of a block we did not allocate,
+ *    stopping where its memory stops being readable.  We do not know
+ *    how big the block is, and reading size bytes may run off the end
+ *    of its mapping; process_vm_readv reports a fault as a short copy
+ *    instead of taking it.  If that is not allowed, only the rest of
+ *    p's own page is known to be readable.
+ */
+static void copy_foreign(void *q, void *p, size_t size)
+{
+  struct iovec local = { q, size }, remote = { p, size };
+  size_t pagesize = mem_pagesize();
+  size_t in_page = pagesize - (uintptr_t)p % pagesize;
+
+  if (process_vm_readv(getpid(), &local, 1, &remote, 1, 0) < 0)
+    memcpy(q, p, size < in_page ? size : in_page);
+}
+
+void *realloc(void *p, size_t size)
+{
+  void *q;
+
+  if (p == NULL)
+    return malloc(size);
+  if (size == 0) {
+    free(p);
+    return NULL;
+  }
+  lock();
+  if (ours(p)) {
+    q = mm_realloc(p, size);
+  } else {
+    /* we cannot tell how big it is; the caller can only rely on the
+       smaller of the two sizes anyway */
+    q = mm_malloc(size);
+    if (q != NULL)
+      copy_foreign(q, p, size);
+  }
+  unlock();
+  if (q == NULL)
+    errno = ENOMEM;
+  return q;
+}
+
+void *reallocarray(void *p, size_t nmemb, size_t size)
+{
+  if (size != 0 && nmemb > SIZE_MAX / size) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return realloc(p, nmemb * size);
+}
+
+void *memalign(size_t align, size_t size)
+{
+  void *p;
+
+  if ((align & (align - 1)) != 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (align < MALLOC_ALIGN)
+    align = MALLOC_ALIGN;
+  lock();
+  p = mm_memalign(align, size ? size : 1);
+  unlock();
+  if (p == NULL)
+    errno = ENOMEM;
+  return p;
+}
+
+int posix_memalign(void **result, size_t align, size_t size)
+{
+  void *p;
+
+  if (align % sizeof(void *) != 0 || (align & (align - 1)) != 0)
+    return EINVAL;
+  if ((p = memalign(align, size)) == NULL)
+    return ENOMEM;
+  *result = p;
+  return 0;
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+  return memalign(align, size);
+}
+
+void *valloc(size_t size)
+{
+  return memalign(mem_pagesize(), size);
+}
+
+void *pvalloc(size_t size)
+{
+  size_t pagesize = mem_pagesize();
+
+  return memalign(pagesize, (size + pagesize - 1) & ~(pagesize - 1));
+}
+
+size_t malloc_usable_size(void *p)
+{
+  size_t size = 0;
+
+  lock();
+  if (ours(p))
+    size = mm_usable_size(p);
+  unlock();
+  return size;
+}
+
+/*
+ * fork handlers: hold the lock across fork in the parent, and release
+ *    it on both sides afterwards
+ */
+static void before_fork(void)
+{
+  lock();
+}
+
+static void after_fork(void)
+{
+  unlock();
+}
+
+/*
+ * start - runs when libmm.so is loaded: registers the fork handlers
+ *    and starts tracing if asked to.  This is not done in lock(), since
+ *    pthread_atfork may itself call malloc.
+ */
+__attribute__((constructor))
+static void start(void)
+{
+  char *trace = getenv("MM_TRACE");
+  char *profile = getenv("MM_PROFILE");
+  char *interval = getenv("MM_PROFILE_INTERVAL");
+  char path[4096];
+
+  pthread_atfork(before_fork, after_fork, after_fork);
+  if (trace != NULL) {
+    snprintf(path, sizeof(path), "%s.%d", trace, (int)getpid());
+    if (mm_trace_start(path) < 0)
+      perror(path);
+  }
+  if (profile != NULL) {
+    snprintf(profile_path, sizeof(profile_path), "%s.%d", profile,
+             (int)getpid());
+    mm_profile_start(interval != NULL ? strtoul(interval, NULL, 0) :
+                     PROFILE_INTERVAL);
+  }
+}
+
+/*
+ * write_profile - at exit, write the heap profile in both formats
+ */
+static void write_profile(const char *suffix, int format)
+{
+  char path[4096 + 16];
+  int fd;
+
+  snprintf(path, sizeof(path), "%s%s", profile_path, suffix);
+  if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+    perror(path);
+    return;
+  }
+  mm_profile_dump(fd, format);
+  close(fd);
+}
+
+__attribute__((destructor))
+static void finish(void)
+{
+  if (profile_path[0] != '\0') {
+    lock();
+    write_profile(".heap", MM_PROFILE_PPROF);
+    write_profile(".folded", MM_PROFILE_FOLDED);
+    unlock();
+  }
+}
@@ -0,0 +1,57 @@
+/*
+ * mmtrace.h - Layout of the event trace file that mm.c writes while
+ *     tracing is on (mm_trace_start), and that tracedump turns into a
+ *     trace for mdriver.
+ *
+ * The file is a header followed by one ring of records per thread.
+ * Each thread only ever writes its own ring, so no locks are needed:
+ * a record is filled in and then published by bumping the ring's
+ * head.  Records are numbered from a counter in the header rather
+ * than timestamped: that costs less than reading a clock, and since
+ * mm.c numbers them under the heap lock, it orders the events on each
+ * block exactly.  The file is mapped shared, so the records are in it
+ * as soon as they are written, even if the process crashes right
+ * after.
+ */
+#include <stdint.h>
+
+#define MM_TRACE_MAGIC 0x6d6d747261636502UL
+#define MM_TRACE_RINGS 64          /* threads that can be traced */
+#define MM_TRACE_RECORDS 65536     /* latest records kept per thread */
+
+/* Events */
+#define MM_TRACE_INIT 0            /* mm_init: a new, empty heap */
+#define MM_TRACE_MALLOC 1
+#define MM_TRACE_CALLOC 2          /* size is nmemb * size */
+#define MM_TRACE_MEMALIGN 3
+#define MM_TRACE_REALLOC 4
+#define MM_TRACE_FREE 5
+#define MM_TRACE_SBRK 6            /* size is the increment */
+
+typedef struct {
+  uint64_t seq;                  /* order among all threads' events */
+  uint64_t size_and_op;          /* size << 8 | event */
+  uint64_t address;              /* block returned or freed, or the
+                                    start of the new sbrk space */
+  uint64_t previous;             /* realloc: the old block;
+                                    memalign: the alignment */
+  uint64_t caller;               /* return address of the call */
+} mm_trace_record_t;
+
+typedef struct {
+  uint64_t head;                 /* records ever written; record i is
+                                    in records[i % MM_TRACE_RECORDS] */
+  uint64_t tid;                  /* thread id of the writer */
+  mm_trace_record_t records[MM_TRACE_RECORDS];
+} mm_trace_ring_t;
+
+typedef struct {
+  uint64_t magic;
+  uint64_t events;               /* events recorded, numbering them */
+  uint64_t rings;                /* rings handed out to threads (may
+                                    exceed MM_TRACE_RINGS) */
+  mm_trace_ring_t ring[MM_TRACE_RINGS];
+} mm_trace_file_t;
+
+#define MM_TRACE_OP(record) ((int)((record)->size_and_op & 0xff))
+#define MM_TRACE_SIZE(record) ((record)->size_and_op >> 8)
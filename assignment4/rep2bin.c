@@ -0,0 +1,232 @@
+/*
+ * rep2bin.c - Converts a trace between the text format mdriver has
+ *     always read and the binary format of bintrace.h, which mdriver
+ *     replays straight from the file.  Neither trace is held in memory,
+ *     so traces of any length can be converted.
+ *
+ * The text trace may have the thread column of -T traces.  Realloc
+ * ("r") lines are not part of the binary format; tracedump -a writes
+ * them as an allocation and a free.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "bintrace.h"
+
+#define MAXLINE 1024
+
+static void usage(void);
+
+/* The binary trace being written, removed if the conversion fails so
+   that mdriver never maps a half-written one */
+static char *out_file = NULL;
+
+/*
+ * give_up - remove the partial output, if any, and exit
+ */
+static void give_up(void)
+{
+    if (out_file != NULL)
+	unlink(out_file);
+    exit(1);
+}
+
+/*
+ * fail - report a bad input line and give up
+ */
+static void fail(char *path, unsigned long line, char *why)
+{
+    fprintf(stderr, "rep2bin: %s, line %lu: %s\n", path, line, why);
+    give_up();
+}
+
+/*
+ * to_binary - write the text trace in to the binary trace out
+ */
+static void to_binary(char *in_path, FILE *in, char *out_path, FILE *out)
+{
+    bintrace_header_t header;
+    bintrace_record_t r;
+    char line[MAXLINE], type[MAXLINE], *p;
+    unsigned long heap, ids, ops, weight, id, size, align;
+    unsigned long n = 0, lineno = 4;
+    int thread, fields, skip;
+
+    if (fscanf(in, "%lu %lu %lu %lu", &heap, &ids, &ops, &weight) != 4)
+	fail(in_path, 1, "bad header");
+    fgets(line, MAXLINE, in);
+
+    memset(&header, 0, sizeof(header));
+    header.magic = BINTRACE_MAGIC;
+    header.heap_size = heap;
+    header.num_ids = ids;
+    header.num_ops = ops;
+    header.weight = weight;
+    header.num_threads = 1;
+    if (fwrite(&header, sizeof(header), 1, out) != 1) {
+	perror(out_path);
+	give_up();
+    }
+
+    while (fgets(line, MAXLINE, in) != NULL) {
+	lineno++;
+	/* a request may start with the id of the thread that makes it */
+	thread = 0;
+	p = line;
+	if (sscanf(line, "%d%n", &thread, &skip) == 1)
+	    p += skip;
+	memset(&r, 0, sizeof(r));
+	size = align = 0;
+	fields = sscanf(p, "%s %lu %lu %lu", type, &id, &size, &align);
+	if (fields < 1)
+	    continue;
+	if (strlen(type) != 1 || fields < 2)
+	    fail(in_path, lineno, "bad request");
+	switch (type[0]) {
+	case 'a':
+	    r.op = BINTRACE_ALLOC;
+	    break;
+	case 'c':
+	    r.op = BINTRACE_CALLOC;
+	    header.flags |= BINTRACE_HAS_CALLOC;
+	    break;
+	case 'm':
+	    if (fields < 4 || align == 0 || (align & (align - 1)) != 0)
+		fail(in_path, lineno, "alignment is not a power of two");
+	    r.op = BINTRACE_MEMALIGN;
+	    while (((unsigned long)1 << r.align_shift) < align)
+		r.align_shift++;
+	    break;
+	case 'f':
+	    r.op = BINTRACE_FREE;
+	    size = 0;
+	    break;
+	case 'r':
+	    fail(in_path, lineno, "reallocs have no binary form (see tracedump -a)");
+	default:
+	    fail(in_path, lineno, "unknown request type");
+	}
+	if (r.op != BINTRACE_FREE && fields < 3)
+	    fail(in_path, lineno, "no size");
+	if (id >= ids)
+	    fail(in_path, lineno, "block id out of range");
+	if (thread < 0 || thread > 0xffff)
+	    fail(in_path, lineno, "thread out of range");
+	r.size = size;
+	r.id = id;
+	r.thread = thread;
+	if ((uint64_t)thread + 1 > header.num_threads)
+	    header.num_threads = thread + 1;
+	if (fwrite(&r, sizeof(r), 1, out) != 1) {
+	    perror(out_path);
+	    give_up();
+	}
+	n++;
+    }
+    if (n != ops)
+	fail(in_path, lineno, "request count does not match the header");
+
+    /* the thread count and flags are only known now */
+    if (fseek(out, 0, SEEK_SET) < 0 ||
+	fwrite(&header, sizeof(header), 1, out) != 1 || fflush(out) != 0) {
+	perror(out_path);
+	give_up();
+    }
+}
+
+/*
+ * to_text - write the binary trace in as a text trace to out
+ */
+static void to_text(char *in_path, FILE *in, FILE *out)
+{
+    static char types[] = { 'a', 'f', 'm', 'c' };
+    bintrace_header_t header;
+    bintrace_record_t r;
+    uint64_t i;
+
+    if (fread(&header, sizeof(header), 1, in) != 1 ||
+	header.magic != BINTRACE_MAGIC) {
+	fprintf(stderr, "rep2bin: %s: not a binary trace\n", in_path);
+	exit(1);
+    }
+    fprintf(out, "%lu\n%lu\n%lu\n%lu\n", (unsigned long)header.heap_size,
+	    (unsigned long)header.num_ids, (unsigned long)header.num_ops,
+	    (unsigned long)header.weight);
+    for (i = 0; i < header.num_ops; i++) {
+	if (fread(&r, sizeof(r), 1, in) != 1 || r.op > BINTRACE_CALLOC) {
+	    fprintf(stderr, "rep2bin: %s: bad or missing request %lu\n",
+		    in_path, (unsigned long)i);
+	    exit(1);
+	}
+	if (header.num_threads > 1)
+	    fprintf(out, "%u ", r.thread);
+	if (r.op == BINTRACE_FREE)
+	    fprintf(out, "f %u\n", r.id);
+	else if (r.op == BINTRACE_MEMALIGN)
+	    fprintf(out, "m %u %lu %lu\n", r.id, (unsigned long)r.size,
+		    1UL << r.align_shift);
+	else
+	    fprintf(out, "%c %u %lu\n", types[r.op], r.id,
+		    (unsigned long)r.size);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    FILE *in, *out;
+    int c, dump = 0;
+
+    while ((c = getopt(argc, argv, "dh")) != EOF) {
+	switch (c) {
+	case 'd':
+	    dump = 1;
+	    break;
+	case 'h':
+	    usage();
+	    exit(0);
+	default:
+	    usage();
+	    exit(1);
+	}
+    }
+    if (optind != argc - 2 + dump) {
+	usage();
+	exit(1);
+    }
+
+    if ((in = fopen(argv[optind], "r")) == NULL) {
+	perror(argv[optind]);
+	exit(1);
+    }
+    if (dump) {
+	to_text(argv[optind], in, stdout);
+	exit(0);
+    }
+    if ((out = fopen(argv[optind + 1], "w")) == NULL) {
+	perror(argv[optind + 1]);
+	exit(1);
+    }
+    out_file = argv[optind + 1];
+    to_binary(argv[optind], in, argv[optind + 1], out);
+    if (fclose(out) != 0) {
+	perror(argv[optind + 1]);
+	give_up();
+    }
+    exit(0);
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: rep2bin [-h] <trace.rep> <trace.bin>\n");
+    fprintf(stderr, "       rep2bin -d <trace.bin>\n");
+    fprintf(stderr, "Writes a text trace as a binary one for mdriver, "
+	    "or with -d the other way.\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-d         Write a binary trace as text, to stdout.\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+}
@@ -0,0 +1,335 @@
+/*
+ * shmbench.c - Stress test for a heap shared between processes
+ *     (mm_open_shared in mm.c).
+ *
+ * The parent creates the heap, with a mailbox per worker as its root,
+ * and starts the workers as fresh processes (so each maps the heap at
+ * an address of its own, as unrelated processes would).  Each one
+ * loops: it either allocates a block, stamps it, and posts its offset
+ * to a random worker's mailbox, or takes an offset from its own
+ * mailbox, checks the stamp, and frees the block.
+ * So most blocks are freed by a different process, at a different
+ * address, than the one that allocated them.  With -k one worker is
+ * killed part way through, which the robust heap lock must survive.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define MAX_PROCS 64
+#define MAILBOX_SLOTS 256
+
+/* offsets posted to one worker, a ring guarded by its own lock */
+typedef struct {
+    pthread_mutex_t lock;
+    size_t head, tail;
+    size_t slots[MAILBOX_SLOTS];
+} mailbox_t;
+
+/* the root of the shared heap */
+typedef struct {
+    int go;                      /* set when every worker may start */
+    size_t ops[MAX_PROCS];       /* operations done by each worker */
+    size_t bad[MAX_PROCS];       /* blocks with a wrong stamp */
+    mailbox_t boxes[MAX_PROCS];
+} board_t;
+
+/* the start of every block */
+typedef struct {
+    size_t size;                 /* payload bytes */
+    size_t stamp;                /* repeated (as a byte) over the rest */
+} block_t;
+
+/* Parameters (set by the command line) */
+static int procs = 4;            /* worker processes */
+static int ops = 100000;         /* operations per worker */
+static size_t max_size = 512;    /* largest payload */
+static int kill_one = 0;         /* kill a worker part way through */
+static int verbose = 0;
+static int worker_id = -1;       /* -W: run as this worker */
+
+static char name[64];
+static board_t *board;
+
+static pid_t start_worker(int id);
+static void usage(void);
+
+/*
+ * now - current time in seconds
+ */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * lock_box - take a mailbox lock, taking over from a killed owner
+ */
+static void lock_box(mailbox_t *box)
+{
+    if (pthread_mutex_lock(&box->lock) == EOWNERDEAD)
+	pthread_mutex_consistent(&box->lock);
+}
+
+/*
+ * post - add offset to box; returns 0 if the box is full
+ */
+static int post(mailbox_t *box, size_t offset)
+{
+    int posted = 0;
+
+    lock_box(box);
+    if (box->tail - box->head < MAILBOX_SLOTS) {
+	box->slots[box->tail++ % MAILBOX_SLOTS] = offset;
+	posted = 1;
+    }
+    pthread_mutex_unlock(&box->lock);
+    return posted;
+}
+
+/*
+ * take - remove the oldest offset from box into *offset; returns 0 if
+ *     the box is empty
+ */
+static int take(mailbox_t *box, size_t *offset)
+{
+    int taken = 0;
+
+    lock_box(box);
+    if (box->head != box->tail) {
+	*offset = box->slots[box->head++ % MAILBOX_SLOTS];
+	taken = 1;
+    }
+    pthread_mutex_unlock(&box->lock);
+    return taken;
+}
+
+/*
+ * stamp_block - fill a new block with its size and stamp
+ */
+static void stamp_block(block_t *block, size_t size, size_t stamp)
+{
+    block->size = size;
+    block->stamp = stamp;
+    memset(block + 1, (int)(stamp & 0xff), size - sizeof(block_t));
+}
+
+/*
+ * check_block - return whether a block still holds its stamp
+ */
+static int check_block(block_t *block)
+{
+    unsigned char *p = (unsigned char *)(block + 1);
+    size_t i;
+
+    for (i = 0; i < block->size - sizeof(block_t); i++)
+	if (p[i] != (block->stamp & 0xff))
+	    return 0;
+    return 1;
+}
+
+/*
+ * free_block - check a block posted by some worker and free it
+ */
+static void free_block(int id, size_t offset)
+{
+    block_t *block = mm_pointer(offset);
+
+    if (!check_block(block))
+	board->bad[id]++;
+    mm_free(block);
+}
+
+/*
+ * worker - attach to the heap and run the operations of worker id
+ */
+static void worker(int id)
+{
+    unsigned int seed = id + 1;
+    size_t offset, size;
+    block_t *block;
+    int i;
+
+    if (mm_open_shared(name) < 0)
+	exit(1);
+    board = mm_get_root();
+    if (verbose)
+	printf("worker %d: heap at %p\n", id, mem_heap_lo());
+
+    while (!__atomic_load_n(&board->go, __ATOMIC_ACQUIRE))
+	sched_yield();
+
+    for (i = 0; i < ops; i++) {
+	if (rand_r(&seed) % 2) {
+	    size = sizeof(block_t) + rand_r(&seed) % max_size + 1;
+	    if ((block = mm_malloc(size)) == NULL) {
+		fprintf(stderr, "worker %d: mm_malloc(%zu) failed\n", id, size);
+		exit(1);
+	    }
+	    stamp_block(block, size, ((size_t)id << 32) | i);
+	    if (!post(&board->boxes[rand_r(&seed) % procs], mm_offset(block)))
+		free_block(id, mm_offset(block));
+	} else if (take(&board->boxes[id], &offset)) {
+	    free_block(id, offset);
+	}
+	board->ops[id]++;
+    }
+    mm_close_shared();
+    exit(0);
+}
+
+int main(int argc, char **argv)
+{
+    pthread_mutexattr_t attr;
+    pid_t pids[MAX_PROCS];
+    size_t offset, total_ops = 0, total_bad = 0;
+    double start, secs;
+    int c, i, status, failed = 0;
+
+    while ((c = getopt(argc, argv, "p:n:s:kvhW:N:")) != EOF) {
+	switch (c) {
+	case 'p':
+	    procs = atoi(optarg);
+	    break;
+	case 'n':
+	    ops = atoi(optarg);
+	    break;
+	case 's':
+	    max_size = strtoul(optarg, NULL, 0);
+	    break;
+	case 'k':
+	    kill_one = 1;
+	    break;
+	case 'v':
+	    verbose = 1;
+	    break;
+	case 'W':                /* internal: see start_worker */
+	    worker_id = atoi(optarg);
+	    break;
+	case 'N':
+	    snprintf(name, sizeof(name), "%s", optarg);
+	    break;
+	case 'h':
+	    usage();
+	    exit(0);
+	default:
+	    usage();
+	    exit(1);
+	}
+    }
+    if (procs < 1 || procs > MAX_PROCS || ops < 1 || max_size < 1) {
+	usage();
+	exit(1);
+    }
+
+    if (worker_id >= 0)
+	worker(worker_id);
+
+    sprintf(name, "/shmbench.%d", (int)getpid());
+    if (mm_open_shared(name) < 0)
+	exit(1);
+    board = mm_calloc(1, sizeof(board_t));
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    for (i = 0; i < procs; i++)
+	pthread_mutex_init(&board->boxes[i].lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    mm_set_root(board);
+    if (verbose)
+	printf("parent:   heap at %p\n", mem_heap_lo());
+    fflush(stdout);
+
+    for (i = 0; i < procs; i++) {
+	if ((pids[i] = start_worker(i)) < 0) {
+	    perror("fork");
+	    exit(1);
+	}
+    }
+
+    start = now();
+    __atomic_store_n(&board->go, 1, __ATOMIC_RELEASE);
+    if (kill_one) {
+	while (__atomic_load_n(&board->ops[0], __ATOMIC_RELAXED) < (size_t)ops / 2)
+	    sched_yield();
+	kill(pids[0], SIGKILL);
+    }
+    for (i = 0; i < procs; i++) {
+	waitpid(pids[i], &status, 0);
+	if (!(kill_one && i == 0) &&
+	    !(WIFEXITED(status) && WEXITSTATUS(status) == 0))
+	    failed++;
+    }
+    secs = now() - start;
+
+    /* free whatever is still posted */
+    for (i = 0; i < procs; i++)
+	while (take(&board->boxes[i], &offset))
+	    free_block(i, offset);
+    for (i = 0; i < procs; i++) {
+	total_ops += board->ops[i];
+	total_bad += board->bad[i];
+    }
+
+    printf("%d processes, %lu ops, max payload %lu%s\n", procs,
+	   (unsigned long)total_ops, (unsigned long)max_size,
+	   kill_one ? ", worker 0 killed" : "");
+    printf("%10s%10s%10s%8s%10s\n", "secs", "Kops", "heap", "bad", "failed");
+    printf("%10.4f%10.0f%10lu%8lu%10d\n", secs, total_ops / secs / 1e3,
+	   (unsigned long)mem_heapsize(), (unsigned long)total_bad, failed);
+
+    mm_close_shared();
+    shm_unlink(name);
+    exit(total_bad == 0 && failed == 0 ? 0 : 1);
+}
+
+/*
+ * start_worker - run worker id in a new process, passing on the
+ *     parameters
+ */
+static pid_t start_worker(int id)
+{
+    char args[5][32];
+    pid_t pid = fork();
+
+    if (pid != 0)
+	return pid;
+    sprintf(args[0], "%d", procs);
+    sprintf(args[1], "%d", ops);
+    sprintf(args[2], "%lu", (unsigned long)max_size);
+    sprintf(args[3], "%d", id);
+    execl("/proc/self/exe", "shmbench", "-p", args[0], "-n", args[1],
+	  "-s", args[2], "-W", args[3], "-N", name, verbose ? "-v" : NULL,
+	  (char *)NULL);
+    perror("exec");
+    exit(1);
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: shmbench [-hkv] [-p <procs>] [-n <ops>] "
+	    "[-s <bytes>]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-k         Kill one worker half way through.\n");
+    fprintf(stderr, "\t-v         Print where each process maps the heap.\n");
+    fprintf(stderr, "\t-p <procs> Worker processes (default 4).\n");
+    fprintf(stderr, "\t-n <ops>   Operations per worker (default 100000).\n");
+    fprintf(stderr, "\t-s <bytes> Largest payload (default 512).\n");
+}
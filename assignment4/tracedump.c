@@ -0,0 +1,274 @@
+/*
+ * tracedump.c - Turns an allocator event trace, the file mm.c writes
+ *     after mm_trace_start (see mmtrace.h), into a trace file that
+ *     mdriver can replay.  The process that wrote it may still be
+ *     running, or may have crashed.
+ *
+ * The rings of all threads are merged in order.  The output starts
+ * after the last mm_init, and no earlier than the oldest record left
+ * in any ring that has wrapped (before that, only some threads' events
+ * are known).  Every allocation gets
+ * a new block id.  Frees of blocks allocated before that point are
+ * dropped, reallocs of them become allocations, and blocks still live
+ * at the end stay allocated.  Reallocs come out as "r" lines, which
+ * mdriver-realloc replays; -a turns them into an allocation and a free
+ * for mdriver.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mmtrace.h"
+
+/* a line of the output trace */
+typedef struct {
+    char type;                   /* 'a', 'c', 'm', 'r' or 'f' */
+    unsigned id;
+    unsigned long size;
+    unsigned long align;
+} op_t;
+
+/* live blocks: an open-addressed table from address to block id */
+typedef struct {
+    uint64_t address;            /* 0 if empty, DELETED if freed */
+    unsigned id;
+} slot_t;
+#define DELETED 1                /* never a block address */
+
+static slot_t *slots;
+static size_t num_slots;         /* a power of two */
+
+static op_t *ops;
+static size_t num_ops;
+static unsigned num_ids;
+
+static int split_reallocs = 0;   /* -a: realloc as alloc and free */
+
+static void usage(void);
+
+/*
+ * by_seq - qsort comparison of two records by their order
+ */
+static int by_seq(const void *a, const void *b)
+{
+    const mm_trace_record_t *x = a, *y = b;
+
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/*
+ * find - the slot holding address, or the empty slot where it would go
+ */
+static slot_t *find(uint64_t address)
+{
+    size_t i = (address >> 4) * 0x9e3779b97f4a7c15UL;
+
+    for (i &= num_slots - 1; slots[i].address != 0; i = (i + 1) & (num_slots - 1))
+	if (slots[i].address == address)
+	    return &slots[i];
+    return &slots[i];
+}
+
+/*
+ * add_op - append a line to the output trace
+ */
+static void add_op(char type, unsigned id, unsigned long size,
+		   unsigned long align)
+{
+    ops[num_ops].type = type;
+    ops[num_ops].id = id;
+    ops[num_ops].size = size;
+    ops[num_ops].align = align;
+    num_ops++;
+}
+
+/*
+ * allocate - record a new block at address, freeing a block the trace
+ *     still thought was there (its free was lost)
+ */
+static void allocate(char type, uint64_t address, unsigned long size,
+		     unsigned long align)
+{
+    slot_t *slot = find(address);
+
+    if (slot->address == address)
+	add_op('f', slot->id, 0, 0);
+    slot->address = address;
+    slot->id = num_ids++;
+    add_op(type, slot->id, size, align);
+}
+
+/*
+ * replay - turn the events in order into trace lines
+ */
+static void replay(mm_trace_record_t *events, size_t n)
+{
+    mm_trace_record_t *e;
+    slot_t *slot;
+    unsigned id;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+	e = &events[i];
+	switch (MM_TRACE_OP(e)) {
+	case MM_TRACE_MALLOC:
+	    allocate('a', e->address, MM_TRACE_SIZE(e), 0);
+	    break;
+	case MM_TRACE_CALLOC:
+	    allocate('c', e->address, MM_TRACE_SIZE(e), 0);
+	    break;
+	case MM_TRACE_MEMALIGN:
+	    allocate('m', e->address, MM_TRACE_SIZE(e), e->previous);
+	    break;
+	case MM_TRACE_REALLOC:
+	    slot = find(e->previous);
+	    if (slot->address != e->previous) {
+		allocate('a', e->address, MM_TRACE_SIZE(e), 0);
+		break;
+	    }
+	    id = slot->id;
+	    slot->address = DELETED;
+	    if (split_reallocs) {
+		allocate('a', e->address, MM_TRACE_SIZE(e), 0);
+		add_op('f', id, 0, 0);
+	    } else {
+		slot = find(e->address);
+		if (slot->address == e->address)
+		    add_op('f', slot->id, 0, 0);
+		slot->address = e->address;
+		slot->id = id;
+		add_op('r', id, MM_TRACE_SIZE(e), 0);
+	    }
+	    break;
+	case MM_TRACE_FREE:
+	    slot = find(e->address);
+	    if (slot->address == e->address) {
+		add_op('f', slot->id, 0, 0);
+		slot->address = DELETED;
+	    }
+	    break;
+	}
+    }
+}
+
+int main(int argc, char **argv)
+{
+    mm_trace_file_t *file;
+    mm_trace_ring_t *ring;
+    mm_trace_record_t *events;
+    struct stat st;
+    uint64_t head, kept, start = 0;
+    size_t n = 0, first = 0, i, k;
+    unsigned long heap = 0;
+    int c, fd, rings, r;
+
+    while ((c = getopt(argc, argv, "ah")) != EOF) {
+	switch (c) {
+	case 'a':
+	    split_reallocs = 1;
+	    break;
+	case 'h':
+	    usage();
+	    exit(0);
+	default:
+	    usage();
+	    exit(1);
+	}
+    }
+    if (optind != argc - 1) {
+	usage();
+	exit(1);
+    }
+
+    if ((fd = open(argv[optind], O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+	perror(argv[optind]);
+	exit(1);
+    }
+    if ((size_t)st.st_size < sizeof(mm_trace_file_t) ||
+	(file = mmap(NULL, sizeof(mm_trace_file_t), PROT_READ, MAP_SHARED,
+		     fd, 0)) == MAP_FAILED ||
+	file->magic != MM_TRACE_MAGIC) {
+	fprintf(stderr, "%s: not an allocator trace\n", argv[optind]);
+	exit(1);
+    }
+    rings = file->rings < MM_TRACE_RINGS ? file->rings : MM_TRACE_RINGS;
+    if (file->rings > MM_TRACE_RINGS)
+	fprintf(stderr, "tracedump: %lu threads were not traced\n",
+		(unsigned long)(file->rings - MM_TRACE_RINGS));
+
+    /* Copy out the kept records of every ring (the writer may still be
+       adding to them), and note where the newest wrapped ring starts */
+    if ((events = malloc((size_t)rings * MM_TRACE_RECORDS *
+			 sizeof(mm_trace_record_t))) == NULL) {
+	perror("malloc");
+	exit(1);
+    }
+    for (r = 0; r < rings; r++) {
+	ring = &file->ring[r];
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	kept = head < MM_TRACE_RECORDS ? head : MM_TRACE_RECORDS;
+	for (k = head - kept; k < head; k++)
+	    events[n++] = ring->records[k % MM_TRACE_RECORDS];
+	if (head > MM_TRACE_RECORDS && events[n - kept].seq > start)
+	    start = events[n - kept].seq;
+    }
+    qsort(events, n, sizeof(mm_trace_record_t), by_seq);
+
+    /* Start at whichever is later: the newest wrapped ring or the
+       last mm_init */
+    while (first < n && events[first].seq < start)
+	first++;
+    for (i = first; i < n; i++)
+	if (MM_TRACE_OP(&events[i]) == MM_TRACE_INIT)
+	    first = i + 1;
+    for (i = first; i < n; i++)
+	if (MM_TRACE_OP(&events[i]) == MM_TRACE_SBRK)
+	    heap += MM_TRACE_SIZE(&events[i]);
+
+    /* every event makes at most two lines, and adds at most one block */
+    for (num_slots = 1; num_slots < 2 * (n - first) + 2; num_slots *= 2)
+	;
+    slots = calloc(num_slots, sizeof(slot_t));
+    ops = malloc(2 * (n - first + 1) * sizeof(op_t));
+    if (slots == NULL || ops == NULL) {
+	perror("malloc");
+	exit(1);
+    }
+    replay(events + first, n - first);
+
+    printf("%lu\n%u\n%lu\n1\n", heap, num_ids, (unsigned long)num_ops);
+    for (i = 0; i < num_ops; i++) {
+	switch (ops[i].type) {
+	case 'f':
+	    printf("f %u\n", ops[i].id);
+	    break;
+	case 'm':
+	    printf("m %u %lu %lu\n", ops[i].id, ops[i].size, ops[i].align);
+	    break;
+	default:
+	    printf("%c %u %lu\n", ops[i].type, ops[i].id, ops[i].size);
+	    break;
+	}
+    }
+    fprintf(stderr, "tracedump: %d threads, %lu events, %u blocks, "
+	    "%lu trace lines\n", rings, (unsigned long)(n - first), num_ids,
+	    (unsigned long)num_ops);
+    exit(0);
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: tracedump [-ah] <trace file>\n");
+    fprintf(stderr, "Writes the events in a file from mm_trace_start "
+	    "as an mdriver trace.\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-a         Write reallocs as an allocation and a free.\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+}
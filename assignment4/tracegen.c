@@ -0,0 +1,559 @@
+/*
+ * tracegen.c - Writes a synthetic trace for mdriver from a model of
+ *     the program that would make it: how big its blocks are, how long
+ *     they live, how many grow by realloc, and how much it keeps
+ *     allocated at once.  The trace goes out as it is made, and only
+ *     the live blocks are kept, so traces of hundreds of millions of
+ *     requests take no more memory than short ones.
+ *
+ * Time is counted in requests.  Each block gets a size and a lifetime
+ * when it is allocated, and is freed when its lifetime is up, or
+ * earlier if the live bytes have reached the target (-H): then the
+ * block due soonest goes first.  A block that grows (-r) is realloced
+ * to a larger size at even intervals over its life.  Each -s starts a
+ * new phase, with its own size distribution and (with a -l after it)
+ * lifetimes; the requests are split evenly among the phases, and
+ * blocks from one phase live on into the next.  Ids of freed blocks
+ * are handed out again, so the trace needs only as many ids as blocks
+ * are ever live at once.  The blocks still live at the end are freed,
+ * so the traces are balanced like the ones in traces/.
+ *
+ * Distributions (sizes in bytes, lifetimes in requests):
+ *
+ *     uniform:<min>:<max>
+ *     lognormal:<median>:<sigma>    the log is normal
+ *     bimodal:<a>:<b>:<p>           <b> with probability <p>, else <a>
+ *     exp:<mean>                    exponential
+ *     pareto:<min>:<alpha>          heavy tailed, as real lifetimes are
+ *     fit:<trace.rep>               as in a text trace
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "bintrace.h"
+
+#define MAXLINE 1024
+#define MAX_PHASES 16
+#define MAX_SIZE ((double)(1UL << 40))  /* larger sizes are cut to this */
+#define REALLOC 4                /* a request text traces have, after
+				    the BINTRACE_ ones */
+
+/* a distribution, as given on the command line */
+typedef struct {
+    enum {UNIFORM, LOGNORMAL, BIMODAL, EXP, PARETO, FITTED} kind;
+    double a, b, p;
+    double *table;               /* FITTED: the values seen ... */
+    size_t n;                    /* ... and how many */
+} dist_t;
+
+typedef struct {
+    dist_t size;
+    dist_t life;
+} phase_t;
+
+/* a live block */
+typedef struct {
+    uint64_t size;
+    uint64_t death;              /* request at which it is freed */
+    uint64_t interval;           /* requests between reallocs */
+    unsigned steps;              /* reallocs still to come */
+} block_t;
+
+/* the next event of a live block, in a heap ordered by time */
+typedef struct {
+    uint64_t time;
+    uint32_t id;
+} event_t;
+
+/* Parameters (set by the command line) */
+static phase_t phases[MAX_PHASES];
+static int num_phases = 0;
+static uint64_t num_requests = 100000; /* -n: before the final frees */
+static uint64_t target = 0;      /* -H: live bytes to keep to, or 0 */
+static double grow_p = 0;        /* -r: fraction of blocks that grow ... */
+static double grow_factor = 2;   /* ... by this factor ... */
+static unsigned grow_steps = 4;  /* ... this many times */
+static int binary = 0;           /* -b: write a binary trace */
+static int split_reallocs = 0;   /* -a: realloc as alloc and free */
+static uint64_t seed = 1;
+
+static block_t *blocks;          /* by id */
+static uint32_t *free_ids;       /* ids to hand out again */
+static size_t num_free_ids;
+static uint32_t num_ids;         /* ids handed out so far */
+static size_t max_ids;           /* room in blocks and free_ids */
+static event_t *events;
+static size_t num_events;
+
+/* What has been written */
+static FILE *out;
+static char *out_path;
+static uint64_t num_ops, live, peak, num_reallocs;
+
+static void usage(void);
+
+/*
+ * random64 - xorshift64*: fast, and the same trace for the same seed
+ *     on every machine
+ */
+static uint64_t random64(void)
+{
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+    return seed * 0x2545f4914f6cdd1dUL;
+}
+
+/* uniform in [0, 1) */
+static double random01(void)
+{
+    return (random64() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* standard normal, by Box-Muller */
+static double random_normal(void)
+{
+    return sqrt(-2 * log(1 - random01())) * cos(2 * M_PI * random01());
+}
+
+/*
+ * sample - draw from a distribution
+ */
+static double sample(dist_t *d)
+{
+    switch (d->kind) {
+    case UNIFORM:
+	return d->a + floor(random01() * (d->b - d->a + 1));
+    case LOGNORMAL:
+	return exp(log(d->a) + d->b * random_normal());
+    case BIMODAL:
+	return random01() < d->p ? d->b : d->a;
+    case EXP:
+	return -d->a * log(1 - random01());
+    case PARETO:
+	return d->a / pow(1 - random01(), 1 / d->b);
+    case FITTED:
+	return d->table[random64() % d->n];
+    }
+    return 0;
+}
+
+/*
+ * append - add a value to a fitted distribution's table
+ */
+static void append(dist_t *d, double value, size_t *room)
+{
+    if (d->n == *room) {
+	*room = *room ? 2 * *room : 1024;
+	if ((d->table = realloc(d->table, *room * sizeof(double))) == NULL) {
+	    perror("realloc");
+	    exit(1);
+	}
+    }
+    d->table[d->n++] = value;
+}
+
+/*
+ * fit - fill d with the sizes (or, with lifetimes set, the lifetimes in
+ *     requests) of the blocks a text trace allocates
+ */
+static void fit(dist_t *d, char *path, int lifetimes)
+{
+    char line[MAXLINE], type[MAXLINE], *p;
+    unsigned long heap, ids, ops, weight, id, size;
+    unsigned long *born = NULL, i = 0;
+    size_t room = 0;
+    int thread, skip;
+    FILE *f;
+
+    if ((f = fopen(path, "r")) == NULL) {
+	perror(path);
+	exit(1);
+    }
+    if (fscanf(f, "%lu %lu %lu %lu", &heap, &ids, &ops, &weight) != 4 ||
+	(born = calloc(ids + 1, sizeof(unsigned long))) == NULL) {
+	fprintf(stderr, "tracegen: %s: not a text trace\n", path);
+	exit(1);
+    }
+    d->kind = FITTED;
+    while (fgets(line, MAXLINE, f) != NULL) {
+	/* a request may start with the id of the thread that makes it */
+	p = line;
+	if (sscanf(line, "%d%n", &thread, &skip) == 1)
+	    p += skip;
+	if (sscanf(p, "%s %lu %lu", type, &id, &size) < 2 || id >= ids)
+	    continue;
+	i++;
+	if (type[0] == 'f') {
+	    if (lifetimes && born[id] != 0)
+		append(d, i - born[id], &room);
+	    born[id] = 0;
+	} else {
+	    if (!lifetimes)
+		append(d, size, &room);
+	    if (type[0] != 'r' || born[id] == 0)
+		born[id] = i;
+	}
+    }
+    fclose(f);
+    free(born);
+    if (d->n == 0) {
+	fprintf(stderr, "tracegen: %s: nothing to fit\n", path);
+	exit(1);
+    }
+}
+
+/*
+ * parse_dist - read a distribution from the command line
+ */
+static void parse_dist(dist_t *d, char *arg, int lifetimes)
+{
+    char *colon = strchr(arg, ':');
+    int n;
+
+    memset(d, 0, sizeof(*d));
+    if (colon == NULL)
+	goto bad;
+    if (strncmp(arg, "fit:", 4) == 0) {
+	fit(d, colon + 1, lifetimes);
+	return;
+    }
+    n = sscanf(colon + 1, "%lf:%lf:%lf", &d->a, &d->b, &d->p);
+    if (strncmp(arg, "uniform:", 8) == 0 && n == 2 && d->a >= 0 &&
+	d->b >= d->a)
+	d->kind = UNIFORM;
+    else if (strncmp(arg, "lognormal:", 10) == 0 && n == 2 && d->a > 0 &&
+	     d->b >= 0)
+	d->kind = LOGNORMAL;
+    else if (strncmp(arg, "bimodal:", 8) == 0 && n == 3 && d->a >= 0 &&
+	     d->b >= 0 && d->p >= 0 && d->p <= 1)
+	d->kind = BIMODAL;
+    else if (strncmp(arg, "exp:", 4) == 0 && n == 1 && d->a > 0)
+	d->kind = EXP;
+    else if (strncmp(arg, "pareto:", 7) == 0 && n == 2 && d->a > 0 &&
+	     d->b > 0)
+	d->kind = PARETO;
+    else
+	goto bad;
+    return;
+
+ bad:
+    fprintf(stderr, "tracegen: bad distribution \"%s\"\n", arg);
+    usage();
+    exit(1);
+}
+
+/*
+ * push, pop - the event heap, soonest first
+ */
+static void push(uint64_t time, uint32_t id)
+{
+    size_t i = num_events++, parent;
+
+    while (i > 0 && events[parent = (i - 1) / 2].time > time) {
+	events[i] = events[parent];
+	i = parent;
+    }
+    events[i].time = time;
+    events[i].id = id;
+}
+
+static event_t pop(void)
+{
+    event_t top = events[0], last = events[--num_events];
+    size_t i = 0, child;
+
+    while ((child = 2 * i + 1) < num_events) {
+	if (child + 1 < num_events && events[child + 1].time < events[child].time)
+	    child++;
+	if (events[child].time >= last.time)
+	    break;
+	events[i] = events[child];
+	i = child;
+    }
+    events[i] = last;
+    return top;
+}
+
+/*
+ * new_id - an id for a new block, reusing a freed one if there is one
+ */
+static uint32_t new_id(void)
+{
+    if (num_free_ids > 0)
+	return free_ids[--num_free_ids];
+    if (num_ids == UINT32_MAX) {
+	fprintf(stderr, "tracegen: more than %u live blocks\n", UINT32_MAX);
+	exit(1);
+    }
+    if (num_ids == max_ids) {
+	max_ids = max_ids ? 2 * max_ids : 1024;
+	if ((blocks = realloc(blocks, max_ids * sizeof(block_t))) == NULL ||
+	    (free_ids = realloc(free_ids, max_ids * sizeof(uint32_t))) == NULL ||
+	    (events = realloc(events, max_ids * sizeof(event_t))) == NULL) {
+	    perror("realloc");
+	    exit(1);
+	}
+    }
+    return num_ids++;
+}
+
+/*
+ * emit - write a request
+ */
+static void emit(int op, uint32_t id, uint64_t size)
+{
+    bintrace_record_t r;
+    int failed;
+
+    if (binary) {
+	memset(&r, 0, sizeof(r));
+	r.size = size;
+	r.id = id;
+	r.op = op;
+	failed = fwrite(&r, sizeof(r), 1, out) != 1;
+    } else if (op == BINTRACE_FREE) {
+	failed = fprintf(out, "f %u\n", id) < 0;
+    } else {
+	failed = fprintf(out, "%c %u %lu\n", op == REALLOC ? 'r' : 'a', id,
+			 (unsigned long)size) < 0;
+    }
+    if (failed) {
+	perror(out_path);
+	exit(1);
+    }
+    num_ops++;
+}
+
+/*
+ * allocate - make a new block in phase ph
+ */
+static void allocate(phase_t *ph)
+{
+    uint32_t id = new_id();
+    block_t *b = &blocks[id];
+    double size = sample(&ph->size), life = sample(&ph->life);
+
+    b->size = size < 1 ? 1 : size > MAX_SIZE ? MAX_SIZE : size;
+    life = life < 1 ? 1 : life > 1e18 ? 1e18 : life;
+    b->death = num_ops + (uint64_t)life;
+    b->steps = grow_p > 0 && random01() < grow_p ? grow_steps : 0;
+    b->interval = (uint64_t)life / (b->steps + 1);
+    if (b->interval == 0)
+	b->steps = 0;
+    emit(BINTRACE_ALLOC, id, b->size);
+    live += b->size;
+    if (live > peak)
+	peak = live;
+    push(b->steps > 0 ? num_ops + b->interval : b->death, id);
+}
+
+/*
+ * release - free block id
+ */
+static void release(uint32_t id)
+{
+    emit(BINTRACE_FREE, id, 0);
+    live -= blocks[id].size;
+    free_ids[num_free_ids++] = id;
+}
+
+/*
+ * grow - realloc block id to a larger size
+ */
+static void grow(uint32_t id)
+{
+    block_t *b = &blocks[id];
+    double size = b->size * grow_factor;
+    uint32_t to = id;
+
+    live -= b->size;
+    b->size = size < 1 ? 1 : size > MAX_SIZE ? MAX_SIZE : size;
+    b->steps--;
+    if (split_reallocs) {
+	to = new_id();
+	b = &blocks[id];             /* new_id may have moved the table */
+	blocks[to] = *b;
+	emit(BINTRACE_ALLOC, to, b->size);
+	emit(BINTRACE_FREE, id, 0);
+	free_ids[num_free_ids++] = id;
+	b = &blocks[to];
+    } else {
+	emit(REALLOC, id, b->size);
+    }
+    live += b->size;
+    if (live > peak)
+	peak = live;
+    num_reallocs++;
+    push(b->steps > 0 ? num_ops + b->interval : b->death, to);
+}
+
+/*
+ * write_header - write (or, at the end, rewrite) the trace's header
+ */
+static void write_header(void)
+{
+    bintrace_header_t header;
+    int failed;
+
+    if (binary) {
+	memset(&header, 0, sizeof(header));
+	header.magic = BINTRACE_MAGIC;
+	header.heap_size = peak;
+	header.num_ids = num_ids;
+	header.num_ops = num_ops;
+	header.weight = 1;
+	header.num_threads = 1;
+	failed = fwrite(&header, sizeof(header), 1, out) != 1;
+    } else {
+	/* fixed width, so it can be rewritten in place */
+	failed = fprintf(out, "%20lu\n%20lu\n%20lu\n1\n", (unsigned long)peak,
+			 (unsigned long)num_ids, (unsigned long)num_ops) < 0;
+    }
+    if (failed) {
+	perror(out_path);
+	exit(1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static char buf[1 << 20];
+    phase_t *ph;
+    event_t e;
+    int c;
+
+    while ((c = getopt(argc, argv, "abhn:s:l:H:r:S:")) != EOF) {
+	switch (c) {
+	case 'a':
+	    split_reallocs = 1;
+	    break;
+	case 'b':
+	    binary = split_reallocs = 1;
+	    break;
+	case 'n':
+	    num_requests = strtoull(optarg, NULL, 0);
+	    break;
+	case 's':
+	    if (num_phases == MAX_PHASES) {
+		fprintf(stderr, "tracegen: at most %d phases\n", MAX_PHASES);
+		exit(1);
+	    }
+	    ph = &phases[num_phases++];
+	    parse_dist(&ph->size, optarg, 0);
+	    if (num_phases > 1)
+		ph->life = phases[num_phases - 2].life;
+	    else
+		parse_dist(&ph->life, "exp:1000", 1);
+	    break;
+	case 'l':
+	    if (num_phases == 0)
+		parse_dist(&phases[num_phases++].size, "lognormal:64:1", 0);
+	    parse_dist(&phases[num_phases - 1].life, optarg, 1);
+	    break;
+	case 'H':
+	    target = strtoull(optarg, NULL, 0);
+	    break;
+	case 'r':
+	    if (sscanf(optarg, "%lf:%lf:%u", &grow_p, &grow_factor,
+		       &grow_steps) < 1 || grow_p < 0 || grow_p > 1 ||
+		grow_factor <= 0) {
+		usage();
+		exit(1);
+	    }
+	    break;
+	case 'S':
+	    seed = strtoull(optarg, NULL, 0) * 2 + 1;   /* never 0 */
+	    break;
+	case 'h':
+	    usage();
+	    exit(0);
+	default:
+	    usage();
+	    exit(1);
+	}
+    }
+    if (optind != argc - 1) {
+	usage();
+	exit(1);
+    }
+    if (num_phases == 0) {
+	parse_dist(&phases[0].size, "lognormal:64:1", 0);
+	parse_dist(&phases[0].life, "exp:1000", 1);
+	num_phases = 1;
+    }
+
+    out_path = argv[optind];
+    if ((out = fopen(out_path, "w")) == NULL) {
+	perror(out_path);
+	exit(1);
+    }
+    setvbuf(out, buf, _IOFBF, sizeof(buf));
+    write_header();
+    num_ops = 0;
+
+    while (num_ops < num_requests) {
+	ph = &phases[num_ops * num_phases / num_requests];
+	if (num_events > 0 &&
+	    (events[0].time <= num_ops || (target > 0 && live >= target))) {
+	    e = pop();
+	    if (e.time <= num_ops && blocks[e.id].steps > 0)
+		grow(e.id);
+	    else
+		release(e.id);
+	} else {
+	    allocate(ph);
+	}
+    }
+    while (num_events > 0)
+	release(pop().id);
+
+    if (fseek(out, 0, SEEK_SET) < 0) {
+	perror(out_path);
+	exit(1);
+    }
+    write_header();
+    if (fclose(out) != 0) {
+	perror(out_path);
+	exit(1);
+    }
+    fprintf(stderr, "tracegen: %d phases, %lu requests, %u ids, "
+	    "%lu reallocs, peak live %lu bytes\n", num_phases,
+	    (unsigned long)num_ops, num_ids, (unsigned long)num_reallocs,
+	    (unsigned long)peak);
+    exit(0);
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: tracegen [-abh] [-n <requests>] [-s <sizes> "
+	    "[-l <lifetimes>]]...\n\t\t[-H <bytes>] [-r <p>[:<factor>"
+	    "[:<steps>]]] [-S <seed>] <trace>\n");
+    fprintf(stderr, "Writes a synthetic trace for mdriver.\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-a         Write reallocs as an allocation and a free.\n");
+    fprintf(stderr, "\t-b         Write a binary trace (see bintrace.h); implies -a.\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-H <bytes> Keep the live bytes under <bytes> "
+	    "(default: no limit).\n");
+    fprintf(stderr, "\t-l <dist>  Lifetimes in requests, for the last "
+	    "phase (default exp:1000).\n");
+    fprintf(stderr, "\t-n <requests> Requests before the final frees "
+	    "(default 100000).\n");
+    fprintf(stderr, "\t-r <p>:<factor>:<steps> Grow a fraction <p> of the "
+	    "blocks <steps> times\n\t           by <factor> over their life "
+	    "(default 0:2:4).\n");
+    fprintf(stderr, "\t-s <dist>  Block sizes; each -s starts a phase "
+	    "(default lognormal:64:1).\n");
+    fprintf(stderr, "\t-S <seed>  Seed the random numbers (default 0).\n");
+    fprintf(stderr, "Distributions: uniform:<min>:<max> lognormal:<median>:"
+	    "<sigma>\n\tbimodal:<a>:<b>:<p> exp:<mean> pareto:<min>:<alpha> "
+	    "fit:<trace.rep>\n");
+}